@@ -0,0 +1,225 @@
+// Compares RLEFrame.encodeRuns against the previous, iterable based RLE
+// encoder, and against palette encoding (PaletteFrame.encode) and LZ
+// encoding (LZFrame.encode).
+//
+// For the decode side, see flrd_codec_bench in flutterino_esp32/host.
+//
+// Run using:
+//
+//   flutter test benchmark/rle_benchmark.dart
+//
+// By default, this synthesizes frames of a watch-like UI. To use captured
+// frames instead, set FLRD_BENCH_FRAMES to a directory of raw little endian
+// RGB565 frames (FLRD_BENCH_WIDTH x FLRD_BENCH_HEIGHT pixels, 240x240 by
+// default), e.g. dumped from BluetoothDisplayConnection.addFrame.
+import 'dart:io';
+import 'dart:math' as math;
+import 'dart:typed_data';
+
+import 'package:flutter_remote_display/flutter_remote_display.dart';
+import 'package:flutter_remote_display/src/protocol.dart';
+import 'package:flutter_test/flutter_test.dart';
+
+const _iterations = 50;
+
+/// The encoder RLEKeyFramePacket used before RLEFrame.encodeRuns.
+///
+/// Allocates a record per run, a list per row and chains the rows using
+/// followedBy. The runs are then iterated twice, once for the run count.
+Iterable<(int, int)> _legacyBuildRunsForRow(Iterable<int> pixels) {
+  final runs = <(int, int)>[];
+
+  var run = (1, pixels.first);
+
+  final it = pixels.skip(1).iterator;
+  while (it.moveNext()) {
+    final next = it.current;
+
+    if (next != run.$2) {
+      runs.add(run);
+
+      run = (0, next);
+    }
+
+    run = (run.$1 + 1, run.$2);
+  }
+
+  runs.add(run);
+
+  return runs;
+}
+
+Iterable<(int, int)> _legacyBuildRuns(ImageData image) {
+  var runs = _legacyBuildRunsForRow(image.getRow(0));
+
+  for (var y = 1; y < image.height; y++) {
+    runs = runs.followedBy(_legacyBuildRunsForRow(image.getRow(y)));
+  }
+
+  return runs;
+}
+
+int _legacyEncode(ImageData image, Uint8List into) {
+  final runs = _legacyBuildRuns(image);
+
+  var offset = 0;
+  into[offset++] = runs.length & 0xFF;
+  into[offset++] = runs.length >> 8;
+
+  for (final (length, color) in runs) {
+    into[offset++] = length;
+    into[offset++] = color & 0xFF;
+    into[offset++] = color >> 8;
+  }
+
+  return offset;
+}
+
+List<ImageData> _loadFrames(String path, int width, int height) {
+  final files = Directory(path).listSync().whereType<File>().toList()
+    ..sort((a, b) => a.path.compareTo(b.path));
+
+  return [
+    for (final file in files)
+      ImageData(
+        file.readAsBytesSync(),
+        format: PixelFormat.rgb565,
+        width: width,
+        height: height,
+      ),
+  ];
+}
+
+/// A dark background, a few lines of "text" and a moving second hand.
+ImageData _synthesizeFrame(int width, int height, int frame, List<int> glyphs) {
+  final pixels = Uint16List(width * height);
+
+  for (var line = 0; line < 4; line++) {
+    final top = 40 + line * 40;
+
+    for (var y = top; y < top + 16 && y < height; y++) {
+      for (var x = 20; x < width - 20; x++) {
+        final glyph = glyphs[(x ~/ 8 + line * 7 + frame) % glyphs.length];
+        final bit = (glyph >> ((x % 8) + (y - top) % 8)) & 1;
+        pixels[y * width + x] = bit != 0 ? 0xFFFF : 0x0841;
+      }
+    }
+  }
+
+  final angle = frame * math.pi / 30;
+  for (var r = 0; r < math.min(width, height) ~/ 2 - 4; r++) {
+    final x = width ~/ 2 + (r * math.sin(angle)).round();
+    final y = height ~/ 2 - (r * math.cos(angle)).round();
+    pixels[y * width + x] = 0xF800;
+  }
+
+  return ImageData(
+    pixels.buffer.asUint8List(),
+    format: PixelFormat.rgb565,
+    width: width,
+    height: height,
+  );
+}
+
+List<ImageData> _synthesizeFrames(int width, int height, int nFrames) {
+  final random = math.Random(42);
+  final glyphs = List.generate(64, (_) => random.nextInt(1 << 16));
+
+  return [
+    for (var frame = 0; frame < nFrames; frame++)
+      _synthesizeFrame(width, height, frame, glyphs),
+  ];
+}
+
+({double microseconds, int bytes}) _measure(
+  List<ImageData> frames,
+  Uint8List into,
+  int Function(ImageData, Uint8List) encode,
+) {
+  var bytes = 0;
+
+  // warm up
+  for (final frame in frames) {
+    encode(frame, into);
+  }
+
+  final watch = Stopwatch()..start();
+  for (var i = 0; i < _iterations; i++) {
+    for (final frame in frames) {
+      bytes += encode(frame, into);
+    }
+  }
+  watch.stop();
+
+  final nEncoded = _iterations * frames.length;
+  return (
+    microseconds: watch.elapsedMicroseconds / nEncoded,
+    bytes: bytes ~/ nEncoded,
+  );
+}
+
+void main() {
+  test('RLE encode benchmark', () {
+    final env = Platform.environment;
+    final width = int.parse(env['FLRD_BENCH_WIDTH'] ?? '240');
+    final height = int.parse(env['FLRD_BENCH_HEIGHT'] ?? '240');
+    final framesPath = env['FLRD_BENCH_FRAMES'];
+
+    final frames = framesPath != null
+        ? _loadFrames(framesPath, width, height)
+        : _synthesizeFrames(width, height, 60);
+
+    final into = Uint8List(RLEFrame.maxEncodedLength(width * height));
+
+    var nRuns = 0;
+    for (final frame in frames) {
+      nRuns += _legacyBuildRuns(frame).length;
+    }
+
+    final legacy = _measure(frames, into, _legacyEncode);
+    final current = _measure(
+      frames,
+      into,
+      (image, into) => RLEFrame.encodeRuns(image, into),
+    );
+
+    final palette = _measure(frames, into, (image, into) {
+      final encoded = PaletteFrame.encode(
+        image,
+        [IntRect.fromLTWH(0, 0, image.width, image.height)],
+      );
+      if (encoded == null) {
+        return RLEFrame.encodeRuns(image, into);
+      }
+
+      final (colors, indices) = encoded;
+      return colors.encodedLength + indices.single.length;
+    });
+
+    // into is big enough, LZ never takes more than 2 bytes per pixel plus
+    // a little.
+    final lz = _measure(
+      frames,
+      into,
+      (image, into) => LZFrame.encode(image, into),
+    );
+
+    // The legacy encoder allocates one record per run, plus a list, a
+    // skip and a followedBy iterable per row. encodeRuns allocates nothing
+    // besides a typed data view of the frame.
+    final legacyAllocations = nRuns ~/ frames.length + 3 * height;
+
+    // ignore: avoid_print
+    print(
+      '${frames.length} frames, ${width}x$height\n'
+      'legacy:     ${legacy.microseconds.toStringAsFixed(1)} us/frame, '
+      '${legacy.bytes} bytes/frame, ~$legacyAllocations objects/frame\n'
+      'encodeRuns: ${current.microseconds.toStringAsFixed(1)} us/frame, '
+      '${current.bytes} bytes/frame, 1 object/frame\n'
+      'palette:    ${palette.microseconds.toStringAsFixed(1)} us/frame, '
+      '${palette.bytes} bytes/frame (RLE if more than 256 colors)\n'
+      'LZ:         ${lz.microseconds.toStringAsFixed(1)} us/frame, '
+      '${lz.bytes} bytes/frame',
+    );
+  });
+}
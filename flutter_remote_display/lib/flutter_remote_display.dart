@@ -1,4 +1,10 @@
 export 'src/display.dart';
-export 'src/remote_view.dart';
+export 'src/remote_view.dart' hide CaptureBoundary, RenderCaptureBoundary;
 export 'src/bluetooth_display.dart';
+export 'src/encoder.dart';
 export 'src/encoding.dart';
+export 'src/damage.dart';
+export 'src/motion.dart';
+export 'src/pacing.dart';
+export 'src/quality.dart';
+export 'src/tiles.dart';
@@ -1,9 +1,9 @@
 import 'dart:async';
+import 'dart:math' as math;
 import 'dart:typed_data';
 
 import 'dart:ui' as ui;
 
-import 'package:buffer/buffer.dart';
 import 'package:flutter/material.dart';
 import 'package:flutter/widgets.dart';
 import 'package:flutter_bluetooth_serial/flutter_bluetooth_serial.dart';
@@ -11,36 +11,184 @@ import 'package:flutter_remote_display/flutter_remote_display.dart';
 import 'package:flutter_remote_display/src/protocol.dart';
 
 class BluetoothDisplayConnection extends DisplayConnection {
-  BluetoothDisplayConnection._(this._connection)
-      : _inputController = StreamController.broadcast() {
-    _connectionSub = _connection.input!.listen((data) {
-      final reader = ByteDataReader(endian: Endian.little);
-      reader.add(data);
-
-      while (reader.remainingLength > 0) {
-        /// FIXME: If the packet needs more data than we have available,
-        /// we should wait for more data to arrive before trying to read
-        /// the packet.
-        final packet = DisplayToHostPacket.readPacket(reader);
-        _inputController.add(packet);
-      }
-    });
+  BluetoothDisplayConnection._(
+    this._connection, {
+    required this.quality,
+    required this.dither,
+    required this.adaptiveQuality,
+    required int maxFramesInFlight,
+    required double? targetFps,
+  }) : _inputController = StreamController.broadcast() {
+    _pipeline = FramePipeline(
+      send: _sendFrame,
+      merge: _mergeFrames,
+      maxFramesInFlight: maxFramesInFlight,
+      targetFps: targetFps,
+    );
+
+    _connectionSub = _connection.input!.listen(_parser.add);
   }
 
   final BluetoothConnection _connection;
   late final StreamSubscription _connectionSub;
   final StreamController<DisplayToHostPacket> _inputController;
+  late final _parser = DisplayToHostParser(_onPacket);
+
+  /// Completes with the device's answer to the [QueryDeviceInfoPacket] sent
+  /// while connecting.
+  final _deviceInfoCompleter = Completer<DeviceInfoPacket>();
+
+  /// How long to wait for the device info before assuming the device
+  /// doesn't send it (firmware predating it), and supports nothing optional.
+  static const _deviceInfoTimeout = Duration(seconds: 2);
 
   var _isClosed = false;
-  ImageData? _previousImageData;
 
+  /// Frames waiting to be encoded, and the regions that changed since the
+  /// last frame (or null if unknown).
+  late final FramePipeline<(ImageData, List<IntRect>?)> _pipeline;
+
+  /// Completes once the last added frame was read back.
+  Future<void> _lastRead = Future.value();
+
+  /// Whether a frame couldn't be read back, so the damaged regions of the
+  /// next one are incomplete.
+  var _lostFrame = false;
+
+  /// Encodes frames on top of what the device shows.
+  late final FrameEncoderIsolate _encoder;
+
+  /// Whether the last frame the encoder sent was lossy, i.e. the device
+  /// shows areas that need a refresh.
+  var _showsLossy = false;
+  Timer? _refreshTimer;
+
+  /// Writes that weren't sent yet, the bytes written since the link was
+  /// last idle, and how long it's been busy since.
+  var _writesInFlight = 0;
+  var _busyBytes = 0;
+  final _busy = Stopwatch();
+
+  /// What the device reported about itself while connecting, or null if it
+  /// didn't answer.
+  DeviceInfoPacket? get deviceInfo => _deviceInfo;
+  late final DeviceInfoPacket? _deviceInfo;
+
+  /// Whether scrolled content is copied on the device instead of being
+  /// resent, see [CopyRectsFramePacket].
+  ///
+  /// Only enabled if the device reported that it supports it, see
+  /// [DeviceInfoPacket.supportsCopyRects].
+  bool get copyRects => _copyRects;
+  late final bool _copyRects;
+
+  /// The number of tiles the device caches, or 0 if content that was sent
+  /// before isn't drawn from the device's tile cache, see [TileCache].
+  ///
+  /// At most the number of slots the device reported, see
+  /// [DeviceInfoPacket.tileCacheSlots].
+  int get tileCacheSlots => _tileCacheSlots;
+  late final int _tileCacheSlots;
+
+  /// Whether content that was sent before is drawn from the device's tile
+  /// cache instead of being resent.
+  bool get tileCache => tileCacheSlots > 0;
+
+  /// The quality frames are sent with, or null to pick it for every frame
+  /// with [adaptiveQuality].
+  FrameQuality? quality;
+
+  /// Whether lossy frames are dithered, see [FrameQuality.apply].
+  bool dither;
+
+  /// Measures the throughput of the link, and picks the quality of frames
+  /// unless [quality] is set.
+  final AdaptiveQuality adaptiveQuality;
+
+  /// The maximum number of frames sent per second, or null to send frames
+  /// as fast as the link takes them, see [FramePipeline].
+  double? get targetFps => _pipeline.targetFps;
+  set targetFps(double? targetFps) => _pipeline.targetFps = targetFps;
+
+  /// The number of frames that were dropped, because a newer frame was
+  /// added before they could be sent.
+  int get supersededFrames => _pipeline.supersededFrames;
+
+  /// Connects to the device at [bluetoothAddress], and asks it what it
+  /// supports.
+  ///
+  /// Scrolled content is copied on the device if [copyRects] is set and the
+  /// device supports it. Up to [tileCacheSlots] of the device's tile cache
+  /// slots are used, or all of them if null.
   static Future<BluetoothDisplayConnection> connect(
-      String bluetoothAddress) async {
+    String bluetoothAddress, {
+    bool copyRects = true,
+    int? tileCacheSlots,
+    FrameQuality? quality,
+    bool dither = false,
+    AdaptiveQuality? adaptiveQuality,
+    int maxFramesInFlight = 2,
+    double? targetFps,
+  }) async {
     final conn = await BluetoothConnection.toAddress(bluetoothAddress);
 
     debugPrint('connected to bluetooth display $bluetoothAddress: $conn');
 
-    return BluetoothDisplayConnection._(conn);
+    final display = BluetoothDisplayConnection._(
+      conn,
+      quality: quality,
+      dither: dither,
+      adaptiveQuality: adaptiveQuality ?? AdaptiveQuality(),
+      maxFramesInFlight: maxFramesInFlight,
+      targetFps: targetFps,
+    );
+
+    try {
+      final deviceInfo = await display._queryDeviceInfo();
+      display._deviceInfo = deviceInfo;
+      display._copyRects =
+          copyRects && (deviceInfo?.supportsCopyRects ?? false);
+      display._tileCacheSlots = math.min(
+        tileCacheSlots ?? TileOp.storeFlag,
+        deviceInfo?.tileCacheSlots ?? 0,
+      );
+
+      display._encoder = await FrameEncoderIsolate.spawn(
+        copyRects: display.copyRects,
+        tileCacheSlots: display.tileCacheSlots,
+      );
+    } catch (_) {
+      await display._connectionSub.cancel();
+      await conn.close();
+      rethrow;
+    }
+
+    return display;
+  }
+
+  /// Asks the device what it supports, or returns null if it doesn't
+  /// answer in time.
+  Future<DeviceInfoPacket?> _queryDeviceInfo() async {
+    await addPacket(QueryDeviceInfoPacket());
+
+    try {
+      return await _deviceInfoCompleter.future.timeout(_deviceInfoTimeout);
+    } on TimeoutException {
+      return null;
+    }
+  }
+
+  void _onPacket(DisplayToHostPacket packet) {
+    switch (packet) {
+      case DeviceInfoPacket():
+        if (!_deviceInfoCompleter.isCompleted) {
+          _deviceInfoCompleter.complete(packet);
+        }
+      case KeyframeRequestPacket():
+        _resync();
+      default:
+        _inputController.add(packet);
+    }
   }
 
   bool get isConnected => _connection.isConnected;
@@ -57,57 +205,184 @@ class BluetoothDisplayConnection extends DisplayConnection {
     }
   }
 
-  Future<ImageData> _getImageData(ui.Image image) async {
-    return (await ImageData.fromDartUIImage(image)).toRGB565();
-  }
-
   /// Sends a frame to the target device.
   ///
+  /// Frames are paced by [FramePipeline], and encoded by a
+  /// [FrameEncoderIsolate]. The returned future completes once the frame
+  /// is out, or when it was superseded by a newer frame.
+  ///
   /// Callers can free the image immediately after return using
   /// [ui.Image.dispose].
   @override
-  Future<void> addFrame(ui.Image frame) async {
+  Future<void> addFrame(
+    ui.Image frame, {
+    Iterable<IntRect>? damagedRegions,
+  }) async {
     _checkOpen();
     _checkConnected();
 
     frame = frame.clone();
 
-    var imageData = await _getImageData(frame);
+    // Only the pixels are read here, converting them is up to the encoder.
+    final previousRead = _lastRead;
+    final read = ImageData.fromDartUIImage(frame).whenComplete(frame.dispose);
+    _lastRead = read.then((_) {}, onError: (_) {
+      _lostFrame = true;
+    });
+
+    final imageData = await read;
+
+    // Reading back may finish out of order, but frames must be queued in
+    // order, since their damaged regions are relative to the last frame.
+    await previousRead;
     _checkConnected();
 
-    frame.dispose();
+    if (_isClosed) {
+      return;
+    }
+
+    final regions = _lostFrame ? null : damagedRegions?.toList();
+    _lostFrame = false;
 
-    imageData = imageData.convert(PixelFormat.rgb565);
+    return await _pipeline.add((imageData, regions));
+  }
+
+  static (ImageData, List<IntRect>?) _mergeFrames(
+    (ImageData, List<IntRect>?) superseded,
+    (ImageData, List<IntRect>?) frame,
+  ) {
+    final (_, supersededRegions) = superseded;
+    final (imageData, regions) = frame;
 
-    final packet = FramePacket.build(
+    return (
       imageData,
-      old: _previousImageData,
-      pixelFormat: PixelFormat.rgb565,
+      supersededRegions != null && regions != null
+          ? [...supersededRegions, ...regions]
+          : null,
     );
+  }
+
+  Future<void> _sendFrame((ImageData, List<IntRect>?) frame) async {
+    final (imageData, damagedRegions) = frame;
+
+    final encoded = await _encoder.encode(
+      imageData,
+      quality: quality,
+      dither: dither,
+      maxBytes: adaptiveQuality.maxFrameBytes,
+      damagedRegions: damagedRegions,
+    );
+
+    // Unchanged frames leave the device as it is, but still postpone the
+    // refresh until frames stop coming.
+    if (encoded != null) {
+      _showsLossy = !encoded.isLossless;
+    }
+    _scheduleRefresh();
 
-    if (packet != null) {
-      final future = addPacket(packet);
-      _previousImageData = imageData;
-      return await future;
+    if (encoded != null) {
+      await _send(encoded.bytes);
     }
   }
 
-  Future<void> addPacket(HostToDisplayPacket packet) async {
+  /// Refreshes the lossy areas once no frame was sent for
+  /// [AdaptiveQuality.idleRefreshDelay], if there are any.
+  void _scheduleRefresh() {
+    _refreshTimer?.cancel();
+    _refreshTimer = null;
+
+    if (_showsLossy && !_isClosed) {
+      _refreshTimer = Timer(adaptiveQuality.idleRefreshDelay, _refresh);
+    }
+  }
+
+  Future<void> _send(Uint8List bytes) async {
+    // allSent also waits for writes queued before this one, so the link is
+    // measured from when it became busy until it's idle again, with all
+    // bytes written meanwhile.
+    if (_writesInFlight == 0) {
+      _busy
+        ..reset()
+        ..start();
+      _busyBytes = 0;
+    }
+
+    _writesInFlight++;
+    _busyBytes += bytes.length;
+
+    var sent = false;
+    try {
+      await _addBytes(bytes);
+      sent = true;
+    } finally {
+      _writesInFlight--;
+
+      if (_writesInFlight == 0 && sent) {
+        adaptiveQuality.addSample(_busyBytes, _busy.elapsed);
+      }
+    }
+  }
+
+  /// Resends the areas that were sent lossy, once the link is idle.
+  Future<void> _refresh() async {
+    if (_isClosed || !isConnected) {
+      return;
+    }
+
+    if (!_pipeline.isIdle) {
+      _refreshTimer = Timer(adaptiveQuality.idleRefreshDelay, _refresh);
+      return;
+    }
+
+    // Frames added meanwhile are encoded after the refresh, and their
+    // bytes sent after it.
+    final frame = await _encoder.refresh();
+    _showsLossy = false;
+
+    if (frame != null && !_isClosed) {
+      await _send(frame.bytes);
+    }
+  }
+
+  /// Resends the last frame as a keyframe, because the device couldn't
+  /// apply a frame, and shows something else than the encoder assumes.
+  Future<void> _resync() async {
+    if (_isClosed || !isConnected) {
+      return;
+    }
+
+    debugPrint('bluetooth display requested a keyframe');
+
+    // Like for refreshes, frames added meanwhile are encoded on top of it.
+    final frame = await _encoder.keyframe();
+    _showsLossy = false;
+
+    if (frame != null && !_isClosed) {
+      await _send(frame.bytes);
+    }
+  }
+
+  Future<void> _addBytes(Uint8List bytes) async {
     _checkOpen();
     _checkConnected();
 
-    final bytes = packet.toBytes();
-
     _connection.output.add(bytes);
 
     return await _connection.output.allSent;
   }
 
+  Future<void> addPacket(HostToDisplayPacket packet) async {
+    return await _addBytes(packet.toBytes());
+  }
+
   @override
   Future<void> close() async {
     _checkOpen();
 
     _isClosed = true;
+    _pipeline.close();
+    _refreshTimer?.cancel();
+    _encoder.close();
     await _connection.close();
   }
 
@@ -0,0 +1,319 @@
+import 'dart:math' as math;
+import 'dart:typed_data';
+
+import 'package:flutter_remote_display/src/encoding.dart';
+
+class _TileRect {
+  _TileRect(this.left, this.top, this.right, this.bottom);
+
+  int left;
+  int top;
+  int right;
+  int bottom;
+
+  int get area => (right - left) * (bottom - top);
+}
+
+/// Finds damaged regions of a frame on a fixed grid of tiles, and merges
+/// the damaged tiles into a few non-overlapping rects.
+///
+/// Damaged tiles in a tile row are first joined into horizontal spans, then
+/// spans are merged greedily into the rects of the tile row above. Two
+/// regions are only merged if that's cheaper according to a simple cost
+/// model: every rect costs [rectCost] bytes (rect header, run count and
+/// setting the window on the device), and every pixel costs [pixelCost]
+/// bytes.
+///
+/// Keeps the tile bitmap around between frames, so it's best to use one
+/// tracker per connection.
+class TileDamageTracker {
+  TileDamageTracker({
+    this.tileSize = 16,
+    this.rectCost = 16,
+    this.pixelCost = 1,
+  }) : assert(tileSize > 0);
+
+  /// Width and height of a tile, in pixels.
+  final int tileSize;
+
+  /// Estimated cost of every rect, in bytes.
+  final int rectCost;
+
+  /// Estimated cost of every pixel (damaged or not) in a rect, in bytes.
+  final int pixelCost;
+
+  var _tileColumns = 0;
+  var _tileRows = 0;
+  /// 1 for damaged tiles, 0 for clean ones, and [_skipped] for tiles that
+  /// aren't compared.
+  var _dirty = Uint8List(0);
+  static const _skipped = 2;
+  var _owner = Int32List(0);
+
+  int _cost(_TileRect rect) {
+    return rectCost + rect.area * tileSize * tileSize * pixelCost;
+  }
+
+  /// Marks the tiles outside of [regions] as clean, so they're skipped by
+  /// [_markDirtyTiles].
+  void _skipTilesOutside(Iterable<IntRect> regions) {
+    _dirty.fillRange(0, _dirty.length, _skipped);
+
+    for (final region in regions) {
+      final left = math.max(region.left ~/ tileSize, 0);
+      final top = math.max(region.top ~/ tileSize, 0);
+      final right = math.min(
+        (region.right + tileSize - 1) ~/ tileSize,
+        _tileColumns,
+      );
+      final bottom = math.min(
+        (region.bottom + tileSize - 1) ~/ tileSize,
+        _tileRows,
+      );
+
+      for (var ty = top; ty < bottom && left < right; ty++) {
+        final row = ty * _tileColumns;
+        _dirty.fillRange(row + left, row + right, 0);
+      }
+    }
+  }
+
+  void _markDirtyTiles(ImageData oldImage, ImageData newImage) {
+    final bpp = oldImage.bpp;
+    final width = oldImage.width;
+    final height = oldImage.height;
+
+    final oldBytes = oldImage.bytes;
+    final newBytes = newImage.bytes;
+    final oldStride = oldImage.stride;
+    final newStride = newImage.stride;
+    final tileBytes = tileSize * bpp;
+
+    final useWords = oldBytes.offsetInBytes % 8 == 0 &&
+        newBytes.offsetInBytes % 8 == 0 &&
+        oldStride % 8 == 0 &&
+        newStride % 8 == 0 &&
+        tileBytes % 8 == 0;
+
+    final oldWords = useWords
+        ? oldBytes.buffer.asUint64List(
+            oldBytes.offsetInBytes,
+            oldBytes.length ~/ 8,
+          )
+        : null;
+    final newWords = useWords
+        ? newBytes.buffer.asUint64List(
+            newBytes.offsetInBytes,
+            newBytes.length ~/ 8,
+          )
+        : null;
+
+    for (var y = 0; y < height; y++) {
+      final oldRow = y * oldStride;
+      final newRow = y * newStride;
+      final tileRow = (y ~/ tileSize) * _tileColumns;
+
+      for (var tx = 0; tx < _tileColumns; tx++) {
+        if (_dirty[tileRow + tx] != 0) {
+          continue;
+        }
+
+        var i = tx * tileBytes;
+        final end = math.min(width * bpp, i + tileBytes);
+
+        if (useWords) {
+          final wordEnd = end & ~7;
+
+          while (i < wordEnd &&
+              oldWords![(oldRow + i) >> 3] == newWords![(newRow + i) >> 3]) {
+            i += 8;
+          }
+        }
+
+        while (i < end && oldBytes[oldRow + i] == newBytes[newRow + i]) {
+          i++;
+        }
+
+        if (i < end) {
+          _dirty[tileRow + tx] = 1;
+        }
+      }
+    }
+
+    for (var i = 0; i < _dirty.length; i++) {
+      if (_dirty[i] == _skipped) {
+        _dirty[i] = 0;
+      }
+    }
+  }
+
+  /// Whether all tiles in [rect] are either unowned or owned by [a] or [b].
+  bool _isFree(_TileRect rect, int a, int b) {
+    for (var ty = rect.top; ty < rect.bottom; ty++) {
+      for (var tx = rect.left; tx < rect.right; tx++) {
+        final owner = _owner[ty * _tileColumns + tx];
+        if (owner != -1 && owner != a && owner != b) {
+          return false;
+        }
+      }
+    }
+
+    return true;
+  }
+
+  void _setOwner(_TileRect rect, int owner) {
+    for (var ty = rect.top; ty < rect.bottom; ty++) {
+      _owner.fillRange(
+        ty * _tileColumns + rect.left,
+        ty * _tileColumns + rect.right,
+        owner,
+      );
+    }
+  }
+
+  List<_TileRect> _mergeTiles() {
+    final rects = <_TileRect>[];
+
+    _owner.fillRange(0, _owner.length, -1);
+
+    // Indices into rects of the rects ending at the current tile row.
+    var open = <int>[];
+
+    for (var ty = 0; ty < _tileRows; ty++) {
+      final spans = <int>[];
+
+      // Join the damaged tiles of this row into spans, bridging clean gaps
+      // where one rect is cheaper than two.
+      _TileRect? span;
+      for (var tx = 0; tx < _tileColumns; tx++) {
+        if (_dirty[ty * _tileColumns + tx] == 0) {
+          continue;
+        }
+
+        if (span != null) {
+          final gap = _TileRect(span.right, ty, tx, ty + 1);
+          if (gap.area == 0 || _cost(gap) - rectCost <= rectCost) {
+            span.right = tx + 1;
+            continue;
+          }
+
+          spans.add(rects.length);
+          rects.add(span);
+        }
+
+        span = _TileRect(tx, ty, tx + 1, ty + 1);
+      }
+
+      if (span != null) {
+        spans.add(rects.length);
+        rects.add(span);
+      }
+
+      for (final index in spans) {
+        _setOwner(rects[index], index);
+      }
+
+      // Merge the spans into the rects above them, where it doesn't make
+      // things more expensive and doesn't overlap any other rect.
+      final nextOpen = <int>[];
+      for (final index in spans) {
+        final rowSpan = rects[index];
+
+        int? bestTarget;
+        var bestSaving = -1;
+
+        for (final target in open) {
+          final rect = rects[target];
+
+          // Only rects that overlap or touch the span horizontally.
+          if (rect.right < rowSpan.left || rect.left > rowSpan.right) {
+            continue;
+          }
+
+          final merged = _TileRect(
+            math.min(rect.left, rowSpan.left),
+            rect.top,
+            math.max(rect.right, rowSpan.right),
+            rowSpan.bottom,
+          );
+
+          final saving = _cost(rect) + _cost(rowSpan) - _cost(merged);
+          if (saving > bestSaving && _isFree(merged, target, index)) {
+            bestTarget = target;
+            bestSaving = saving;
+          }
+        }
+
+        if (bestTarget == null) {
+          nextOpen.add(index);
+          continue;
+        }
+
+        final rect = rects[bestTarget];
+        rect.left = math.min(rect.left, rowSpan.left);
+        rect.right = math.max(rect.right, rowSpan.right);
+        rect.bottom = rowSpan.bottom;
+        _setOwner(rect, bestTarget);
+
+        rects[index] = _TileRect(0, 0, 0, 0);
+        if (!nextOpen.contains(bestTarget)) {
+          nextOpen.add(bestTarget);
+        }
+      }
+
+      open = nextOpen;
+    }
+
+    return rects.where((rect) => rect.area > 0).toList();
+  }
+
+  /// Finds the damaged regions between [oldImage] and [newImage].
+  ///
+  /// If [regions] are given, e.g. the bounds of what was repainted, only
+  /// tiles overlapping them are compared, and the others are assumed to be
+  /// clean.
+  ///
+  /// The returned rects don't overlap, are aligned to the tile grid and
+  /// clipped to the image bounds.
+  List<IntRect> findDamagedRects({
+    required ImageData oldImage,
+    required ImageData newImage,
+    Iterable<IntRect>? regions,
+  }) {
+    // assert image dimensions and bpp are equal
+    assert(oldImage.width == newImage.width);
+    assert(oldImage.height == newImage.height);
+    assert(oldImage.bpp == newImage.bpp);
+
+    final width = oldImage.width;
+    final height = oldImage.height;
+
+    final tileColumns = (width + tileSize - 1) ~/ tileSize;
+    final tileRows = (height + tileSize - 1) ~/ tileSize;
+
+    if (tileColumns != _tileColumns || tileRows != _tileRows) {
+      _tileColumns = tileColumns;
+      _tileRows = tileRows;
+      _dirty = Uint8List(tileColumns * tileRows);
+      _owner = Int32List(tileColumns * tileRows);
+    }
+
+    if (regions != null) {
+      _skipTilesOutside(regions);
+    } else {
+      _dirty.fillRange(0, _dirty.length, 0);
+    }
+
+    _markDirtyTiles(oldImage, newImage);
+
+    return [
+      for (final rect in _mergeTiles())
+        IntRect.fromLTRB(
+          rect.left * tileSize,
+          rect.top * tileSize,
+          math.min(rect.right * tileSize, width),
+          math.min(rect.bottom * tileSize, height),
+        ),
+    ];
+  }
+}
@@ -1,5 +1,6 @@
 import 'dart:ui' as ui;
 
+import 'package:flutter_remote_display/src/encoding.dart';
 import 'package:flutter_remote_display/src/protocol.dart';
 
 class RemoteDisplayException implements Exception {
@@ -23,7 +24,11 @@ abstract class DisplayConnection {
     return input.where((event) => event is TouchEvent).cast<TouchEvent>();
   }
 
-  Future<void> addFrame(ui.Image image);
+  /// Sends [image] to the display.
+  ///
+  /// If [damagedRegions] are given, [image] only differs from the last
+  /// frame inside of them.
+  Future<void> addFrame(ui.Image image, {Iterable<IntRect>? damagedRegions});
 
   void setBacklight(double intensity) {
     return output.add(BacklightPacket(intensity));
@@ -0,0 +1,404 @@
+import 'dart:async';
+import 'dart:isolate';
+import 'dart:typed_data';
+
+import 'package:flutter_remote_display/src/damage.dart';
+import 'package:flutter_remote_display/src/encoding.dart';
+import 'package:flutter_remote_display/src/motion.dart';
+import 'package:flutter_remote_display/src/protocol.dart';
+import 'package:flutter_remote_display/src/quality.dart';
+import 'package:flutter_remote_display/src/tiles.dart';
+
+/// A frame packet, ready to be sent.
+class EncodedFrame {
+  EncodedFrame(this.bytes, {required this.isLossless});
+
+  final Uint8List bytes;
+
+  /// Whether the frame was sent with [FrameQuality.lossless], i.e. the
+  /// device shows exactly the frame that was encoded.
+  final bool isLossless;
+}
+
+/// Encodes frames as the smallest packet on top of what the device shows.
+///
+/// Keeps the reference frame, and the state of the scroll detector and the
+/// tile cache, so every frame it returns must be sent, in order.
+class FrameEncoder {
+  FrameEncoder({this.copyRects = false, int tileCacheSlots = 0})
+      : _tileCache =
+            tileCacheSlots > 0 ? TileCache(slots: tileCacheSlots) : null;
+
+  /// Whether scrolled content is copied on the device instead of being
+  /// resent, see [CopyRectsFramePacket].
+  final bool copyRects;
+
+  final _damageTracker = TileDamageTracker();
+  final _scrollDetector = ScrollDetector();
+  final TileCache? _tileCache;
+
+  /// What the device shows, which is [_targetImage] reduced to the quality
+  /// it was sent with.
+  ImageData? _previousImage;
+
+  /// The last frame, lossless.
+  ImageData? _targetImage;
+
+  /// The quality [_previousImage] was sent with.
+  FrameQuality? _previousQuality;
+
+  /// Encodes [image] on top of the previous frame.
+  ///
+  /// With a [quality], the frame is reduced to it. Otherwise, the quality
+  /// is reduced until the packet fits into [maxBytes], if given (or the
+  /// lowest quality is reached).
+  ///
+  /// If [damagedRegions] are given, [image] is assumed to only differ from
+  /// the last frame inside of them, so the rest isn't compared.
+  ///
+  /// Returns null if nothing changed.
+  EncodedFrame? encode(
+    ImageData image, {
+    FrameQuality? quality,
+    bool dither = false,
+    int? maxBytes,
+    Iterable<IntRect>? damagedRegions,
+  }) {
+    image = image.convert(PixelFormat.rgb565);
+    _targetImage = image;
+
+    final (reduced, sentQuality, packet) = _buildFramePacket(
+      image,
+      qualities: quality != null ? [quality] : FrameQuality.values,
+      dither: dither,
+      maxBytes: maxBytes,
+      damagedRegions: damagedRegions,
+    );
+
+    if (packet == null) {
+      return null;
+    }
+
+    _previousImage = reduced;
+    _previousQuality = sentQuality;
+
+    return EncodedFrame(
+      packet.toBytes(),
+      isLossless: identical(reduced, image),
+    );
+  }
+
+  /// Encodes the areas of the last frame that were sent lossy, lossless.
+  ///
+  /// Returns null if there are none.
+  EncodedFrame? refresh() {
+    final target = _targetImage;
+    final previousImage = _previousImage;
+
+    if (target == null || previousImage == null) {
+      return null;
+    }
+
+    final packet = FramePacket.build(
+      target,
+      old: previousImage,
+      damagedRects: _damageTracker.findDamagedRects(
+        oldImage: previousImage,
+        newImage: target,
+      ),
+      pixelFormat: PixelFormat.rgb565,
+    );
+
+    if (packet == null) {
+      return null;
+    }
+
+    _previousImage = target;
+    _previousQuality = FrameQuality.lossless;
+
+    return EncodedFrame(packet.toBytes(), isLossless: true);
+  }
+
+  /// Encodes the last frame as a keyframe, lossless, for when the device
+  /// couldn't apply a frame and asked for one, see [KeyframeRequestPacket].
+  ///
+  /// The device's tile cache may have stored wrong pixels since, so the
+  /// tiles are forgotten as well.
+  ///
+  /// Returns null if no frame was encoded yet.
+  EncodedFrame? keyframe() {
+    final target = _targetImage;
+
+    if (target == null) {
+      return null;
+    }
+
+    _tileCache?.clear();
+
+    _previousImage = target;
+    _previousQuality = FrameQuality.lossless;
+
+    return EncodedFrame(
+      FramePacket.buildKeyFrame(target).toBytes(),
+      isLossless: true,
+    );
+  }
+
+  /// The frame packet for [image] on top of what the device shows, the
+  /// image it makes the device show, i.e. [image] reduced to the quality
+  /// it's sent with, and that quality.
+  (ImageData, FrameQuality, FramePacket?) _buildFramePacket(
+    ImageData image, {
+    required List<FrameQuality> qualities,
+    required bool dither,
+    required int? maxBytes,
+    required Iterable<IntRect>? damagedRegions,
+  }) {
+    final previousImage = _previousImage;
+
+    late ImageData reduced;
+    late FrameQuality quality;
+    FramePacket? packet;
+
+    // Reduce the quality until the frame is expected to go out in time.
+    for (quality in qualities) {
+      reduced = quality.apply(image, dither: dither);
+      packet = FramePacket.build(
+        reduced,
+        old: previousImage,
+        damagedRects: previousImage != null
+            ? _damageTracker.findDamagedRects(
+                oldImage: previousImage,
+                newImage: reduced,
+                // Switching qualities changes pixels outside of them.
+                regions: quality == _previousQuality ? damagedRegions : null,
+              )
+            : null,
+        pixelFormat: PixelFormat.rgb565,
+      );
+
+      if (packet == null ||
+          maxBytes == null ||
+          packet.encodedLength <= maxBytes) {
+        break;
+      }
+    }
+
+    if (copyRects && previousImage != null && packet != null) {
+      final scroll = CopyRectsFramePacket.build(
+        reduced,
+        oldImage: previousImage,
+        detector: _scrollDetector,
+        damageTracker: _damageTracker,
+      );
+
+      if (scroll != null && scroll.encodedLength < packet.encodedLength) {
+        packet = scroll;
+      }
+    }
+
+    // Tile ops must be sent once they're built, so only build them when
+    // nothing else was picked.
+    final tileCache = _tileCache;
+    if (tileCache != null &&
+        previousImage != null &&
+        packet != null &&
+        packet is! CopyRectsFramePacket) {
+      packet = tileCache.build(
+            reduced,
+            oldImage: previousImage,
+            damageTracker: _damageTracker,
+          ) ??
+          packet;
+    }
+
+    return (reduced, quality, packet);
+  }
+}
+
+class _EncodeRequest {
+  _EncodeRequest(
+    this.pixels, {
+    required this.format,
+    required this.width,
+    required this.height,
+    required this.stride,
+    required this.quality,
+    required this.dither,
+    required this.maxBytes,
+    required this.damagedRegions,
+  });
+
+  final TransferableTypedData pixels;
+  final PixelFormat format;
+  final int width;
+  final int height;
+  final int stride;
+  final FrameQuality? quality;
+  final bool dither;
+  final int? maxBytes;
+  final List<IntRect>? damagedRegions;
+}
+
+class _RefreshRequest {
+  const _RefreshRequest();
+}
+
+class _KeyframeRequest {
+  const _KeyframeRequest();
+}
+
+/// Runs a [FrameEncoder] on a background isolate, so encoding frames
+/// doesn't take time from the UI thread, and the next frame can be
+/// captured while the last one is encoded.
+///
+/// Pixels are passed to the isolate and encoded frames back as
+/// [TransferableTypedData], so they aren't copied on the way.
+class FrameEncoderIsolate {
+  FrameEncoderIsolate._(this._isolate, this._responses);
+
+  final Isolate _isolate;
+  final ReceivePort _responses;
+  late final SendPort _requests;
+
+  /// Requests in the order they were sent, which is the order the isolate
+  /// answers them in.
+  final _pending = <Completer<Object?>>[];
+
+  static Future<FrameEncoderIsolate> spawn({
+    bool copyRects = false,
+    int tileCacheSlots = 0,
+  }) async {
+    final responses = ReceivePort();
+    final isolate = await Isolate.spawn(
+      _main,
+      (responses.sendPort, copyRects, tileCacheSlots),
+      debugName: 'FrameEncoderIsolate',
+    );
+
+    final encoder = FrameEncoderIsolate._(isolate, responses);
+    final requests = Completer<SendPort>();
+
+    responses.listen((message) {
+      if (!requests.isCompleted) {
+        requests.complete(message as SendPort);
+        return;
+      }
+
+      final completer = encoder._pending.removeAt(0);
+      if (message is RemoteError) {
+        completer.completeError(message, message.stackTrace);
+      } else {
+        completer.complete(message);
+      }
+    });
+
+    encoder._requests = await requests.future;
+    return encoder;
+  }
+
+  static void _main((SendPort, bool, int) args) {
+    final (responses, copyRects, tileCacheSlots) = args;
+    final encoder = FrameEncoder(
+      copyRects: copyRects,
+      tileCacheSlots: tileCacheSlots,
+    );
+    final requests = ReceivePort();
+
+    responses.send(requests.sendPort);
+
+    requests.listen((message) {
+      try {
+        final frame = switch (message) {
+          _EncodeRequest request => encoder.encode(
+              ImageData(
+                request.pixels.materialize().asUint8List(),
+                format: request.format,
+                width: request.width,
+                height: request.height,
+                stride: request.stride,
+              ),
+              quality: request.quality,
+              dither: request.dither,
+              maxBytes: request.maxBytes,
+              damagedRegions: request.damagedRegions,
+            ),
+          _RefreshRequest() => encoder.refresh(),
+          _KeyframeRequest() => encoder.keyframe(),
+          _ => throw ArgumentError.value(message, 'message'),
+        };
+
+        responses.send(
+          frame != null
+              ? (
+                  TransferableTypedData.fromList([frame.bytes]),
+                  frame.isLossless,
+                )
+              : null,
+        );
+      } catch (error, stackTrace) {
+        responses.send(RemoteError('$error', '$stackTrace'));
+      }
+    });
+  }
+
+  Future<EncodedFrame?> _request(Object request) async {
+    final completer = Completer<Object?>();
+    _pending.add(completer);
+    _requests.send(request);
+
+    final response = await completer.future;
+    if (response == null) {
+      return null;
+    }
+
+    final (bytes, isLossless) = response as (TransferableTypedData, bool);
+    return EncodedFrame(
+      bytes.materialize().asUint8List(),
+      isLossless: isLossless,
+    );
+  }
+
+  /// See [FrameEncoder.encode].
+  ///
+  /// The bytes of [image] are copied once, into the message to the
+  /// isolate.
+  Future<EncodedFrame?> encode(
+    ImageData image, {
+    FrameQuality? quality,
+    bool dither = false,
+    int? maxBytes,
+    Iterable<IntRect>? damagedRegions,
+  }) {
+    return _request(
+      _EncodeRequest(
+        TransferableTypedData.fromList([image.bytes]),
+        format: image.format,
+        width: image.width,
+        height: image.height,
+        stride: image.stride,
+        quality: quality,
+        dither: dither,
+        maxBytes: maxBytes,
+        damagedRegions: damagedRegions?.toList(),
+      ),
+    );
+  }
+
+  /// See [FrameEncoder.refresh].
+  Future<EncodedFrame?> refresh() => _request(const _RefreshRequest());
+
+  /// See [FrameEncoder.keyframe].
+  Future<EncodedFrame?> keyframe() => _request(const _KeyframeRequest());
+
+  /// Stops the isolate. Pending requests complete with null.
+  void close() {
+    _responses.close();
+    _isolate.kill();
+
+    for (final completer in _pending) {
+      completer.complete(null);
+    }
+    _pending.clear();
+  }
+}
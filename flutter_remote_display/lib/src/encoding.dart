@@ -3,7 +3,6 @@ import 'dart:math' as math;
 import 'dart:typed_data';
 import 'dart:ui' as ui;
 
-import 'package:buffer/buffer.dart';
 import 'package:flutter/foundation.dart';
 import 'package:flutter/material.dart';
 import 'package:flutter/widgets.dart';
@@ -19,6 +18,15 @@ extension Uint8SubListView on Uint8List {
   }
 }
 
+extension ByteDataSetBytes on ByteData {
+  /// Copies [bytes] into this, starting at [offset]. Returns the offset after
+  /// the copied bytes.
+  int setBytes(int offset, Uint8List bytes) {
+    buffer.asUint8List(offsetInBytes + offset, bytes.length).setAll(0, bytes);
+    return offset + bytes.length;
+  }
+}
+
 extension ByteIterableToInt on Iterable<int> {
   int toInt({Endian endian = Endian.little, int? length}) {
     length ??= this.length;
@@ -222,6 +230,20 @@ class RGBA32ToRGB565PixelFormatConverter extends PixelFormatConverter {
       result = into;
     }
 
+    // Fast path: read whole pixels and write whole pixels, if the buffers
+    // are aligned (which freshly allocated ones always are).
+    if (input is Uint8List &&
+        input.offsetInBytes % 4 == 0 &&
+        result.offsetInBytes % 2 == 0 &&
+        Endian.host == Endian.little) {
+      _convertWords(
+        input.buffer.asUint32List(input.offsetInBytes, nPixels),
+        result.buffer.asUint16List(result.offsetInBytes, nPixels),
+      );
+
+      return result;
+    }
+
     for (var index = 0; index < nPixels; index++) {
       final r = input[index * source.bpp];
       final g = input[index * source.bpp + 1];
@@ -238,6 +260,18 @@ class RGBA32ToRGB565PixelFormatConverter extends PixelFormatConverter {
 
     return result;
   }
+
+  static void _convertWords(Uint32List rgba8888, Uint16List rgb565) {
+    final nPixels = rgba8888.length;
+
+    for (var index = 0; index < nPixels; index++) {
+      final value = rgba8888[index];
+
+      rgb565[index] = ((value >> 3) & 0x001F) |
+          ((value >> 5) & 0x07E0) |
+          ((value >> 8) & 0xF800);
+    }
+  }
 }
 
 enum PixelFormat {
@@ -478,10 +512,9 @@ class ImageData {
     Endian endian = Endian.little,
     PixelFormat? format,
   }) {
-    final bytes = getPixelBytes(x, y);
-    assert(bytes.length <= 8);
+    assert(bpp <= 8);
 
-    final pixelValue = bytes.reversed.fold(0, (acc, byte) => acc << 8 | byte);
+    final pixelValue = bytes.toInt(length: bpp, offset: getOffset(x, y));
     if (format == null || format == this.format) {
       return pixelValue;
     } else {
@@ -493,10 +526,30 @@ class ImageData {
     }
   }
 
+  /// Returns the (little endian) pixel values of row [y].
+  ///
+  /// For 2 and 4 bytes per pixel, this is a view of [bytes] if it's
+  /// suitably aligned, so it must not be modified.
   Iterable<int> getRow(int y) {
-    return Iterable.generate(width, (x) {
-      return getPixelValue(x, y);
-    });
+    final offset = bytes.offsetInBytes + getOffset(0, y);
+
+    if (Endian.host == Endian.little) {
+      if (bpp == 2 && offset % 2 == 0) {
+        return bytes.buffer.asUint16List(offset, width);
+      } else if (bpp == 4 && offset % 4 == 0) {
+        return bytes.buffer.asUint32List(offset, width);
+      }
+    }
+
+    return _generateRow(y);
+  }
+
+  Iterable<int> _generateRow(int y) sync* {
+    final rowOffset = getOffset(0, y);
+
+    for (var x = 0; x < width; x++) {
+      yield bytes.toInt(length: bpp, offset: rowOffset + x * bpp);
+    }
   }
 
   ImageData view(IntRect rect) {
@@ -522,89 +575,6 @@ class ImageData {
   }
 }
 
-class DiscardingByteDataWriter implements ByteDataWriter {
-  DiscardingByteDataWriter({this.endian = Endian.big});
-
-  @override
-  int bufferLength = 0;
-
-  int _length = 0;
-  int get length => _length;
-
-  @override
-  final Endian endian;
-
-  @override
-  Uint8List toBytes() {
-    return Uint8List(0);
-  }
-
-  @override
-  void write(List<int> bytes, {bool copy = false}) {
-    _length += bytes.length;
-  }
-
-  @override
-  void writeFloat32(double value, [Endian? endian]) {
-    _length += 4;
-  }
-
-  @override
-  void writeFloat64(double value, [Endian? endian]) {
-    _length += 8;
-  }
-
-  @override
-  void writeInt(int byteLength, int value, [Endian? endian]) {
-    _length += byteLength;
-  }
-
-  @override
-  void writeInt16(int value, [Endian? endian]) {
-    _length += 2;
-  }
-
-  @override
-  void writeInt32(int value, [Endian? endian]) {
-    _length += 4;
-  }
-
-  @override
-  void writeInt64(int value, [Endian? endian]) {
-    _length += 8;
-  }
-
-  @override
-  void writeInt8(int value) {
-    _length += 1;
-  }
-
-  @override
-  void writeUint(int byteLength, int value, [Endian? endian]) {
-    _length += byteLength;
-  }
-
-  @override
-  void writeUint16(int value, [Endian? endian]) {
-    _length += 2;
-  }
-
-  @override
-  void writeUint32(int value, [Endian? endian]) {
-    _length += 4;
-  }
-
-  @override
-  void writeUint64(int value, [Endian? endian]) {
-    _length += 8;
-  }
-
-  @override
-  void writeUint8(int value) {
-    _length += 1;
-  }
-}
-
 class IntRect {
   const IntRect.fromLTRB(this.left, this.top, this.right, this.bottom);
 
@@ -818,5 +788,12 @@ class IntRect {
 }
 
 abstract class ByteSerializable {
-  void write(ByteDataWriter writer);
+  /// The exact number of bytes [writeInto] writes.
+  int get encodedLength;
+
+  /// Writes this object into [data], starting at [offset].
+  ///
+  /// [data] must have space for at least [encodedLength] more bytes.
+  /// Returns the offset after the written bytes.
+  int writeInto(ByteData data, int offset);
 }
@@ -0,0 +1,166 @@
+import 'dart:typed_data';
+
+import 'package:flutter_remote_display/src/encoding.dart';
+import 'package:flutter_remote_display/src/protocol.dart';
+
+/// Finds content that scrolled vertically between two frames, e.g. in a
+/// ListView, so it can be copied on the device instead of being resent.
+///
+/// Rows are compared by hash: for every shift up to [maxShift] rows, this
+/// looks for the longest band of rows of the new frame that match the rows
+/// of the old frame shifted by that amount. Only rows that actually changed
+/// count towards a band, so static content (app bars, blank background)
+/// doesn't cause bogus scrolls.
+///
+/// The row hashes of the last new frame are kept, so when frames are passed
+/// in order, only the new frame needs to be hashed.
+class ScrollDetector {
+  ScrollDetector({this.maxShift = 96, this.minRows = 8})
+      : assert(maxShift > 0 && minRows > 0);
+
+  /// The maximum number of rows content may have moved by.
+  final int maxShift;
+
+  /// The minimum number of changed rows a scrolled band must cover.
+  final int minRows;
+
+  ImageData? _hashedImage;
+  var _hashes = Int32List(0);
+
+  static Int32List _hashRows(ImageData image) {
+    final hashes = Int32List(image.height);
+    final bytes = image.bytes;
+    final stride = image.stride;
+    final rowLength = image.width * image.bpp;
+
+    final useWords = bytes.offsetInBytes % 4 == 0 &&
+        stride % 4 == 0 &&
+        rowLength % 4 == 0;
+
+    final words = useWords
+        ? bytes.buffer.asUint32List(bytes.offsetInBytes, bytes.length ~/ 4)
+        : null;
+
+    for (var y = 0; y < image.height; y++) {
+      var hash = 17;
+
+      if (useWords) {
+        final start = y * stride ~/ 4;
+        for (var i = start; i < start + rowLength ~/ 4; i++) {
+          hash = (hash * 31 + words![i]) & 0x3FFFFFFF;
+        }
+      } else {
+        final start = y * stride;
+        for (var i = start; i < start + rowLength; i++) {
+          hash = (hash * 31 + bytes[i]) & 0x3FFFFFFF;
+        }
+      }
+
+      hashes[y] = hash;
+    }
+
+    return hashes;
+  }
+
+  static bool _rowsEqual(ImageData a, int aRow, ImageData b, int bRow) {
+    final rowLength = a.width * a.bpp;
+    final aStart = aRow * a.stride;
+    final bStart = bRow * b.stride;
+
+    for (var i = 0; i < rowLength; i++) {
+      if (a.bytes[aStart + i] != b.bytes[bStart + i]) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /// Finds the band of [newImage] that scrolled the most since [oldImage].
+  ///
+  /// Returns a full-width copy of the band's rows in [oldImage] to their
+  /// position in [newImage], or null if nothing scrolled.
+  CopyRect? detect({
+    required ImageData oldImage,
+    required ImageData newImage,
+  }) {
+    assert(oldImage.width == newImage.width);
+    assert(oldImage.height == newImage.height);
+    assert(oldImage.bpp == newImage.bpp);
+
+    final height = newImage.height;
+
+    final oldHashes = identical(oldImage, _hashedImage)
+        ? _hashes
+        : _hashRows(oldImage);
+    final newHashes = _hashRows(newImage);
+
+    _hashedImage = newImage;
+    _hashes = newHashes;
+
+    var bestShift = 0;
+    var bestTop = 0;
+    var bestBottom = 0;
+    var bestGain = minRows - 1;
+
+    for (var shift = -maxShift; shift <= maxShift; shift++) {
+      if (shift == 0) {
+        continue;
+      }
+
+      // The band of new rows matching the old rows shifted by shift, and
+      // how many of them changed in place.
+      var top = -1;
+      var gain = 0;
+
+      final start = shift > 0 ? shift : 0;
+      final end = shift > 0 ? height : height + shift;
+
+      for (var y = start; y <= end; y++) {
+        if (y < end && newHashes[y] == oldHashes[y - shift]) {
+          if (top < 0) {
+            top = y;
+            gain = 0;
+          }
+
+          if (newHashes[y] != oldHashes[y]) {
+            gain++;
+          }
+
+          continue;
+        }
+
+        if (top >= 0 && gain > bestGain) {
+          bestShift = shift;
+          bestTop = top;
+          bestBottom = y;
+          bestGain = gain;
+        }
+
+        top = -1;
+      }
+    }
+
+    if (bestShift == 0) {
+      return null;
+    }
+
+    // Hashes can collide, so make sure the rows really match.
+    for (var y = bestTop; y < bestBottom; y++) {
+      if (!_rowsEqual(newImage, y, oldImage, y - bestShift)) {
+        return null;
+      }
+    }
+
+    return CopyRect(
+      IntRect.fromLTRB(
+        0,
+        bestTop - bestShift,
+        newImage.width,
+        bestBottom - bestShift,
+      ),
+      dx: 0,
+      dy: bestShift,
+    );
+  }
+}
@@ -0,0 +1,142 @@
+import 'dart:async';
+
+/// Paces frames to what the link can take, so a fast animation doesn't
+/// queue up frames (and input lag) on the way to the device.
+///
+/// At most [maxFramesInFlight] frames are being sent at a time, and at most
+/// [targetFps] frames are sent per second. A frame that arrives while the
+/// pipeline is full waits, and is superseded by the next frame that
+/// arrives. Frames are only encoded when they're sent, as a delta to what
+/// the device shows, so the damage of superseded frames is part of the next
+/// delta. Anything else a frame carries along, like the regions that were
+/// repainted, is combined with [merge].
+class FramePipeline<T> {
+  FramePipeline({
+    required this.send,
+    this.merge,
+    this.maxFramesInFlight = 2,
+    this.targetFps,
+  })  : assert(maxFramesInFlight > 0),
+        assert(targetFps == null || targetFps > 0);
+
+  /// Encodes and sends a frame. Frames are passed in order, and the
+  /// returned future completes once the frame is out.
+  final Future<void> Function(T frame) send;
+
+  /// Combines a superseded frame with the frame that replaces it. If null,
+  /// the superseded frame is dropped.
+  final T Function(T superseded, T frame)? merge;
+
+  /// The maximum number of frames that were passed to [send], but aren't
+  /// out yet.
+  final int maxFramesInFlight;
+
+  /// The maximum number of frames sent per second, or null to send frames
+  /// as fast as the link takes them.
+  double? targetFps;
+
+  T? _pending;
+  Completer<void>? _pendingCompleter;
+  var _framesInFlight = 0;
+  var _supersededFrames = 0;
+  Stopwatch? _sinceLastFrame;
+  Timer? _pacingTimer;
+  var _isClosed = false;
+
+  /// The number of frames being sent.
+  int get framesInFlight => _framesInFlight;
+
+  /// The number of frames that were dropped for a newer one so far.
+  int get supersededFrames => _supersededFrames;
+
+  /// Whether no frame is being sent or waiting to be sent.
+  bool get isIdle => _framesInFlight == 0 && _pendingCompleter == null;
+
+  /// Adds [frame] to be sent after the frames in flight.
+  ///
+  /// The returned future completes once the frame is out, or when it was
+  /// superseded by a newer frame.
+  Future<void> add(T frame) {
+    if (_isClosed) {
+      throw StateError('Frame pipeline is already closed.');
+    }
+
+    final superseded = _pendingCompleter;
+    if (superseded != null) {
+      _supersededFrames++;
+      superseded.complete();
+
+      final merge = this.merge;
+      if (merge != null) {
+        frame = merge(_pending as T, frame);
+      }
+    }
+
+    final completer = Completer<void>();
+    _pending = frame;
+    _pendingCompleter = completer;
+
+    _pump();
+
+    return completer.future;
+  }
+
+  Duration _untilNextFrame() {
+    final targetFps = this.targetFps;
+    final sinceLastFrame = _sinceLastFrame;
+
+    if (targetFps == null || sinceLastFrame == null) {
+      return Duration.zero;
+    }
+
+    final interval = Duration.microsecondsPerSecond ~/ targetFps;
+    return Duration(
+      microseconds: interval - sinceLastFrame.elapsedMicroseconds,
+    );
+  }
+
+  void _pump() {
+    final completer = _pendingCompleter;
+
+    if (_isClosed ||
+        completer == null ||
+        _framesInFlight >= maxFramesInFlight ||
+        _pacingTimer != null) {
+      return;
+    }
+
+    final wait = _untilNextFrame();
+    if (wait > Duration.zero) {
+      _pacingTimer = Timer(wait, () {
+        _pacingTimer = null;
+        _pump();
+      });
+      return;
+    }
+
+    final frame = _pending as T;
+    _pending = null;
+    _pendingCompleter = null;
+
+    _sinceLastFrame = Stopwatch()..start();
+    _framesInFlight++;
+
+    Future.sync(() => send(frame)).then(
+      (_) => completer.complete(),
+      onError: completer.completeError,
+    ).whenComplete(() {
+      _framesInFlight--;
+      _pump();
+    });
+  }
+
+  /// Drops the waiting frame, if any. Frames in flight are still sent.
+  void close() {
+    _isClosed = true;
+    _pacingTimer?.cancel();
+    _pacingTimer = null;
+    _pending = null;
+    _pendingCompleter?.complete();
+    _pendingCompleter = null;
+  }
+}
@@ -1,3 +1,4 @@
+import 'dart:math' as math;
 import 'dart:typed_data';
 
 import 'package:buffer/buffer.dart';
@@ -16,36 +17,49 @@ enum PacketType {
   pingPacket,
   pongPacket,
   framePacket,
+  keyframeRequest,
 }
 
 abstract class Packet implements ByteSerializable {
   PacketType get type;
 
-  void writePacketBody(ByteDataWriter writer);
+  /// The exact number of bytes [writePacketBody] writes.
+  int get packetBodyLength;
+
+  /// Writes the packet body into [data] at [offset], and returns the offset
+  /// after it.
+  int writePacketBody(ByteData data, int offset);
+
+  @override
+  int get encodedLength => 1 + packetBodyLength;
 
   @override
-  void write(ByteDataWriter writer) {
-    writer.writeUint8(type.index);
-    writePacketBody(writer);
+  int writeInto(ByteData data, int offset) {
+    data.setUint8(offset, type.index);
+
+    final end = writePacketBody(data, offset + 1);
+    assert(end == offset + encodedLength);
+
+    return end;
   }
 
+  /// Serializes this packet into a new buffer of exactly [encodedLength]
+  /// bytes.
+  ///
+  /// To avoid the allocation, use [writeInto] with a reused buffer.
   Uint8List toBytes() {
-    final writer = ByteDataWriter(endian: Endian.little);
-    write(writer);
-    return writer.toBytes();
+    final bytes = Uint8List(encodedLength);
+    writeInto(ByteData.sublistView(bytes), 0);
+    return bytes;
   }
 
-  int getLength() {
-    final writer = DiscardingByteDataWriter(endian: Endian.little);
-    write(writer);
-    return writer.length;
-  }
+  int getLength() => encodedLength;
 
   static double calculateCompressionRatio(
     Packet compressed,
     Packet raw,
   ) {
-    return compressed.getLength() / raw.getLength();
+    return compressed.encodedLength / raw.encodedLength;
   }
 }
 
@@ -63,12 +77,130 @@ abstract class DisplayToHostPacket extends Packet {
         return PhysicalButtonEvent.readPacketBody(reader);
       case PacketType.pongPacket:
         return PongPacket.readPacketBody(reader);
+      case PacketType.deviceInfo:
+        return DeviceInfoPacket.readPacketBody(reader);
+      case PacketType.keyframeRequest:
+        return KeyframeRequestPacket.readPacketBody(reader);
       default:
         throw Exception('Unknown packet type: $type');
     }
   }
 }
 
+/// Parses the bytes the display sends into packets, as they arrive.
+///
+/// Chunks of the stream can end anywhere, so the start of a packet that is
+/// split across chunks is kept until the rest arrives. Packets are read
+/// straight from the chunks, and passed to [onPacket] as soon as they're
+/// complete.
+///
+/// Malformed packets (unknown types or out of range fields) are skipped and
+/// counted in [skippedBytes] instead of throwing, so a corrupted byte
+/// doesn't take down the input stream.
+class DisplayToHostParser {
+  DisplayToHostParser(this.onPacket);
+
+  final void Function(DisplayToHostPacket packet) onPacket;
+
+  /// The longest packet the display sends, including the type byte.
+  static const _maxPacketLength = 12;
+
+  /// The start of a packet that didn't fit into the last chunk.
+  final _partial = Uint8List(_maxPacketLength);
+  var _partialLength = 0;
+
+  var _skippedBytes = 0;
+
+  /// The number of bytes that weren't part of a valid packet so far.
+  int get skippedBytes => _skippedBytes;
+
+  /// The body length of packets of [type], or -1 if the display doesn't
+  /// send those.
+  static int _bodyLength(int type) {
+    if (type == PacketType.touchEvent.index) {
+      return 8;
+    } else if (type == PacketType.accelerationEvent.index ||
+        type == PacketType.physicalButtonEvent.index) {
+      return 1;
+    } else if (type == PacketType.pongPacket.index ||
+        type == PacketType.keyframeRequest.index) {
+      return 0;
+    } else if (type == PacketType.deviceInfo.index) {
+      return 11;
+    }
+
+    return -1;
+  }
+
+  /// Parses [chunk], the next bytes of the stream.
+  void add(Uint8List chunk) {
+    var offset = 0;
+
+    if (_partialLength > 0) {
+      final length = 1 + _bodyLength(_partial[0]);
+      final missing = math.min(length - _partialLength, chunk.length);
+
+      _partial.setRange(_partialLength, _partialLength + missing, chunk);
+      _partialLength += missing;
+      offset = missing;
+
+      if (_partialLength < length) {
+        return;
+      }
+
+      _parse(_partial, 0);
+      _partialLength = 0;
+    }
+
+    while (offset < chunk.length) {
+      final bodyLength = _bodyLength(chunk[offset]);
+
+      if (bodyLength < 0) {
+        _skippedBytes++;
+        offset++;
+        continue;
+      }
+
+      final end = offset + 1 + bodyLength;
+
+      if (end > chunk.length) {
+        _partial.setRange(0, chunk.length - offset, chunk, offset);
+        _partialLength = chunk.length - offset;
+        return;
+      }
+
+      _parse(chunk, offset);
+      offset = end;
+    }
+  }
+
+  void _parse(Uint8List bytes, int offset) {
+    final type = bytes[offset];
+
+    final DisplayToHostPacket? packet;
+    if (type == PacketType.touchEvent.index) {
+      packet = TouchEvent.readPacketBodyFrom(bytes, offset + 1);
+    } else if (type == PacketType.accelerationEvent.index) {
+      packet = AccelerationEvent.readPacketBodyFrom(bytes, offset + 1);
+    } else if (type == PacketType.physicalButtonEvent.index) {
+      packet = PhysicalButtonEvent(bytes[offset + 1]);
+    } else if (type == PacketType.deviceInfo.index) {
+      packet = DeviceInfoPacket.readPacketBodyFrom(bytes, offset + 1);
+    } else if (type == PacketType.keyframeRequest.index) {
+      packet = KeyframeRequestPacket();
+    } else {
+      packet = PongPacket();
+    }
+
+    if (packet == null) {
+      _skippedBytes += 1 + _bodyLength(type);
+      return;
+    }
+
+    onPacket(packet);
+  }
+}
+
 enum TouchEventPhase { down, move, up }
 
 class TouchEvent extends DisplayToHostPacket {
@@ -88,19 +220,43 @@ class TouchEvent extends DisplayToHostPacket {
   final type = PacketType.touchEvent;
 
   @override
-  void writePacketBody(ByteDataWriter writer) {
-    writer.writeUint8(pointer);
+  final packetBodyLength = 8;
+
+  @override
+  int writePacketBody(ByteData data, int offset) {
+    data.setUint8(offset, pointer);
 
-    writer.writeUint32(timestamp);
+    data.setUint32(offset + 1, timestamp, Endian.little);
 
-    writer.writeUint8(phase.index);
+    data.setUint8(offset + 5, phase.index);
 
     final (x, y) = switch (position) {
       (int, int) p => p,
       null => (0, 0),
     };
-    writer.writeUint8(x);
-    writer.writeUint8(y);
+    data.setUint8(offset + 6, x);
+    data.setUint8(offset + 7, y);
+
+    return offset + 8;
+  }
+
+  /// Reads the body at [offset] of [bytes], or returns null if it's
+  /// malformed.
+  static TouchEvent? readPacketBodyFrom(Uint8List bytes, int offset) {
+    final phaseIndex = bytes[offset + 5];
+    if (phaseIndex >= TouchEventPhase.values.length) {
+      return null;
+    }
+
+    return TouchEvent(
+      pointer: bytes[offset],
+      timestamp: bytes[offset + 1] |
+          bytes[offset + 2] << 8 |
+          bytes[offset + 3] << 16 |
+          bytes[offset + 4] << 24,
+      phase: TouchEventPhase.values[phaseIndex],
+      position: (bytes[offset + 6], bytes[offset + 7]),
+    );
   }
 
   static TouchEvent readPacketBody(ByteDataReader reader) {
@@ -132,8 +288,23 @@ class AccelerationEvent extends DisplayToHostPacket
   final AccelerationEventKind kind;
 
   @override
-  void writePacketBody(ByteDataWriter writer) {
-    writer.writeUint8(kind.index);
+  final packetBodyLength = 1;
+
+  @override
+  int writePacketBody(ByteData data, int offset) {
+    data.setUint8(offset, kind.index);
+    return offset + 1;
+  }
+
+  /// Reads the body at [offset] of [bytes], or returns null if it's
+  /// malformed.
+  static AccelerationEvent? readPacketBodyFrom(Uint8List bytes, int offset) {
+    final kindIndex = bytes[offset];
+    if (kindIndex >= AccelerationEventKind.values.length) {
+      return null;
+    }
+
+    return AccelerationEvent(AccelerationEventKind.values[kindIndex]);
   }
 
   static AccelerationEvent readPacketBody(ByteDataReader reader) {
@@ -153,8 +324,12 @@ class PhysicalButtonEvent extends DisplayToHostPacket
   final int button;
 
   @override
-  void writePacketBody(ByteDataWriter writer) {
-    writer.writeUint8(button);
+  final packetBodyLength = 1;
+
+  @override
+  int writePacketBody(ByteData data, int offset) {
+    data.setUint8(offset, button);
+    return offset + 1;
   }
 
   static PhysicalButtonEvent readPacketBody(ByteDataReader reader) {
@@ -174,9 +349,13 @@ class BacklightPacket extends HostToDisplayPacket {
   final type = PacketType.backlightPacket;
 
   @override
-  void writePacketBody(ByteDataWriter writer) {
+  final packetBodyLength = 1;
+
+  @override
+  int writePacketBody(ByteData data, int offset) {
     final byte = (intensity * 255).round();
-    writer.writeUint8(byte);
+    data.setUint8(offset, byte);
+    return offset + 1;
   }
 
   static BacklightPacket readPacketBody(ByteDataReader reader) {
@@ -194,13 +373,17 @@ class VibrationPacket extends HostToDisplayPacket {
   final type = PacketType.vibrationPacket;
 
   @override
-  void writePacketBody(ByteDataWriter writer) {
+  final packetBodyLength = 1;
+
+  @override
+  int writePacketBody(ByteData data, int offset) {
     var centiSeconds = duration.inMilliseconds ~/ 10;
     if (centiSeconds > 255) {
       centiSeconds = 255;
     }
 
-    writer.writeUint8(centiSeconds);
+    data.setUint8(offset, centiSeconds);
+    return offset + 1;
   }
 
   static VibrationPacket readPacketBody(ByteDataReader reader) {
@@ -214,7 +397,10 @@ class PingPacket extends HostToDisplayPacket {
   final type = PacketType.pingPacket;
 
   @override
-  void writePacketBody(ByteDataWriter writer) {}
+  final packetBodyLength = 0;
+
+  @override
+  int writePacketBody(ByteData data, int offset) => offset;
 
   static PingPacket readPacketBody(ByteDataReader reader) {
     return PingPacket();
@@ -226,14 +412,178 @@ class PongPacket extends DisplayToHostPacket {
   final type = PacketType.pongPacket;
 
   @override
-  void writePacketBody(ByteDataWriter writer) {}
+  final packetBodyLength = 0;
+
+  @override
+  int writePacketBody(ByteData data, int offset) => offset;
 
   static PongPacket readPacketBody(ByteDataReader reader) {
     return PongPacket();
   }
 }
 
-enum FrameEncoding { rawKeyframe, rleKeyframe, rawDeltaframe, rleDeltaframe }
+/// Asks the display for a [DeviceInfoPacket].
+class QueryDeviceInfoPacket extends HostToDisplayPacket {
+  @override
+  final type = PacketType.queryDeviceInfo;
+
+  @override
+  final packetBodyLength = 0;
+
+  @override
+  int writePacketBody(ByteData data, int offset) => offset;
+
+  static QueryDeviceInfoPacket readPacketBody(ByteDataReader reader) {
+    return QueryDeviceInfoPacket();
+  }
+}
+
+/// What the display is and supports, the answer to a
+/// [QueryDeviceInfoPacket].
+class DeviceInfoPacket extends DisplayToHostPacket {
+  DeviceInfoPacket({
+    required this.width,
+    required this.height,
+    required this.widthMm,
+    required this.heightMm,
+    this.supportsVibration = false,
+    this.supportsBacklight = false,
+    this.supportsTouch = false,
+    this.supportsAccelerometer = false,
+    this.supportsCopyRects = false,
+    this.tileCacheSlots = 0,
+  });
+
+  /// Bits of the flags byte. Same as enum flrd_device_info_flags.
+  static const vibrationFlag = 1 << 0;
+  static const backlightFlag = 1 << 1;
+  static const touchFlag = 1 << 2;
+  static const accelerometerFlag = 1 << 3;
+  static const copyRectsFlag = 1 << 4;
+
+  final int width;
+  final int height;
+  final int widthMm;
+  final int heightMm;
+  final bool supportsVibration;
+  final bool supportsBacklight;
+  final bool supportsTouch;
+  final bool supportsAccelerometer;
+
+  /// Whether the display keeps a shadow framebuffer, so it can apply
+  /// [CopyRectsFramePacket]s.
+  final bool supportsCopyRects;
+
+  /// The number of tiles the display caches, see [TilesFramePacket]. 0 if
+  /// it doesn't support those.
+  final int tileCacheSlots;
+
+  @override
+  final type = PacketType.deviceInfo;
+
+  @override
+  final packetBodyLength = 11;
+
+  int get _flags =>
+      (supportsVibration ? vibrationFlag : 0) |
+      (supportsBacklight ? backlightFlag : 0) |
+      (supportsTouch ? touchFlag : 0) |
+      (supportsAccelerometer ? accelerometerFlag : 0) |
+      (supportsCopyRects ? copyRectsFlag : 0);
+
+  @override
+  int writePacketBody(ByteData data, int offset) {
+    data.setUint16(offset, width, Endian.little);
+    data.setUint16(offset + 2, height, Endian.little);
+    data.setUint16(offset + 4, widthMm, Endian.little);
+    data.setUint16(offset + 6, heightMm, Endian.little);
+    data.setUint8(offset + 8, _flags);
+    data.setUint16(offset + 9, tileCacheSlots, Endian.little);
+
+    return offset + 11;
+  }
+
+  static DeviceInfoPacket _fromFields(
+    int width,
+    int height,
+    int widthMm,
+    int heightMm,
+    int flags,
+    int tileCacheSlots,
+  ) {
+    return DeviceInfoPacket(
+      width: width,
+      height: height,
+      widthMm: widthMm,
+      heightMm: heightMm,
+      supportsVibration: flags & vibrationFlag != 0,
+      supportsBacklight: flags & backlightFlag != 0,
+      supportsTouch: flags & touchFlag != 0,
+      supportsAccelerometer: flags & accelerometerFlag != 0,
+      supportsCopyRects: flags & copyRectsFlag != 0,
+      tileCacheSlots: tileCacheSlots,
+    );
+  }
+
+  /// Reads the body at [offset] of [bytes].
+  static DeviceInfoPacket readPacketBodyFrom(Uint8List bytes, int offset) {
+    return _fromFields(
+      bytes[offset] | bytes[offset + 1] << 8,
+      bytes[offset + 2] | bytes[offset + 3] << 8,
+      bytes[offset + 4] | bytes[offset + 5] << 8,
+      bytes[offset + 6] | bytes[offset + 7] << 8,
+      bytes[offset + 8],
+      bytes[offset + 9] | bytes[offset + 10] << 8,
+    );
+  }
+
+  static DeviceInfoPacket readPacketBody(ByteDataReader reader) {
+    return _fromFields(
+      reader.readUint16(),
+      reader.readUint16(),
+      reader.readUint16(),
+      reader.readUint16(),
+      reader.readUint8(),
+      reader.readUint16(),
+    );
+  }
+}
+
+/// Sent by the display when it couldn't apply an op of a frame (e.g. a copy
+/// rect without a shadow framebuffer), so it no longer shows what the
+/// encoder assumes, and the next frame needs to be a keyframe.
+class KeyframeRequestPacket extends DisplayToHostPacket {
+  @override
+  final type = PacketType.keyframeRequest;
+
+  @override
+  final packetBodyLength = 0;
+
+  @override
+  int writePacketBody(ByteData data, int offset) => offset;
+
+  static KeyframeRequestPacket readPacketBody(ByteDataReader reader) {
+    return KeyframeRequestPacket();
+  }
+}
+
+enum FrameEncoding {
+  rawKeyframe(isKeyframe: true),
+  rleKeyframe(isKeyframe: true),
+  rawDeltaframe(isKeyframe: false),
+  rleDeltaframe(isKeyframe: false),
+  paletteKeyframe(isKeyframe: true),
+  paletteDeltaframe(isKeyframe: false),
+  copyRects(isKeyframe: false),
+  tiles(isKeyframe: false),
+  lzDeltaframe(isKeyframe: false);
+
+  const FrameEncoding({required this.isKeyframe});
+
+  /// Whether frames of this encoding replace the whole screen, without
+  /// depending on the previous frame.
+  final bool isKeyframe;
+}
 
 abstract class FramePacket extends HostToDisplayPacket {
   @override
@@ -241,29 +591,124 @@ abstract class FramePacket extends HostToDisplayPacket {
 
   FrameEncoding get encoding;
 
-  void writeFrameBody(ByteDataWriter writer);
+  /// The exact number of bytes [writeFrameBody] writes.
+  int get frameBodyLength;
+
+  /// Writes the frame body into [data] at [offset], and returns the offset
+  /// after it.
+  int writeFrameBody(ByteData data, int offset);
+
+  @override
+  int get packetBodyLength => 1 + frameBodyLength;
 
   @override
-  void writePacketBody(ByteDataWriter writer) {
-    writer.writeUint8(encoding.index);
+  int writePacketBody(ByteData data, int offset) {
+    data.setUint8(offset, encoding.index);
 
-    writeFrameBody(writer);
+    return writeFrameBody(data, offset + 1);
   }
 
+  /// Builds the smallest frame packet for [image].
+  ///
+  /// If [old] is given, this is the smallest of an RLE, raw, palette or LZ
+  /// deltaframe, unless that's bigger than a raw keyframe. The delta isn't
+  /// compared to an RLE or palette keyframe, which would mean encoding the
+  /// whole image for every frame, so a keyframe is only sent if the delta is
+  /// hopeless. Keyframes are RLE or palette encoded, unless that's bigger
+  /// than the raw pixels, e.g. for photos and gradients.
+  ///
+  /// Returns null if nothing changed since [old].
   static FramePacket? build(
     ImageData image, {
     ImageData? old,
+    Iterable<IntRect>? damagedRects,
     PixelFormat? pixelFormat,
   }) {
-    if (old == null) {
-      return RLEKeyFramePacket.build(image, format: pixelFormat);
-    } else {
-      return RLEDeltaFramePacket.build(
+    if (pixelFormat != null) {
+      image = image.convert(pixelFormat);
+    }
+
+    if (old != null) {
+      final (frame, damage) = DeltaFrame.prepare(
         image,
         oldImage: old,
-        pixelFormat: pixelFormat,
+        damagedRects: damagedRects,
+      );
+
+      if (damage.isEmpty) {
+        return null;
+      }
+
+      FramePacket delta = RLEDeltaFramePacket.build(
+        frame,
+        damagedRects: damage,
+      )!;
+
+      final rawDeltaLength = RawDeltaFramePacket.frameBodyLengthFor(
+        damage,
+        frame.bpp,
+      );
+
+      if (rawDeltaLength < delta.frameBodyLength &&
+          damage.length <= RawDeltaFramePacket.maxRects) {
+        delta = RawDeltaFramePacket.build(frame, damagedRects: damage)!;
+      }
+
+      final paletteDelta = PaletteDeltaFramePacket.build(
+        frame,
+        damagedRects: damage,
+      );
+
+      if (paletteDelta != null &&
+          paletteDelta.frameBodyLength < delta.frameBodyLength) {
+        delta = paletteDelta;
+      }
+
+      // Only if it's smaller than the best so far, so it can give up early.
+      final lzDelta = LZDeltaFramePacket.build(
+        frame,
+        damagedRects: damage,
+        maxLength: delta.frameBodyLength - 1,
+      );
+
+      if (lzDelta != null) {
+        delta = lzDelta;
+      }
+
+      if (delta.frameBodyLength <= frame.width * frame.height * frame.bpp) {
+        return delta;
+      }
+    }
+
+    return buildKeyFrame(image);
+  }
+
+  /// Builds the smallest of an RLE, a palette and a raw keyframe for
+  /// [image].
+  static FramePacket buildKeyFrame(ImageData image) {
+    final rawLength = image.width * image.height * image.bpp;
+
+    // null if the image has too many colors.
+    final palette = PaletteKeyFramePacket.build(image);
+    final paletteLength = palette?.frameBodyLength ?? rawLength;
+    final maxLength = paletteLength < rawLength ? paletteLength : rawLength;
+
+    // Give up on RLE as soon as it gets bigger than the others.
+    final runs = Uint8List(maxLength);
+    final length = RLEFrame.encodeRuns(image, runs, maxLength: maxLength);
+
+    if (length >= 0) {
+      return RLEKeyFramePacket(
+        runs.sublistView(0, length),
+        pixelFormat: image.format,
       );
     }
+
+    if (palette != null && paletteLength <= rawLength) {
+      return palette;
+    }
+
+    return RawKeyFramePacket.build(image);
   }
 }
 
@@ -274,13 +719,16 @@ class RawDamageRect implements ByteSerializable {
   final Uint8List bytes;
 
   @override
-  void write(ByteDataWriter writer) {
-    writer.writeUint8(rect.left);
-    writer.writeUint8(rect.top);
-    writer.writeUint8(rect.width);
-    writer.writeUint8(rect.height);
+  int get encodedLength => 4 + bytes.length;
+
+  @override
+  int writeInto(ByteData data, int offset) {
+    data.setUint8(offset, rect.left);
+    data.setUint8(offset + 1, rect.top);
+    data.setUint8(offset + 2, rect.width);
+    data.setUint8(offset + 3, rect.height);
 
-    writer.write(bytes);
+    return data.setBytes(offset + 4, bytes);
   }
 }
 
@@ -288,221 +736,674 @@ class RLEDamageRect implements ByteSerializable {
   RLEDamageRect(this.rect, this.runs);
 
   final IntRect rect;
-  final Iterable<(int, int)> runs;
+
+  /// The run count and runs, as encoded by [RLEFrame.encodeRuns].
+  final Uint8List runs;
 
   @override
-  void write(ByteDataWriter writer) {
-    writer.writeUint8(rect.left);
-    writer.writeUint8(rect.top);
-    writer.writeUint8(rect.width);
-    writer.writeUint8(rect.height);
+  int get encodedLength => 4 + runs.length;
 
-    writer.writeUint16(runs.length);
+  @override
+  int writeInto(ByteData data, int offset) {
+    data.setUint8(offset, rect.left);
+    data.setUint8(offset + 1, rect.top);
+    data.setUint8(offset + 2, rect.width);
+    data.setUint8(offset + 3, rect.height);
 
-    for (final (length, rgb565) in runs) {
-      writer.writeUint8(length);
-      writer.writeUint16(rgb565);
-    }
+    return data.setBytes(offset + 4, runs);
+  }
+}
+
+/// The pixels of the 16 bpp [image], and the number of pixels per row.
+///
+/// A view of the image bytes if possible, otherwise a copy.
+(Uint16List, int) _pixelsOf(ImageData image) {
+  assert(image.bpp == 2);
+
+  final bytes = image.bytes;
+
+  if (Endian.host == Endian.little &&
+      bytes.offsetInBytes % 2 == 0 &&
+      image.stride % 2 == 0) {
+    return (
+      bytes.buffer.asUint16List(bytes.offsetInBytes, bytes.length ~/ 2),
+      image.stride ~/ 2,
+    );
   }
+
+  final width = image.width;
+  final pixels = Uint16List(width * image.height);
+  for (var y = 0; y < image.height; y++) {
+    pixels.setRange(y * width, (y + 1) * width, image.getRow(y));
+  }
+
+  return (pixels, width);
 }
 
 mixin RLEFrame {
   PixelFormat get pixelFormat;
 
-  static Iterable<(int, int)> buildRunsForRow(Iterable<int> pixels) {
-    final runs = <(int, int)>[];
+  /// The maximum number of bytes [encodeRuns] writes for [nPixels] pixels.
+  static int maxEncodedLength(int nPixels) => 2 + nPixels * 3;
+
+  /// Encodes the pixels of [image] as a uint16 run count, followed by the
+  /// runs as (uint8 length, uint16 color) into [into], starting at [offset].
+  ///
+  /// Runs continue across rows and are only split at 255 pixels.
+  /// [into] must have space for at least [maxEncodedLength] bytes, or
+  /// [maxLength] bytes if given.
+  ///
+  /// Returns the number of bytes written, or -1 if that would've been more
+  /// than [maxLength].
+  static int encodeRuns(
+    ImageData image,
+    Uint8List into, {
+    int offset = 0,
+    int? maxLength,
+  }) {
+    assert(image.bpp == 2);
+
+    maxLength ??= maxEncodedLength(image.width * image.height);
+    assert(into.length - offset >= maxLength);
+
+    final limit = offset + maxLength;
+
+    final width = image.width;
+    final height = image.height;
+    final (pixels, rowPixels) = _pixelsOf(image);
+
+    var out = offset + 2;
+    var nRuns = 0;
+    var color = -1;
+    var length = 0;
+
+    for (var y = 0; y < height; y++) {
+      final row = y * rowPixels;
+
+      for (var x = 0; x < width; x++) {
+        final pixel = pixels[row + x];
+
+        if (pixel == color && length < 255) {
+          length++;
+          continue;
+        }
 
-    var run = (1, pixels.first);
+        if (length > 0) {
+          if (out + 3 > limit) {
+            return -1;
+          }
 
-    final it = pixels.skip(1).iterator;
-    while (it.moveNext()) {
-      final next = it.current;
+          into[out] = length;
+          into[out + 1] = color & 0xFF;
+          into[out + 2] = color >> 8;
+          out += 3;
+          nRuns++;
+        }
 
-      if (next != run.$2) {
-        runs.add(run);
+        color = pixel;
+        length = 1;
+      }
+    }
 
-        run = (0, next);
+    if (length > 0) {
+      if (out + 3 > limit) {
+        return -1;
       }
 
-      run = (run.$1 + 1, run.$2);
+      into[out] = length;
+      into[out + 1] = color & 0xFF;
+      into[out + 2] = color >> 8;
+      out += 3;
+      nRuns++;
     }
 
-    runs.add(run);
+    if (nRuns > 0xFFFF) {
+      throw ArgumentError.value(image, 'image', 'too many runs for one rect');
+    }
+
+    into[offset] = nRuns & 0xFF;
+    into[offset + 1] = nRuns >> 8;
 
-    return runs;
+    return out - offset;
   }
+}
 
-  static Iterable<(int, int)> buildRuns(
-    ImageData image, {
-    PixelFormat? format,
-  }) {
-    if (format != null) {
-      image = image.convert(format);
+/// LZ77 compression of the pixels of a rect, for content RLE can't
+/// compress, like anti-aliased text and dithered gradients.
+///
+/// The pixels are encoded as sequences of literal pixels followed by a
+/// match, which copies pixels from up to [window] pixels back in the same
+/// rect. Each sequence starts with a token byte: the literal count in the
+/// high nibble, the match length minus [minMatch] in the low nibble. A
+/// nibble of 15 is followed by bytes that are added to it, up to and
+/// including the first byte that isn't 255. Then follow the literals as
+/// uint16, the match offset as uint16 and the rest of the match length.
+/// The last sequence has no match.
+///
+/// Like LZ4, but in units of pixels, with a window small enough for the
+/// device (see FLRD_LZ_WINDOW).
+mixin LZFrame {
+  /// How far back matches may reach, in pixels.
+  static const window = 2048;
+
+  /// The shortest match, in pixels.
+  static const minMatch = 2;
+
+  static const _hashBits = 12;
+
+  /// The maximum number of bytes [encode] writes for [nPixels] pixels.
+  static int maxEncodedLength(int nPixels) => 2 + nPixels * 2 + nPixels ~/ 255;
+
+  static int _writeLength(Uint8List into, int out, int length) {
+    for (; length >= 255; length -= 255) {
+      into[out++] = 255;
     }
 
-    var runs = buildRunsForRow(image.getRow(0));
+    into[out++] = length;
+    return out;
+  }
+
+  /// Writes a sequence of the literals from [start] to [end], followed by a
+  /// match of [matchLength] pixels [distance] pixels back, if [matchLength]
+  /// isn't zero.
+  ///
+  /// Returns the offset after it, or -1 if that's beyond [limit].
+  static int _writeSequence(
+    Uint8List into,
+    int out,
+    int limit,
+    Uint16List pixels,
+    int start,
+    int end,
+    int distance,
+    int matchLength,
+  ) {
+    final nLiterals = end - start;
+    final matchNibble = matchLength > 0 ? matchLength - minMatch : 0;
+
+    final length = 1 +
+        (nLiterals >= 15 ? (nLiterals - 15) ~/ 255 + 1 : 0) +
+        nLiterals * 2 +
+        (matchLength > 0 ? 2 : 0) +
+        (matchNibble >= 15 ? (matchNibble - 15) ~/ 255 + 1 : 0);
 
-    for (var y = 1; y < image.height; y++) {
-      runs = runs.followedBy(buildRunsForRow(image.getRow(y)));
+    if (out + length > limit) {
+      return -1;
     }
 
-    return runs;
-  }
+    into[out++] = (nLiterals < 15 ? nLiterals : 15) << 4 |
+        (matchNibble < 15 ? matchNibble : 15);
 
-  void writeRLERuns(ByteDataWriter writer, Iterable<(int, int)> runs) {
-    writer.writeUint16(runs.length);
+    if (nLiterals >= 15) {
+      out = _writeLength(into, out, nLiterals - 15);
+    }
+
+    for (var i = start; i < end; i++) {
+      into[out] = pixels[i] & 0xFF;
+      into[out + 1] = pixels[i] >> 8;
+      out += 2;
+    }
 
-    for (final run in runs) {
-      final (runLength, color) = run;
-      writer.writeUint8(runLength);
+    if (matchLength > 0) {
+      into[out] = distance & 0xFF;
+      into[out + 1] = distance >> 8;
+      out += 2;
 
-      assert(pixelFormat.bpp == 2);
-      writer.writeUint16(color);
+      if (matchNibble >= 15) {
+        out = _writeLength(into, out, matchNibble - 15);
+      }
     }
+
+    return out;
   }
-}
 
-mixin DeltaFrame {
-  static Iterable<IntRect> findDamagedRects({
-    required ImageData oldImage,
-    required ImageData newImage,
+  /// Encodes the pixels of [image] into [into], starting at [offset].
+  ///
+  /// Greedy, with a single candidate per hash of two pixels, which is
+  /// extended as far as possible. Runs of one color are matches one pixel
+  /// back, so this is never much bigger than RLE.
+  /// [into] must have space for at least [maxEncodedLength] bytes, or
+  /// [maxLength] bytes if given.
+  ///
+  /// Encoding several rects with the same [table] saves clearing it for
+  /// each of them. If not given, a new one is used.
+  ///
+  /// Returns the number of bytes written, or -1 if that would've been more
+  /// than [maxLength].
+  static int encode(
+    ImageData image,
+    Uint8List into, {
+    int offset = 0,
+    int? maxLength,
+    LZHashTable? table,
   }) {
-    // assert image dimensions and bpp are equal
-    assert(oldImage.width == newImage.width);
-    assert(oldImage.height == newImage.height);
-    assert(oldImage.bpp == newImage.bpp);
+    assert(image.bpp == 2);
 
-    final width = oldImage.width;
-    final height = oldImage.height;
-    final bpp = oldImage.bpp;
+    final width = image.width;
+    final n = width * image.height;
 
-    var rect = IntRect.zero;
-    for (var i = 0; i < oldImage.stride * height; i++) {
-      final oldByte = oldImage.bytes[i];
-      final newByte = newImage.bytes[i];
+    maxLength ??= maxEncodedLength(n);
+    assert(into.length - offset >= maxLength);
 
-      if (oldByte != newByte) {
-        final (x, y) = oldImage.getCoordinatesForOffset(i);
-        final pixelRect = IntRect.fromLTWH(x, y, 1, 1);
-        rect = rect.expandToInclude(pixelRect);
-      }
+    final limit = offset + maxLength;
+
+    // Matches may span rows, so the rows need to be contiguous.
+    final (source, rowPixels) = _pixelsOf(image);
+    final pixels = Uint16List(n);
+    for (var y = 0; y < image.height; y++) {
+      pixels.setRange(y * width, (y + 1) * width, source, y * rowPixels);
     }
 
-    if (rect.isEmpty) {
-      return [];
-    } else {
-      return [rect];
+    table ??= LZHashTable();
+    final entries = table._entries;
+
+    if (table._base > 0x3FFFFFFF - n - window) {
+      entries.fillRange(0, entries.length, 0);
+      table._base = 0;
     }
-  }
-}
 
-class RawKeyFramePacket extends FramePacket {
-  RawKeyFramePacket(this.bytes);
+    // Everything in the table is below base now.
+    final base = table._base + window + 1;
+    table._base = base + n;
+
+    var out = offset;
+    var anchor = 0;
+    var i = 0;
+
+    while (i + minMatch <= n) {
+      final key = pixels[i] | pixels[i + 1] << 16;
+      final hash = ((key * 0x9E3779B1) & 0xFFFFFFFF) >> (32 - _hashBits);
+      final candidate = entries[hash] - base;
+      entries[hash] = base + i;
+
+      if (candidate < 0 ||
+          i - candidate > window ||
+          pixels[candidate] != pixels[i] ||
+          pixels[candidate + 1] != pixels[i + 1]) {
+        i++;
+        continue;
+      }
 
-  final Uint8List bytes;
+      var length = minMatch;
+      while (i + length < n &&
+          pixels[candidate + length] == pixels[i + length]) {
+        length++;
+      }
 
-  @override
-  final encoding = FrameEncoding.rawKeyframe;
+      out = _writeSequence(
+        into,
+        out,
+        limit,
+        pixels,
+        anchor,
+        i,
+        i - candidate,
+        length,
+      );
+      if (out < 0) {
+        return -1;
+      }
 
-  @override
-  void writeFrameBody(ByteDataWriter writer) {
-    writer.write(bytes);
+      i += length;
+      anchor = i;
+    }
+
+    if (anchor < n) {
+      out = _writeSequence(into, out, limit, pixels, anchor, n, 0, 0);
+      if (out < 0) {
+        return -1;
+      }
+    }
+
+    return out - offset;
   }
 }
 
-class RLEKeyFramePacket extends FramePacket with RLEFrame {
-  RLEKeyFramePacket(this.runs, {required this.pixelFormat});
+/// The hash table of [LZFrame.encode].
+class LZHashTable {
+  /// Maps hashes of pixel pairs to the last position they were seen at,
+  /// plus [_base]. Entries below [_base] are from earlier rects.
+  final _entries = Int32List(1 << LZFrame._hashBits);
+  var _base = 0;
+}
 
-  final Iterable<(int, int)> runs;
+class LZDamageRect implements ByteSerializable {
+  LZDamageRect(this.rect, this.sequences);
 
-  @override
-  final PixelFormat pixelFormat;
+  final IntRect rect;
+
+  /// The sequences, as encoded by [LZFrame.encode].
+  final Uint8List sequences;
 
   @override
-  final encoding = FrameEncoding.rleKeyframe;
+  int get encodedLength => 4 + sequences.length;
 
   @override
-  void writeFrameBody(ByteDataWriter writer) {
-    writeRLERuns(writer, runs);
-  }
+  int writeInto(ByteData data, int offset) {
+    data.setUint8(offset, rect.left);
+    data.setUint8(offset + 1, rect.top);
+    data.setUint8(offset + 2, rect.width);
+    data.setUint8(offset + 3, rect.height);
 
-  static RLEKeyFramePacket build(ImageData image, {PixelFormat? format}) {
-    return RLEKeyFramePacket(
-      RLEFrame.buildRuns(image, format: format),
-      pixelFormat: format ?? image.format,
-    );
+    return data.setBytes(offset + 4, sequences);
   }
 }
 
-class RawDeltaFramePacket extends FramePacket with DeltaFrame {
-  RawDeltaFramePacket(this.bytes);
+/// The colors of a palette encoded frame, shared by all of its rects.
+///
+/// Encoded as the number of colors minus one, a format byte (the bits per
+/// packed index, or'ed with 0x80 if the indices are RLE encoded instead),
+/// and the colors as uint16.
+class Palette implements ByteSerializable {
+  Palette(this.colors, {required this.rle})
+      : assert(colors.isNotEmpty && colors.length <= maxColors);
+
+  static const maxColors = 256;
+
+  final Uint16List colors;
+
+  /// Whether the indices are RLE encoded as a uint16 run count, followed by
+  /// the runs as (uint8 length, uint8 index), instead of packed.
+  final bool rle;
+
+  /// The number of bits per packed index, for a palette of [nColors] colors.
+  static int bitsPerIndexFor(int nColors) {
+    if (nColors <= 2) return 1;
+    if (nColors <= 4) return 2;
+    if (nColors <= 16) return 4;
+    return 8;
+  }
 
-  final Uint8List bytes;
+  int get bitsPerIndex => rle ? 8 : bitsPerIndexFor(colors.length);
 
   @override
-  final encoding = FrameEncoding.rawDeltaframe;
+  int get encodedLength => 2 + colors.length * 2;
 
   @override
-  void writeFrameBody(ByteDataWriter writer) {
-    writer.write(bytes);
-  }
+  int writeInto(ByteData data, int offset) {
+    data.setUint8(offset, colors.length - 1);
+    data.setUint8(offset + 1, bitsPerIndex | (rle ? 0x80 : 0));
+    offset += 2;
+
+    for (final color in colors) {
+      data.setUint16(offset, color, Endian.little);
+      offset += 2;
+    }
 
-  static RawDeltaFramePacket? build(Uint8List imageARGBBytes) {
-    throw UnimplementedError();
+    return offset;
   }
 }
 
-class RLEDeltaFramePacket extends FramePacket with DeltaFrame, RLEFrame {
-  RLEDeltaFramePacket(this.rects, {required this.pixelFormat});
+class PaletteDamageRect implements ByteSerializable {
+  PaletteDamageRect(this.rect, this.indices);
 
-  final Iterable<RLEDamageRect> rects;
+  final IntRect rect;
 
-  @override
-  final encoding = FrameEncoding.rleDeltaframe;
+  /// The packed or RLE encoded palette indices, see [Palette.rle].
+  final Uint8List indices;
 
-  final PixelFormat pixelFormat;
+  @override
+  int get encodedLength => 4 + indices.length;
 
   @override
-  void writeFrameBody(ByteDataWriter writer) {
-    writer.writeUint16(rects.length);
+  int writeInto(ByteData data, int offset) {
+    data.setUint8(offset, rect.left);
+    data.setUint8(offset + 1, rect.top);
+    data.setUint8(offset + 2, rect.width);
+    data.setUint8(offset + 3, rect.height);
 
-    for (final tile in rects) {
-      tile.write(writer);
-    }
+    return data.setBytes(offset + 4, indices);
   }
+}
 
-  static RLEDeltaFramePacket? build(
-    ImageData image, {
-    ImageData? oldImage,
-    Iterable<IntRect>? damagedRects,
-    PixelFormat? pixelFormat,
-  }) {
-    // assert old image or dirty rects are provided
-    assert(oldImage != null || damagedRects != null);
+mixin PaletteFrame {
+  Palette get palette;
+
+  /// Maps the pixels in [rects] of [image] to indices into a palette, one
+  /// byte per pixel, rect after rect and row by row.
+  ///
+  /// Returns the palette colors and the indices, or null if there are more
+  /// than [Palette.maxColors] colors.
+  static (Uint16List, Uint8List)? indexPixels(
+    ImageData image,
+    Iterable<IntRect> rects,
+  ) {
+    final (pixels, rowPixels) = _pixelsOf(image);
 
-    if (pixelFormat != null) {
-      image = image.convert(pixelFormat);
+    var nPixels = 0;
+    for (final rect in rects) {
+      nPixels += rect.width * rect.height;
     }
 
-    if (oldImage != null &&
-        (pixelFormat != null || image.format != oldImage.format)) {
-      oldImage = oldImage.convert(pixelFormat ?? image.format);
-    }
+    final colors = Uint16List(Palette.maxColors);
+    final indexOf = <int, int>{};
+    final indices = Uint8List(nPixels);
 
-    final rects = <RLEDamageRect>[];
+    var nColors = 0;
+    var out = 0;
 
-    damagedRects ??= DeltaFrame.findDamagedRects(
-      oldImage: oldImage!,
-      newImage: image,
-    );
+    // Neighbouring pixels mostly have the same color, so skip the lookup
+    // for those.
+    var lastColor = -1;
+    var lastIndex = 0;
 
-    assert((() {
-      damagedRects!;
+    for (final rect in rects) {
+      for (var y = rect.top; y < rect.bottom; y++) {
+        final row = y * rowPixels;
+
+        for (var x = rect.left; x < rect.right; x++) {
+          final pixel = pixels[row + x];
+
+          if (pixel != lastColor) {
+            var index = indexOf[pixel];
+            if (index == null) {
+              if (nColors == Palette.maxColors) {
+                return null;
+              }
+
+              index = nColors++;
+              colors[index] = pixel;
+              indexOf[pixel] = index;
+            }
+
+            lastColor = pixel;
+            lastIndex = index;
+          }
+
+          indices[out++] = lastIndex;
+        }
+      }
+    }
+
+    return (colors.sublist(0, nColors > 0 ? nColors : 1), indices);
+  }
 
+  /// The number of bytes [encodePacked] writes for [nPixels] indices.
+  static int packedLength(int nPixels, int bitsPerIndex) {
+    return (nPixels * bitsPerIndex + 7) >> 3;
+  }
+
+  /// The number of bytes [encodeRuns] writes for the indices from [start]
+  /// to [end].
+  static int runsLength(Uint8List indices, int start, int end) {
+    var nRuns = 0;
+    var index = -1;
+    var length = 0;
+
+    for (var i = start; i < end; i++) {
+      if (indices[i] == index && length < 255) {
+        length++;
+        continue;
+      }
+
+      nRuns++;
+      index = indices[i];
+      length = 1;
+    }
+
+    return 2 + nRuns * 2;
+  }
+
+  /// Packs the indices from [start] to [end] with [bitsPerIndex] bits each,
+  /// starting at the lowest bits of the first byte, into [into] at [offset].
+  ///
+  /// Returns the number of bytes written.
+  static int encodePacked(
+    Uint8List indices,
+    int start,
+    int end,
+    int bitsPerIndex,
+    Uint8List into,
+    int offset,
+  ) {
+    var out = offset;
+    var byte = 0;
+    var shift = 0;
+
+    for (var i = start; i < end; i++) {
+      byte |= indices[i] << shift;
+      shift += bitsPerIndex;
+
+      if (shift == 8) {
+        into[out++] = byte;
+        byte = 0;
+        shift = 0;
+      }
+    }
+
+    if (shift > 0) {
+      into[out++] = byte;
+    }
+
+    return out - offset;
+  }
+
+  /// Encodes the indices from [start] to [end] as a uint16 run count,
+  /// followed by the runs as (uint8 length, uint8 index), into [into] at
+  /// [offset].
+  ///
+  /// Returns the number of bytes written.
+  static int encodeRuns(
+    Uint8List indices,
+    int start,
+    int end,
+    Uint8List into,
+    int offset,
+  ) {
+    var out = offset + 2;
+    var index = -1;
+    var length = 0;
+
+    for (var i = start; i < end; i++) {
+      if (indices[i] == index && length < 255) {
+        length++;
+        continue;
+      }
+
+      if (length > 0) {
+        into[out] = length;
+        into[out + 1] = index;
+        out += 2;
+      }
+
+      index = indices[i];
+      length = 1;
+    }
+
+    if (length > 0) {
+      into[out] = length;
+      into[out + 1] = index;
+      out += 2;
+    }
+
+    final nRuns = (out - offset - 2) ~/ 2;
+    into[offset] = nRuns & 0xFF;
+    into[offset + 1] = nRuns >> 8;
+
+    return out - offset;
+  }
+
+  /// Builds a palette for the pixels in [rects] of [image], and encodes the
+  /// indices of each rect, either packed or RLE encoded, whichever is
+  /// smaller for all rects together.
+  ///
+  /// Returns null if there are more than [Palette.maxColors] colors.
+  static (Palette, List<Uint8List>)? encode(
+    ImageData image,
+    Iterable<IntRect> rects,
+  ) {
+    final indexed = indexPixels(image, rects);
+    if (indexed == null) {
+      return null;
+    }
+
+    final (colors, indices) = indexed;
+    final bitsPerIndex = Palette.bitsPerIndexFor(colors.length);
+
+    var packedTotal = 0;
+    var runsTotal = 0;
+    var start = 0;
+    for (final rect in rects) {
+      final nPixels = rect.width * rect.height;
+
+      packedTotal += packedLength(nPixels, bitsPerIndex);
+      runsTotal += runsLength(indices, start, start + nPixels);
+      start += nPixels;
+    }
+
+    final rle = runsTotal < packedTotal;
+    final into = Uint8List(rle ? runsTotal : packedTotal);
+    final encoded = <Uint8List>[];
+
+    var offset = 0;
+    start = 0;
+    for (final rect in rects) {
+      final end = start + rect.width * rect.height;
+
+      final length = rle
+          ? encodeRuns(indices, start, end, into, offset)
+          : encodePacked(indices, start, end, bitsPerIndex, into, offset);
+
+      encoded.add(into.sublistView(offset, offset + length));
+      offset += length;
+      start = end;
+    }
+
+    return (Palette(colors, rle: rle), encoded);
+  }
+}
+
+mixin DeltaFrame {
+  /// Converts [image] (and [oldImage]) to [pixelFormat] if given, and finds
+  /// the damaged rects between them unless [damagedRects] is given.
+  static (ImageData, Iterable<IntRect>) prepare(
+    ImageData image, {
+    ImageData? oldImage,
+    Iterable<IntRect>? damagedRects,
+    PixelFormat? pixelFormat,
+  }) {
+    // assert old image or dirty rects are provided
+    assert(oldImage != null || damagedRects != null);
+
+    if (pixelFormat != null) {
+      image = image.convert(pixelFormat);
+    }
+
+    if (oldImage != null &&
+        (pixelFormat != null || image.format != oldImage.format)) {
+      oldImage = oldImage.convert(pixelFormat ?? image.format);
+    }
+
+    final rects = damagedRects ??
+        findDamagedRects(
+          oldImage: oldImage!,
+          newImage: image,
+        );
+
+    assert((() {
       // no rects overlap
-      for (final (i, a) in damagedRects.indexed) {
-        final rectsExceptA =
-            damagedRects.whereNotIndexed((index, _) => index == i);
+      for (final (i, a) in rects.indexed) {
+        final rectsExceptA = rects.whereNotIndexed((index, _) => index == i);
 
         for (final b in rectsExceptA) {
           if (a.overlaps(b)) {
@@ -514,15 +1415,792 @@ class RLEDeltaFramePacket extends FramePacket with DeltaFrame, RLEFrame {
       return true;
     })());
 
+    return (image, rects);
+  }
+
+  /// Finds the regions of [newImage] that differ from [oldImage].
+  ///
+  /// Every run of consecutive damaged rows is returned as one rect, spanning
+  /// from the leftmost to the rightmost damaged column in those rows. The
+  /// returned rects are ordered top to bottom and never overlap.
+  ///
+  /// Rows are compared 8 bytes at a time if both buffers are 8-byte aligned
+  /// and have a stride that is a multiple of 8, which is the case for frames
+  /// converted by [ImageData.convert].
+  static List<IntRect> findDamagedRects({
+    required ImageData oldImage,
+    required ImageData newImage,
+  }) {
+    // assert image dimensions and bpp are equal
+    assert(oldImage.width == newImage.width);
+    assert(oldImage.height == newImage.height);
+    assert(oldImage.bpp == newImage.bpp);
+
+    final height = oldImage.height;
+    final bpp = oldImage.bpp;
+    final rowBytes = oldImage.width * bpp;
+
+    final oldBytes = oldImage.bytes;
+    final newBytes = newImage.bytes;
+    final oldStride = oldImage.stride;
+    final newStride = newImage.stride;
+
+    final useWords = oldBytes.offsetInBytes % 8 == 0 &&
+        newBytes.offsetInBytes % 8 == 0 &&
+        oldStride % 8 == 0 &&
+        newStride % 8 == 0;
+
+    final oldWords = useWords
+        ? oldBytes.buffer.asUint64List(
+            oldBytes.offsetInBytes,
+            oldBytes.length ~/ 8,
+          )
+        : null;
+    final newWords = useWords
+        ? newBytes.buffer.asUint64List(
+            newBytes.offsetInBytes,
+            newBytes.length ~/ 8,
+          )
+        : null;
+
+    // The last whole word of each row.
+    final wordEnd = rowBytes & ~7;
+
+    final rects = <IntRect>[];
+
+    // The damaged rows (and columns) since the last clean row.
+    var bandTop = -1;
+    var bandLeft = 0;
+    var bandRight = 0;
+
+    for (var y = 0; y < height; y++) {
+      final oldRow = y * oldStride;
+      final newRow = y * newStride;
+
+      // First differing byte in this row.
+      var first = 0;
+      if (useWords) {
+        final oldRowWord = oldRow >> 3;
+        final newRowWord = newRow >> 3;
+
+        while (first < wordEnd &&
+            oldWords![oldRowWord + (first >> 3)] ==
+                newWords![newRowWord + (first >> 3)]) {
+          first += 8;
+        }
+      }
+
+      while (first < rowBytes &&
+          oldBytes[oldRow + first] == newBytes[newRow + first]) {
+        first++;
+      }
+
+      if (first == rowBytes) {
+        if (bandTop >= 0) {
+          rects.add(IntRect.fromLTRB(bandLeft, bandTop, bandRight, y));
+          bandTop = -1;
+        }
+
+        continue;
+      }
+
+      // One past the last differing byte in this row. There's at least one
+      // differing byte (at first), so none of these loops can run past it.
+      var last = rowBytes;
+      if (useWords) {
+        while (last > wordEnd &&
+            oldBytes[oldRow + last - 1] == newBytes[newRow + last - 1]) {
+          last--;
+        }
+
+        if (last == wordEnd) {
+          while (oldWords![((oldRow + last) >> 3) - 1] ==
+              newWords![((newRow + last) >> 3) - 1]) {
+            last -= 8;
+          }
+        }
+      }
+
+      while (oldBytes[oldRow + last - 1] == newBytes[newRow + last - 1]) {
+        last--;
+      }
+
+      final left = first ~/ bpp;
+      final right = (last - 1) ~/ bpp + 1;
+
+      if (bandTop < 0) {
+        bandTop = y;
+        bandLeft = left;
+        bandRight = right;
+      } else {
+        if (left < bandLeft) bandLeft = left;
+        if (right > bandRight) bandRight = right;
+      }
+    }
+
+    if (bandTop >= 0) {
+      rects.add(IntRect.fromLTRB(bandLeft, bandTop, bandRight, height));
+    }
+
+    return rects;
+  }
+}
+
+class RawKeyFramePacket extends FramePacket {
+  RawKeyFramePacket(this.bytes);
+
+  final Uint8List bytes;
+
+  @override
+  final encoding = FrameEncoding.rawKeyframe;
+
+  @override
+  int get frameBodyLength => bytes.length;
+
+  @override
+  int writeFrameBody(ByteData data, int offset) {
+    return data.setBytes(offset, bytes);
+  }
+
+  static RawKeyFramePacket build(ImageData image) {
+    final rowLength = image.width * image.bpp;
+
+    if (image.stride == rowLength) {
+      return RawKeyFramePacket(
+        image.bytes.sublistView(0, rowLength * image.height),
+      );
+    }
+
+    final bytes = Uint8List(rowLength * image.height);
+    for (var y = 0; y < image.height; y++) {
+      final offset = image.getOffset(0, y);
+
+      bytes.setRange(
+        y * rowLength,
+        (y + 1) * rowLength,
+        image.bytes,
+        offset,
+      );
+    }
+
+    return RawKeyFramePacket(bytes);
+  }
+}
+
+class RLEKeyFramePacket extends FramePacket with RLEFrame {
+  RLEKeyFramePacket(this.runs, {required this.pixelFormat});
+
+  /// The run count and runs, as encoded by [RLEFrame.encodeRuns].
+  final Uint8List runs;
+
+  @override
+  final PixelFormat pixelFormat;
+
+  @override
+  final encoding = FrameEncoding.rleKeyframe;
+
+  @override
+  int get frameBodyLength => runs.length;
+
+  @override
+  int writeFrameBody(ByteData data, int offset) {
+    assert(pixelFormat.bpp == 2);
+    return data.setBytes(offset, runs);
+  }
+
+  static RLEKeyFramePacket build(ImageData image, {PixelFormat? format}) {
+    if (format != null) {
+      image = image.convert(format);
+    }
+
+    final runs = Uint8List(
+      RLEFrame.maxEncodedLength(image.width * image.height),
+    );
+    final length = RLEFrame.encodeRuns(image, runs);
+
+    return RLEKeyFramePacket(
+      runs.sublistView(0, length),
+      pixelFormat: image.format,
+    );
+  }
+}
+
+class RawDeltaFramePacket extends FramePacket with DeltaFrame {
+  RawDeltaFramePacket(this.rects) : assert(rects.length <= maxRects);
+
+  /// The rect count is sent as a single byte.
+  static const maxRects = 255;
+
+  final List<RawDamageRect> rects;
+
+  @override
+  final encoding = FrameEncoding.rawDeltaframe;
+
+  /// The frame body length of a raw deltaframe for [damagedRects].
+  static int frameBodyLengthFor(Iterable<IntRect> damagedRects, int bpp) {
+    var length = 1;
     for (final rect in damagedRects) {
-      final damagedImage = image.view(rect);
-      final runs = RLEFrame.buildRuns(damagedImage);
+      length += 4 + rect.width * rect.height * bpp;
+    }
+
+    return length;
+  }
+
+  @override
+  int get frameBodyLength {
+    var length = 1;
+    for (final rect in rects) {
+      length += rect.encodedLength;
+    }
+
+    return length;
+  }
+
+  @override
+  int writeFrameBody(ByteData data, int offset) {
+    data.setUint8(offset, rects.length);
+    offset += 1;
+
+    for (final rect in rects) {
+      offset = rect.writeInto(data, offset);
+    }
+
+    return offset;
+  }
+
+  /// Builds a raw deltaframe for the pixels of [image] in [damagedRects], or
+  /// those that changed since [oldImage].
+  ///
+  /// Returns null if nothing changed, or if there are more than [maxRects]
+  /// damaged rects.
+  static RawDeltaFramePacket? build(
+    ImageData image, {
+    ImageData? oldImage,
+    Iterable<IntRect>? damagedRects,
+    PixelFormat? pixelFormat,
+  }) {
+    final (frame, damage) = DeltaFrame.prepare(
+      image,
+      oldImage: oldImage,
+      damagedRects: damagedRects,
+      pixelFormat: pixelFormat,
+    );
 
-      rects.add(RLEDamageRect(rect, runs));
+    if (damage.isEmpty || damage.length > maxRects) {
+      return null;
+    }
+
+    final bpp = frame.bpp;
+
+    // Copy all rects into one buffer, a row at a time.
+    var length = 0;
+    for (final rect in damage) {
+      length += rect.width * rect.height * bpp;
+    }
+
+    final pixels = Uint8List(length);
+    final rects = <RawDamageRect>[];
+    var offset = 0;
+
+    for (final rect in damage) {
+      final damagedImage = frame.view(rect);
+      final rowLength = rect.width * bpp;
+      final start = offset;
+
+      for (var y = 0; y < rect.height; y++) {
+        pixels.setRange(
+          offset,
+          offset + rowLength,
+          damagedImage.bytes,
+          y * damagedImage.stride,
+        );
+
+        offset += rowLength;
+      }
+
+      rects.add(RawDamageRect(rect, pixels.sublistView(start, offset)));
+    }
+
+    return RawDeltaFramePacket(rects);
+  }
+}
+
+class RLEDeltaFramePacket extends FramePacket with DeltaFrame, RLEFrame {
+  RLEDeltaFramePacket(this.rects, {required this.pixelFormat});
+
+  final Iterable<RLEDamageRect> rects;
+
+  @override
+  final encoding = FrameEncoding.rleDeltaframe;
+
+  final PixelFormat pixelFormat;
+
+  @override
+  int get frameBodyLength {
+    var length = 2;
+    for (final rect in rects) {
+      length += rect.encodedLength;
+    }
+
+    return length;
+  }
+
+  @override
+  int writeFrameBody(ByteData data, int offset) {
+    data.setUint16(offset, rects.length, Endian.little);
+    offset += 2;
+
+    for (final tile in rects) {
+      offset = tile.writeInto(data, offset);
+    }
+
+    return offset;
+  }
+
+  static RLEDeltaFramePacket? build(
+    ImageData image, {
+    ImageData? oldImage,
+    Iterable<IntRect>? damagedRects,
+    PixelFormat? pixelFormat,
+  }) {
+    final (frame, damage) = DeltaFrame.prepare(
+      image,
+      oldImage: oldImage,
+      damagedRects: damagedRects,
+      pixelFormat: pixelFormat,
+    );
+
+    final rects = <RLEDamageRect>[];
+
+    // Encode all rects into one buffer, big enough for the worst case.
+    var maxLength = 0;
+    for (final rect in damage) {
+      maxLength += RLEFrame.maxEncodedLength(rect.width * rect.height);
+    }
+
+    final runs = Uint8List(maxLength);
+    var offset = 0;
+
+    for (final rect in damage) {
+      final damagedImage = frame.view(rect);
+      final length = RLEFrame.encodeRuns(damagedImage, runs, offset: offset);
+
+      rects.add(
+        RLEDamageRect(rect, runs.sublistView(offset, offset + length)),
+      );
+      offset += length;
     }
 
     return rects.isNotEmpty
-        ? RLEDeltaFramePacket(rects, pixelFormat: pixelFormat ?? image.format)
+        ? RLEDeltaFramePacket(rects, pixelFormat: frame.format)
         : null;
   }
 }
+
+class PaletteKeyFramePacket extends FramePacket with PaletteFrame {
+  PaletteKeyFramePacket(this.palette, this.indices);
+
+  @override
+  final Palette palette;
+
+  /// The packed or RLE encoded palette indices, see [Palette.rle].
+  final Uint8List indices;
+
+  @override
+  final encoding = FrameEncoding.paletteKeyframe;
+
+  @override
+  int get frameBodyLength => palette.encodedLength + indices.length;
+
+  @override
+  int writeFrameBody(ByteData data, int offset) {
+    offset = palette.writeInto(data, offset);
+
+    return data.setBytes(offset, indices);
+  }
+
+  /// Builds a palette keyframe for [image], or returns null if it has more
+  /// than [Palette.maxColors] colors.
+  static PaletteKeyFramePacket? build(ImageData image, {PixelFormat? format}) {
+    if (format != null) {
+      image = image.convert(format);
+    }
+
+    final encoded = PaletteFrame.encode(
+      image,
+      [IntRect.fromLTWH(0, 0, image.width, image.height)],
+    );
+    if (encoded == null) {
+      return null;
+    }
+
+    final (palette, indices) = encoded;
+    return PaletteKeyFramePacket(palette, indices.single);
+  }
+}
+
+class PaletteDeltaFramePacket extends FramePacket
+    with DeltaFrame, PaletteFrame {
+  PaletteDeltaFramePacket(this.palette, this.rects);
+
+  @override
+  final Palette palette;
+
+  final List<PaletteDamageRect> rects;
+
+  @override
+  final encoding = FrameEncoding.paletteDeltaframe;
+
+  @override
+  int get frameBodyLength {
+    var length = palette.encodedLength + 2;
+    for (final rect in rects) {
+      length += rect.encodedLength;
+    }
+
+    return length;
+  }
+
+  @override
+  int writeFrameBody(ByteData data, int offset) {
+    offset = palette.writeInto(data, offset);
+
+    data.setUint16(offset, rects.length, Endian.little);
+    offset += 2;
+
+    for (final rect in rects) {
+      offset = rect.writeInto(data, offset);
+    }
+
+    return offset;
+  }
+
+  /// Builds a palette deltaframe for the pixels of [image] in
+  /// [damagedRects], or those that changed since [oldImage].
+  ///
+  /// All rects share one palette. Returns null if nothing changed, or if
+  /// the damaged pixels have more than [Palette.maxColors] colors.
+  static PaletteDeltaFramePacket? build(
+    ImageData image, {
+    ImageData? oldImage,
+    Iterable<IntRect>? damagedRects,
+    PixelFormat? pixelFormat,
+  }) {
+    final (frame, damage) = DeltaFrame.prepare(
+      image,
+      oldImage: oldImage,
+      damagedRects: damagedRects,
+      pixelFormat: pixelFormat,
+    );
+
+    if (damage.isEmpty || damage.length > 0xFFFF) {
+      return null;
+    }
+
+    final encoded = PaletteFrame.encode(frame, damage);
+    if (encoded == null) {
+      return null;
+    }
+
+    final (palette, indices) = encoded;
+    return PaletteDeltaFramePacket(palette, [
+      for (final (i, rect) in damage.indexed)
+        PaletteDamageRect(rect, indices[i]),
+    ]);
+  }
+}
+
+class LZDeltaFramePacket extends FramePacket with DeltaFrame, LZFrame {
+  LZDeltaFramePacket(this.rects);
+
+  final List<LZDamageRect> rects;
+
+  @override
+  final encoding = FrameEncoding.lzDeltaframe;
+
+  @override
+  int get frameBodyLength {
+    var length = 2;
+    for (final rect in rects) {
+      length += rect.encodedLength;
+    }
+
+    return length;
+  }
+
+  @override
+  int writeFrameBody(ByteData data, int offset) {
+    data.setUint16(offset, rects.length, Endian.little);
+    offset += 2;
+
+    for (final rect in rects) {
+      offset = rect.writeInto(data, offset);
+    }
+
+    return offset;
+  }
+
+  /// Builds an LZ deltaframe for the pixels of [image] in [damagedRects],
+  /// or those that changed since [oldImage].
+  ///
+  /// Returns null if nothing changed, or as soon as the frame body gets
+  /// bigger than [maxLength], if given.
+  static LZDeltaFramePacket? build(
+    ImageData image, {
+    ImageData? oldImage,
+    Iterable<IntRect>? damagedRects,
+    PixelFormat? pixelFormat,
+    int? maxLength,
+  }) {
+    final (frame, damage) = DeltaFrame.prepare(
+      image,
+      oldImage: oldImage,
+      damagedRects: damagedRects,
+      pixelFormat: pixelFormat,
+    );
+
+    if (damage.isEmpty || damage.length > 0xFFFF) {
+      return null;
+    }
+
+    // Encode all rects into one buffer, big enough for the worst case.
+    var worstLength = 0;
+    for (final rect in damage) {
+      worstLength += LZFrame.maxEncodedLength(rect.width * rect.height);
+    }
+
+    final budget = maxLength ?? 2 + damage.length * 4 + worstLength;
+    final sequences = Uint8List(math.max(0, math.min(worstLength, budget)));
+    final rects = <LZDamageRect>[];
+    final table = LZHashTable();
+
+    var offset = 0;
+    var bodyLength = 2;
+
+    for (final rect in damage) {
+      bodyLength += 4;
+      if (bodyLength > budget) {
+        return null;
+      }
+
+      final length = LZFrame.encode(
+        frame.view(rect),
+        sequences,
+        offset: offset,
+        maxLength: math.min(
+          LZFrame.maxEncodedLength(rect.width * rect.height),
+          budget - bodyLength,
+        ),
+        table: table,
+      );
+      if (length < 0) {
+        return null;
+      }
+
+      rects.add(
+        LZDamageRect(rect, sequences.sublistView(offset, offset + length)),
+      );
+      offset += length;
+      bodyLength += length;
+    }
+
+    return LZDeltaFramePacket(rects);
+  }
+}
+
+/// Copies [source] of the previous frame by ([dx], [dy]).
+class CopyRect implements ByteSerializable {
+  CopyRect(this.source, {required this.dx, required this.dy});
+
+  final IntRect source;
+  final int dx;
+  final int dy;
+
+  IntRect get destination => source.translate(dx, dy);
+
+  @override
+  int get encodedLength => 6;
+
+  @override
+  int writeInto(ByteData data, int offset) {
+    data.setUint8(offset, source.left);
+    data.setUint8(offset + 1, source.top);
+    data.setUint8(offset + 2, source.width);
+    data.setUint8(offset + 3, source.height);
+    data.setUint8(offset + 4, source.left + dx);
+    data.setUint8(offset + 5, source.top + dy);
+
+    return offset + 6;
+  }
+}
+
+/// Copies rects of the previous frame around on the device, e.g. to scroll,
+/// followed by a [patch] frame for the pixels that couldn't be copied.
+///
+/// The device needs a shadow framebuffer for this (see
+/// flrd_set_shadow_framebuffer).
+class CopyRectsFramePacket extends FramePacket {
+  CopyRectsFramePacket(this.copies, {this.patch})
+      : assert(copies.length <= maxCopies);
+
+  /// The copy count is sent as a single byte.
+  static const maxCopies = 255;
+
+  final List<CopyRect> copies;
+
+  /// Sent right after the copies, as a separate packet.
+  final FramePacket? patch;
+
+  @override
+  final encoding = FrameEncoding.copyRects;
+
+  @override
+  int get frameBodyLength {
+    return 1 + copies.length * 6 + (patch?.encodedLength ?? 0);
+  }
+
+  @override
+  int writeFrameBody(ByteData data, int offset) {
+    data.setUint8(offset, copies.length);
+    offset += 1;
+
+    for (final copy in copies) {
+      offset = copy.writeInto(data, offset);
+    }
+
+    return patch?.writeInto(data, offset) ?? offset;
+  }
+
+  /// Returns a copy of [image] with [copies] applied, i.e. what the device
+  /// shows after the copies, but before the patch.
+  static ImageData applyTo(ImageData image, Iterable<CopyRect> copies) {
+    final bytes = Uint8List.fromList(image.bytes);
+    final stride = image.stride;
+    final bpp = image.bpp;
+
+    for (final copy in copies) {
+      final source = copy.source;
+      final rowLength = source.width * bpp;
+
+      // Same as on the device: copying downwards starts at the bottom, so
+      // source rows aren't overwritten before they were copied.
+      for (var i = 0; i < source.height; i++) {
+        final row = copy.dy > 0 ? source.height - 1 - i : i;
+        final from = (source.top + row) * stride + source.left * bpp;
+        final to = (source.top + row + copy.dy) * stride +
+            (source.left + copy.dx) * bpp;
+
+        bytes.setRange(to, to + rowLength, bytes, from);
+      }
+    }
+
+    return ImageData(
+      bytes,
+      format: image.format,
+      width: image.width,
+      height: image.height,
+      stride: stride,
+    );
+  }
+
+  /// Builds a copy rects frame for [image] if [detector] finds that the
+  /// content scrolled since [oldImage], patched with the smallest delta
+  /// frame for what's left.
+  ///
+  /// Returns null if nothing scrolled, or if the patch would be a keyframe
+  /// anyway.
+  static CopyRectsFramePacket? build(
+    ImageData image, {
+    required ImageData oldImage,
+    required ScrollDetector detector,
+    TileDamageTracker? damageTracker,
+  }) {
+    final copy = detector.detect(oldImage: oldImage, newImage: image);
+    if (copy == null) {
+      return null;
+    }
+
+    final copied = applyTo(oldImage, [copy]);
+
+    final patch = FramePacket.build(
+      image,
+      old: copied,
+      damagedRects: damageTracker?.findDamagedRects(
+        oldImage: copied,
+        newImage: image,
+      ),
+    );
+
+    if (patch != null && patch.encoding.isKeyframe) {
+      return null;
+    }
+
+    return CopyRectsFramePacket([copy], patch: patch);
+  }
+}
+
+/// Stores the tile of the screen at ([x], [y]) in a slot of the device's
+/// tile cache, or draws the tile cached in [slot] at ([x], [y]).
+class TileOp implements ByteSerializable {
+  TileOp.store(this.x, this.y, this.slot) : store = true;
+
+  TileOp.draw(this.x, this.y, this.slot) : store = false;
+
+  /// Set in the slot of store ops.
+  static const storeFlag = 0x8000;
+
+  final int x;
+  final int y;
+  final int slot;
+  final bool store;
+
+  @override
+  int get encodedLength => 4;
+
+  @override
+  int writeInto(ByteData data, int offset) {
+    data.setUint8(offset, x);
+    data.setUint8(offset + 1, y);
+    data.setUint16(offset + 2, store ? slot | storeFlag : slot, Endian.little);
+
+    return offset + 4;
+  }
+}
+
+/// Stores tiles of the screen in the device's tile cache and draws cached
+/// tiles, followed by a [patch] frame for everything else.
+///
+/// The device needs a tile cache and a shadow framebuffer for this (see
+/// flrd_set_tile_cache). Ops are run in order, so stores should come first
+/// to store tiles of the previous frame. See [TileCache] for building these.
+class TilesFramePacket extends FramePacket {
+  TilesFramePacket(this.ops, {this.patch}) : assert(ops.length <= maxOps);
+
+  /// The op count is sent as a 16 bit word.
+  static const maxOps = 0xFFFF;
+
+  final List<TileOp> ops;
+
+  /// Sent right after the ops, as a separate packet.
+  final FramePacket? patch;
+
+  @override
+  final encoding = FrameEncoding.tiles;
+
+  @override
+  int get frameBodyLength {
+    return 2 + ops.length * 4 + (patch?.encodedLength ?? 0);
+  }
+
+  @override
+  int writeFrameBody(ByteData data, int offset) {
+    data.setUint16(offset, ops.length, Endian.little);
+    offset += 2;
+
+    for (final op in ops) {
+      offset = op.writeInto(data, offset);
+    }
+
+    return patch?.writeInto(data, offset) ?? offset;
+  }
+}
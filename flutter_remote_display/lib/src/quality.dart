@@ -0,0 +1,187 @@
+import 'dart:typed_data';
+
+import 'package:flutter_remote_display/src/encoding.dart';
+
+/// The color depth frames are encoded with.
+///
+/// Lossy qualities reduce the bits per channel before the frame is
+/// encoded, but still send RGB565 pixels, so the device doesn't know the
+/// difference. Fewer colors make longer RLE runs, more repeated content
+/// for LZ and fit more frames into a palette.
+enum FrameQuality {
+  lossless(redBits: 5, greenBits: 6, blueBits: 5),
+  rgb444(redBits: 4, greenBits: 4, blueBits: 4),
+  rgb332(redBits: 3, greenBits: 3, blueBits: 2);
+
+  const FrameQuality({
+    required this.redBits,
+    required this.greenBits,
+    required this.blueBits,
+  });
+
+  final int redBits;
+  final int greenBits;
+  final int blueBits;
+
+  bool get isLossless => this == lossless;
+
+  /// A 4x4 ordered dither matrix.
+  static const _bayer = [0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5];
+
+  /// For every threshold of [_bayer] (and a 17th one for rounding without
+  /// dithering), maps each red, green and blue value of an RGB565 pixel to
+  /// the reduced value, already shifted into place.
+  static final _tables = <FrameQuality, List<Uint16List>>{};
+
+  /// Maps the [fromBits] values of a channel at [shift] in an RGB565 pixel
+  /// to the nearest of the 2^[toBits] levels, for each threshold.
+  static List<Uint16List> _channelTables(int fromBits, int toBits, int shift) {
+    final maxValue = (1 << fromBits) - 1;
+    final maxLevel = (1 << toBits) - 1;
+
+    return [
+      for (var threshold = 0; threshold <= _bayer.length; threshold++)
+        Uint16List.fromList([
+          for (var value = 0; value <= maxValue; value++)
+            _expand(
+                  _level(value, maxValue, maxLevel, threshold),
+                  maxValue,
+                  maxLevel,
+                ) <<
+                shift,
+        ]),
+    ];
+  }
+
+  static int _level(int value, int maxValue, int maxLevel, int threshold) {
+    // Dithered, the value is offset by (threshold + 1/2) / 16 of a level,
+    // otherwise by half a level, i.e. it's rounded.
+    final n = _bayer.length;
+    final offset =
+        threshold < n ? (2 * threshold + 1) * maxValue : n * maxValue;
+
+    return (2 * n * value * maxLevel + offset) ~/ (2 * n * maxValue);
+  }
+
+  /// Scales [level] back to the full range of the channel, e.g. level 15 of
+  /// 4 bits is 31 of 5 bits.
+  static int _expand(int level, int maxValue, int maxLevel) =>
+      (2 * level * maxValue + maxLevel) ~/ (2 * maxLevel);
+
+  List<Uint16List> get _channels => _tables.putIfAbsent(this, () {
+        final red = _channelTables(5, redBits, 11);
+        final green = _channelTables(6, greenBits, 5);
+        final blue = _channelTables(5, blueBits, 0);
+
+        return [
+          for (var t = 0; t <= _bayer.length; t++) ...[
+            red[t],
+            green[t],
+            blue[t],
+          ],
+        ];
+      });
+
+  /// Returns the RGB565 [image] reduced to this quality, or [image] itself
+  /// if this is [lossless].
+  ///
+  /// With [dither], a 4x4 ordered dither hides the banding of gradients.
+  /// That costs compression: colors between two levels become a pattern
+  /// instead of a run, which LZ handles much better than RLE.
+  ImageData apply(ImageData image, {bool dither = false}) {
+    assert(image.format == PixelFormat.rgb565);
+
+    if (isLossless) {
+      return image;
+    }
+
+    final channels = _channels;
+    final source = image.bytes;
+    final stride = image.stride;
+    final bytes = Uint8List(stride * image.height);
+
+    for (var y = 0; y < image.height; y++) {
+      for (var x = 0; x < image.width; x++) {
+        final offset = y * stride + x * 2;
+        final pixel = source[offset] | (source[offset + 1] << 8);
+
+        final threshold =
+            dither ? _bayer[(y & 3) * 4 + (x & 3)] : _bayer.length;
+        final t = threshold * 3;
+
+        final reduced = channels[t][pixel >> 11] |
+            channels[t + 1][(pixel >> 5) & 0x3F] |
+            channels[t + 2][pixel & 0x1F];
+
+        bytes[offset] = reduced & 0xFF;
+        bytes[offset + 1] = reduced >> 8;
+      }
+    }
+
+    return ImageData(
+      bytes,
+      format: image.format,
+      width: image.width,
+      height: image.height,
+      stride: stride,
+    );
+  }
+}
+
+/// Picks the [FrameQuality] of each frame from the measured throughput of
+/// the link, so frames keep flowing when it's slow.
+///
+/// Frames are sent lossless as long as they're expected to go out within
+/// [maxLatency], otherwise the best quality that fits (or the lowest one).
+/// Once no frame was sent for [idleRefreshDelay], the lossy areas should
+/// be refreshed lossless.
+class AdaptiveQuality {
+  AdaptiveQuality({
+    this.maxLatency = const Duration(milliseconds: 150),
+    this.idleRefreshDelay = const Duration(milliseconds: 300),
+    this.minSampleBytes = 2048,
+  });
+
+  /// How long sending a frame may take before quality is reduced.
+  final Duration maxLatency;
+
+  /// How long the link has to be idle before lossy areas are refreshed.
+  final Duration idleRefreshDelay;
+
+  /// Transfers smaller than this are dominated by latency rather than
+  /// throughput, so they aren't measured.
+  final int minSampleBytes;
+
+  double? _bytesPerSecond;
+
+  /// The smoothed throughput of the link, or null before it was measured.
+  double? get bytesPerSecond => _bytesPerSecond;
+
+  /// Records that sending [bytes] took [elapsed].
+  void addSample(int bytes, Duration elapsed) {
+    if (bytes < minSampleBytes || elapsed <= Duration.zero) {
+      return;
+    }
+
+    final sample = bytes * Duration.microsecondsPerSecond /
+        elapsed.inMicroseconds;
+    final previous = _bytesPerSecond;
+
+    _bytesPerSecond =
+        previous == null ? sample : previous * 0.7 + sample * 0.3;
+  }
+
+  /// The most bytes a frame may have to be sent within [maxLatency], or
+  /// null before the throughput was measured.
+  int? get maxFrameBytes {
+    final bytesPerSecond = _bytesPerSecond;
+    if (bytesPerSecond == null) {
+      return null;
+    }
+
+    return (bytesPerSecond *
+            maxLatency.inMicroseconds /
+            Duration.microsecondsPerSecond)
+        .floor();
+  }
+}
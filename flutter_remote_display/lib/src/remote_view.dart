@@ -1,5 +1,6 @@
 import 'dart:async';
 
+import 'package:flutter/foundation.dart';
 import 'package:flutter/gestures.dart';
 import 'package:flutter/rendering.dart';
 import 'package:flutter/scheduler.dart';
@@ -24,6 +25,10 @@ class RemoteView extends StatefulWidget {
 
 class _RemoteViewState extends State<RemoteView> {
   final _repaintBoundaryKey = GlobalKey<_RemoteViewState>();
+
+  /// Whether the next frame is captured even if nothing was repainted.
+  var _forceCapture = false;
+
   BoxHitTestResult? _hitTestResult;
 
   late StreamSubscription _displayToHostSub;
@@ -38,12 +43,26 @@ class _RemoteViewState extends State<RemoteView> {
     if (!widget.connection.isConnected) return;
 
     final renderObject = _repaintBoundaryKey.currentContext?.findRenderObject()
-        as RenderRepaintBoundary?;
+        as RenderCaptureBoundary?;
 
     if (renderObject == null) {
       return;
     }
 
+    // Post-frame callbacks run for every frame of the app, but only frames
+    // that repainted the view need to be read back and diffed.
+    var (repainted, damagedRegions) = renderObject.takeRepainted();
+
+    if (_forceCapture) {
+      repainted = true;
+      damagedRegions = null;
+      _forceCapture = false;
+    }
+
+    if (!repainted) {
+      return;
+    }
+
     // ignore: invalid_use_of_protected_member
     final frame = await (renderObject.layer as OffsetLayer).toImage(
       Offset.zero & renderObject.size,
@@ -52,7 +71,7 @@ class _RemoteViewState extends State<RemoteView> {
     // final frame = await renderObject.toImage();
     if (!mounted) return;
 
-    widget.connection.addFrame(frame);
+    widget.connection.addFrame(frame, damagedRegions: damagedRegions);
 
     frame.dispose();
   }
@@ -152,6 +171,7 @@ class _RemoteViewState extends State<RemoteView> {
   void reassemble() {
     super.reassemble();
 
+    _forceCapture = true;
     _captureFrame();
   }
 
@@ -163,9 +183,268 @@ class _RemoteViewState extends State<RemoteView> {
 
   @override
   Widget build(BuildContext context) {
-    return RepaintBoundary(
+    return CaptureBoundary(
       key: _repaintBoundaryKey,
       child: widget.child,
     );
   }
 }
+
+/// A [RepaintBoundary] that knows whether its content was repainted.
+@visibleForTesting
+class CaptureBoundary extends SingleChildRenderObjectWidget {
+  const CaptureBoundary({super.key, super.child});
+
+  @override
+  RenderRepaintBoundary createRenderObject(BuildContext context) {
+    return RenderCaptureBoundary();
+  }
+}
+
+/// Where a leaf layer ended up on the screen, and how it looks there.
+class _LeafState {
+  _LeafState(this.transform, this.effects, this.bounds);
+
+  /// From the leaf to the root.
+  final Matrix4 transform;
+
+  /// The properties of the layers above the leaf that change how it looks
+  /// without moving it, like opacity, clips and filters.
+  final List<Object?> effects;
+
+  /// Where the leaf is, in the coordinates of the root and clipped, or null
+  /// if it isn't a picture, so it's unknown.
+  final Rect? bounds;
+
+  bool sameAs(_LeafState other) {
+    return transform == other.transform && listEquals(effects, other.effects);
+  }
+
+  /// The properties of [layer] that change how its children look, or null
+  /// if they're only moved, which the transform covers.
+  ///
+  /// Paths and shaders have no value equality, so new ones count as
+  /// changed even if they're the same.
+  static Object? effectOf(ContainerLayer layer) {
+    return switch (layer) {
+      OpacityLayer(:final alpha) => (alpha,),
+      ClipRectLayer(:final clipRect, :final clipBehavior) => (
+          clipRect,
+          clipBehavior,
+        ),
+      ClipRRectLayer(:final clipRRect, :final clipBehavior) => (
+          clipRRect,
+          clipBehavior,
+        ),
+      ClipPathLayer(:final clipPath, :final clipBehavior) => (
+          clipPath,
+          clipBehavior,
+        ),
+      ColorFilterLayer(:final colorFilter) => (colorFilter,),
+      ImageFilterLayer(:final imageFilter) => (imageFilter,),
+      ShaderMaskLayer(:final shader, :final maskRect, :final blendMode) => (
+          shader,
+          maskRect,
+          blendMode,
+        ),
+      BackdropFilterLayer(:final filter, :final blendMode) => (
+          filter,
+          blendMode,
+        ),
+      _ => null,
+    };
+  }
+
+  /// The bounds of what [layer] clips its children to, in its own
+  /// coordinates, or null if it doesn't clip.
+  static Rect? clipOf(ContainerLayer layer) {
+    return switch (layer) {
+      ClipRectLayer(:final clipRect?, :final clipBehavior)
+          when clipBehavior != Clip.none =>
+        clipRect,
+      ClipRRectLayer(:final clipRRect?, :final clipBehavior)
+          when clipBehavior != Clip.none =>
+        clipRRect.outerRect,
+      ClipPathLayer(:final clipPath?, :final clipBehavior)
+          when clipBehavior != Clip.none =>
+        clipPath.getBounds(),
+      _ => null,
+    };
+  }
+}
+
+/// The leaf layers (mostly pictures) of a layer tree, in paint order, and
+/// where they are.
+class _LayerSnapshot {
+  final leaves = <Layer>[];
+
+  /// Where each leaf is, so leaves that were only moved or faded (e.g. by
+  /// scrolling or an opacity animation, which don't repaint) are noticed.
+  final states = <Layer, _LeafState>{};
+
+  /// Whether there's a backdrop filter, which also changes when anything
+  /// below it changes, anywhere.
+  var hasBackdropFilter = false;
+
+  void _add(
+    Layer layer,
+    Matrix4 transform,
+    List<Object?> effects,
+    Rect? clip,
+  ) {
+    if (layer is ContainerLayer) {
+      final effect = _LeafState.effectOf(layer);
+      if (effect != null) {
+        effects = [...effects, effect];
+      }
+
+      final layerClip = _LeafState.clipOf(layer);
+      if (layerClip != null) {
+        final rect = MatrixUtils.transformRect(transform, layerClip);
+        clip = clip != null ? clip.intersect(rect) : rect;
+      }
+
+      if (layer is BackdropFilterLayer) {
+        hasBackdropFilter = true;
+      }
+
+      for (var child = layer.firstChild;
+          child != null;
+          child = child.nextSibling) {
+        final childTransform = transform.clone();
+        layer.applyTransform(child, childTransform);
+
+        _add(child, childTransform, effects, clip);
+      }
+      return;
+    }
+
+    var bounds = layer is PictureLayer
+        ? MatrixUtils.transformRect(transform, layer.canvasBounds)
+        : null;
+    if (bounds != null && clip != null) {
+      bounds = bounds.intersect(clip);
+    }
+
+    leaves.add(layer);
+    states[layer] = _LeafState(transform, effects, bounds);
+  }
+
+  /// Takes a snapshot of the layers below [root], in its coordinates.
+  static _LayerSnapshot of(ContainerLayer root) {
+    final snapshot = _LayerSnapshot();
+
+    // Frames are read back in the coordinates of the root, so its own
+    // offset doesn't count.
+    for (var child = root.firstChild;
+        child != null;
+        child = child.nextSibling) {
+      snapshot._add(child, Matrix4.identity(), const [], null);
+    }
+
+    return snapshot;
+  }
+}
+
+/// The render object of [CaptureBoundary].
+@visibleForTesting
+class RenderCaptureBoundary extends RenderRepaintBoundary {
+  var _painted = false;
+  var _snapshot = _LayerSnapshot();
+
+  @override
+  void paint(PaintingContext context, Offset offset) {
+    super.paint(context, offset);
+    _painted = true;
+  }
+
+  /// Whether this boundary, or a boundary nested in it, repainted since the
+  /// last call, and where, or null if it's unknown where.
+  ///
+  /// Nested boundaries (e.g. around list items, progress indicators or a
+  /// clock) repaint without this one being painted, but their new pictures
+  /// show up in its layer tree, which is cheap to walk. Layers can also move
+  /// or fade without anything being painted, e.g. when scrolling past list
+  /// items behind their own repaint boundaries, or for opacity animations,
+  /// so the transforms and effects above each leaf are compared as well.
+  ///
+  /// Every leaf that was added, removed, moved or faded counts as damaged,
+  /// where it was and where it is.
+  (bool, List<IntRect>?) takeRepainted() {
+    final layer = this.layer;
+    final previous = _snapshot;
+    final snapshot =
+        layer != null ? _LayerSnapshot.of(layer) : _LayerSnapshot();
+
+    _snapshot = snapshot;
+
+    if (_painted) {
+      _painted = false;
+      return (true, null);
+    }
+
+    // Leaves that were there before and still are have to be in the same
+    // order, otherwise anything they overlap may look different.
+    final kept = [
+      for (final leaf in snapshot.leaves)
+        if (previous.states.containsKey(leaf)) leaf,
+    ];
+    final keptBefore = [
+      for (final leaf in previous.leaves)
+        if (snapshot.states.containsKey(leaf)) leaf,
+    ];
+    if (!listEquals(kept, keptBefore)) {
+      return (true, null);
+    }
+
+    final damage = <Rect?>[];
+
+    for (final leaf in snapshot.leaves) {
+      final state = snapshot.states[leaf]!;
+      final before = previous.states[leaf];
+
+      if (before == null) {
+        damage.add(state.bounds);
+      } else if (!before.sameAs(state)) {
+        damage.add(before.bounds);
+        damage.add(state.bounds);
+      }
+    }
+
+    for (final leaf in previous.leaves) {
+      if (!snapshot.states.containsKey(leaf)) {
+        damage.add(previous.states[leaf]!.bounds);
+      }
+    }
+
+    if (damage.isEmpty) {
+      return (false, null);
+    }
+
+    if (snapshot.hasBackdropFilter || previous.hasBackdropFilter) {
+      return (true, null);
+    }
+
+    final regions = <IntRect>[];
+
+    for (final bounds in damage) {
+      if (bounds == null) {
+        return (true, null);
+      }
+
+      final rect = bounds.intersect(Offset.zero & size);
+      if (!rect.isEmpty) {
+        regions.add(
+          IntRect.fromLTRB(
+            rect.left.floor(),
+            rect.top.floor(),
+            rect.right.ceil(),
+            rect.bottom.ceil(),
+          ),
+        );
+      }
+    }
+
+    return (true, regions);
+  }
+}
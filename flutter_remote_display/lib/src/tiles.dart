@@ -0,0 +1,235 @@
+import 'dart:typed_data';
+
+import 'package:flutter_remote_display/src/damage.dart';
+import 'package:flutter_remote_display/src/encoding.dart';
+import 'package:flutter_remote_display/src/protocol.dart';
+
+/// Mirrors the tile cache of the device (see flrd_set_tile_cache), so
+/// content that was sent before, like digits of a clock or icons, can be
+/// drawn from the cache instead of being resent.
+///
+/// Tiles are [tileSize] x [tileSize] pixels on a fixed grid. Changed tiles
+/// that aren't cached are sent as pixels, and stored in the device's cache
+/// with the next frame, while they are still on screen. Tiles are looked up
+/// by a hash of their content, and compared exactly on a hit.
+///
+/// When the cache is full, the least recently used slot is evicted (the
+/// lowest one on ties), so the device and this mirror never disagree about
+/// which tile is in which slot, as long as every packet returned by [build]
+/// is sent.
+class TileCache {
+  TileCache({required this.slots})
+      : assert(slots > 0 && slots <= TileOp.storeFlag),
+        _slotHashes = Int32List(slots),
+        _lastUsed = Int32List(slots)..fillRange(0, slots, -1),
+        _tiles = List.filled(slots, null);
+
+  /// Width and height of a tile, in pixels. Same as FLRD_TILE_SIZE.
+  static const tileSize = 16;
+
+  /// The number of tiles the device can cache.
+  final int slots;
+
+  /// Maps content hashes to the slot with that content.
+  final _slotsByHash = <int, int>{};
+  final Int32List _slotHashes;
+  final Int32List _lastUsed;
+  final List<Uint8List?> _tiles;
+  var _clock = 0;
+
+  /// Tiles that were sent as pixels for [_pendingImage], and are stored
+  /// when the next frame is built on top of it.
+  ImageData? _pendingImage;
+  var _pending = <(int, int, int, Uint8List)>[];
+
+  static Uint8List _tileBytes(ImageData image, int x, int y) {
+    final rowLength = tileSize * image.bpp;
+    final tile = Uint8List(tileSize * rowLength);
+
+    for (var row = 0; row < tileSize; row++) {
+      final start = (y + row) * image.stride + x * image.bpp;
+      tile.setRange(row * rowLength, (row + 1) * rowLength, image.bytes, start);
+    }
+
+    return tile;
+  }
+
+  static bool _tileEquals(ImageData a, ImageData b, int x, int y) {
+    final rowLength = tileSize * a.bpp;
+
+    for (var row = 0; row < tileSize; row++) {
+      final aStart = (y + row) * a.stride + x * a.bpp;
+      final bStart = (y + row) * b.stride + x * b.bpp;
+
+      for (var i = 0; i < rowLength; i++) {
+        if (a.bytes[aStart + i] != b.bytes[bStart + i]) {
+          return false;
+        }
+      }
+    }
+
+    return true;
+  }
+
+  /// Whether all pixels of [tile] are the same. Those are cheap to send
+  /// anyway, so they aren't worth a slot.
+  static bool _isUniform(Uint8List tile, int bpp) {
+    for (var i = bpp; i < tile.length; i++) {
+      if (tile[i] != tile[i % bpp]) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  static int _hash(Uint8List tile) {
+    var hash = 17;
+    for (final byte in tile) {
+      hash = (hash * 31 + byte) & 0x3FFFFFFF;
+    }
+    return hash;
+  }
+
+  int? _lookup(int hash, Uint8List tile) {
+    final slot = _slotsByHash[hash];
+    if (slot == null) {
+      return null;
+    }
+
+    final cached = _tiles[slot]!;
+    for (var i = 0; i < tile.length; i++) {
+      if (cached[i] != tile[i]) {
+        return null;
+      }
+    }
+
+    return slot;
+  }
+
+  int _store(int hash, Uint8List tile) {
+    var slot = 0;
+    for (var i = 1; i < slots; i++) {
+      if (_lastUsed[i] < _lastUsed[slot]) {
+        slot = i;
+      }
+    }
+
+    if (_tiles[slot] != null && _slotsByHash[_slotHashes[slot]] == slot) {
+      _slotsByHash.remove(_slotHashes[slot]);
+    }
+
+    _tiles[slot] = tile;
+    _slotHashes[slot] = hash;
+    _slotsByHash[hash] = slot;
+    _lastUsed[slot] = _clock++;
+
+    return slot;
+  }
+
+  /// Forgets all cached and pending tiles, e.g. because the device's cache
+  /// can't be trusted anymore. Slots are reused from the start.
+  void clear() {
+    _slotsByHash.clear();
+    _slotHashes.fillRange(0, slots, 0);
+    _lastUsed.fillRange(0, slots, -1);
+    _tiles.fillRange(0, slots, null);
+    _pendingImage = null;
+    _pending = [];
+  }
+
+  /// Builds a tiles frame for [image] that stores the tiles sent for
+  /// [oldImage] and draws the changed tiles of [image] that are cached,
+  /// patched with the smallest frame for what's left.
+  ///
+  /// Returns null if there's nothing to store or draw. Otherwise, the packet
+  /// must be sent, since the cache now assumes the device ran its ops.
+  TilesFramePacket? build(
+    ImageData image, {
+    required ImageData oldImage,
+    TileDamageTracker? damageTracker,
+  }) {
+    assert(oldImage.width == image.width);
+    assert(oldImage.height == image.height);
+    assert(oldImage.bpp == image.bpp);
+
+    final ops = <TileOp>[];
+
+    if (identical(oldImage, _pendingImage)) {
+      for (final (x, y, hash, tile) in _pending) {
+        // Tiles with the same content may be pending more than once.
+        if (_lookup(hash, tile) == null) {
+          ops.add(TileOp.store(x, y, _store(hash, tile)));
+        }
+      }
+    }
+
+    _pendingImage = image;
+    _pending = [];
+
+    final draws = <(TileOp, Uint8List)>[];
+
+    for (var y = 0; y + tileSize <= image.height; y += tileSize) {
+      for (var x = 0; x + tileSize <= image.width; x += tileSize) {
+        if (_tileEquals(oldImage, image, x, y)) {
+          continue;
+        }
+
+        final tile = _tileBytes(image, x, y);
+        final hash = _hash(tile);
+        final slot = _lookup(hash, tile);
+
+        if (slot != null) {
+          _lastUsed[slot] = _clock++;
+          draws.add((TileOp.draw(x, y, slot), tile));
+        } else if (!_isUniform(tile, image.bpp)) {
+          _pending.add((x, y, hash, tile));
+        }
+      }
+    }
+
+    if (ops.isEmpty && draws.isEmpty) {
+      return null;
+    }
+
+    ops.addAll(draws.map((draw) => draw.$1));
+
+    final drawn = _applyDraws(oldImage, draws);
+
+    final patch = FramePacket.build(
+      image,
+      old: drawn,
+      damagedRects: damageTracker?.findDamagedRects(
+        oldImage: drawn,
+        newImage: image,
+      ),
+    );
+
+    return TilesFramePacket(ops, patch: patch);
+  }
+
+  /// Returns a copy of [image] with the tiles of [draws] drawn, i.e. what
+  /// the device shows after the ops, but before the patch.
+  static ImageData _applyDraws(
+    ImageData image,
+    List<(TileOp, Uint8List)> draws,
+  ) {
+    final bytes = Uint8List.fromList(image.bytes);
+    final rowLength = tileSize * image.bpp;
+
+    for (final (op, tile) in draws) {
+      for (var row = 0; row < tileSize; row++) {
+        final start = (op.y + row) * image.stride + op.x * image.bpp;
+        bytes.setRange(start, start + rowLength, tile, row * rowLength);
+      }
+    }
+
+    return ImageData(
+      bytes,
+      format: image.format,
+      width: image.width,
+      height: image.height,
+      stride: image.stride,
+    );
+  }
+}
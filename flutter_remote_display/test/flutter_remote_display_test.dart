@@ -1,6 +1,138 @@
+import 'dart:async';
+import 'dart:io';
+import 'dart:typed_data';
+
+import 'package:flutter/widgets.dart';
 import 'package:flutter_remote_display/flutter_remote_display.dart';
+import 'package:flutter_remote_display/src/protocol.dart';
+import 'package:flutter_remote_display/src/remote_view.dart';
 import 'package:flutter_test/flutter_test.dart';
 
+ImageData _rgb565Image(int width, int height, {int? stride}) {
+  stride ??= width * 2;
+
+  return ImageData(
+    Uint8List(stride * height),
+    format: PixelFormat.rgb565,
+    width: width,
+    height: height,
+    stride: stride,
+  );
+}
+
+void _setPixel(ImageData image, int x, int y, int value) {
+  final offset = image.getOffset(x, y);
+  image.bytes[offset] = value & 0xFF;
+  image.bytes[offset + 1] = value >> 8;
+}
+
+/// A static header of 6 rows, above a list of rows with distinct content,
+/// scrolled down by [scrollOffset] rows.
+ImageData _scrolledList(int width, int height, int scrollOffset) {
+  final image = _rgb565Image(width, height);
+
+  for (var y = 0; y < height; y++) {
+    final content = y + scrollOffset;
+
+    for (var x = 0; x < width; x++) {
+      _setPixel(image, x, y, y < 6 ? 0x001F : (content * 97 + x * 13) & 0xFFFF);
+    }
+  }
+
+  return image;
+}
+
+/// A vertical gradient, dithered with a 4x4 ordered dither: single pixel
+/// runs of many colors, which RLE and palettes compress badly.
+ImageData _ditheredGradient(int width, int height) {
+  const bayer = [0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5];
+  final image = _rgb565Image(width, height);
+
+  for (var y = 0; y < height; y++) {
+    for (var x = 0; x < width; x++) {
+      _setPixel(image, x, y, y * 16 + bayer[(y % 4) * 4 + x % 4]);
+    }
+  }
+
+  return image;
+}
+
+/// Decodes [nPixels] pixels encoded by [LZFrame.encode].
+List<int> _lzDecode(Uint8List sequences, int nPixels) {
+  final pixels = <int>[];
+  var i = 0;
+
+  int readLength(int nibble) {
+    var length = nibble;
+    if (nibble == 15) {
+      int byte;
+      do {
+        byte = sequences[i++];
+        length += byte;
+      } while (byte == 255);
+    }
+    return length;
+  }
+
+  while (pixels.length < nPixels) {
+    final token = sequences[i++];
+
+    for (var n = readLength(token >> 4); n > 0; n--) {
+      pixels.add(sequences[i] | sequences[i + 1] << 8);
+      i += 2;
+    }
+
+    if (pixels.length == nPixels) {
+      break;
+    }
+
+    final offset = sequences[i] | sequences[i + 1] << 8;
+    i += 2;
+
+    final length = readLength(token & 0x0F) + LZFrame.minMatch;
+    for (var n = 0; n < length; n++) {
+      pixels.add(pixels[pixels.length - offset]);
+    }
+  }
+
+  expect(i, sequences.length);
+  return pixels;
+}
+
+/// A row of 16x16 tiles, each showing a distinct pattern per digit.
+ImageData _digits(List<int> digits) {
+  final image = _rgb565Image(digits.length * 16, 16);
+
+  for (final (i, digit) in digits.indexed) {
+    for (var y = 0; y < 16; y++) {
+      for (var x = 0; x < 16; x++) {
+        final on = (x * (digit + 1) + y * (digit + 3)) % 5 < 2;
+        _setPixel(image, i * 16 + x, y, on ? 0xFFFF : 0x0841);
+      }
+    }
+  }
+
+  return image;
+}
+
+/// The packets sent for [frames] with [cache], like
+/// BluetoothDisplayConnection.addFrame does.
+List<FramePacket> _tilePackets(TileCache cache, List<ImageData> frames) {
+  final packets = <FramePacket>[FramePacket.buildKeyFrame(frames.first)];
+
+  for (var i = 1; i < frames.length; i++) {
+    packets.add(
+      cache.build(frames[i], oldImage: frames[i - 1]) ??
+          FramePacket.build(frames[i], old: frames[i - 1])!,
+    );
+  }
+
+  return packets;
+}
+
+/// Runs everything that's scheduled as a microtask, e.g. `then` callbacks.
+Future<void> _flushMicrotasks() => Future.delayed(Duration.zero);
+
 void main() {
   const blueRgba8888 = 0xFFFF0000;
 
@@ -23,4 +155,1137 @@ void main() {
 
     expect(rgb565, 0x00F8);
   });
+
+  test('RGBA8888 to RGB565 fast path matches the per-byte conversion', () {
+    final rgba = Uint8List(64 * 4);
+    for (var i = 0; i < rgba.length; i++) {
+      rgba[i] = (i * 37 + 11) & 0xFF;
+    }
+
+    final converter = PixelFormatConverter(
+      PixelFormat.rgba8888,
+      PixelFormat.rgb565,
+    );
+
+    // A plain list takes the per-byte path.
+    expect(converter.convert(rgba), converter.convert(List.of(rgba)));
+
+    final image = ImageData(
+      converter.convert(rgba),
+      format: PixelFormat.rgb565,
+      width: 8,
+      height: 8,
+    );
+
+    for (var y = 0; y < image.height; y++) {
+      expect(
+        image.getRow(y),
+        [for (var x = 0; x < image.width; x++) image.getPixelValue(x, y)],
+      );
+    }
+
+    expect(
+      image.getPixelValue(0, 0),
+      PixelFormat.convert(
+        rgba.toInt(length: 4),
+        sourceFormat: PixelFormat.rgba8888,
+        destFormat: PixelFormat.rgb565,
+      ),
+    );
+  });
+
+  test('RLE runs cross rows and are split at 255 pixels', () {
+    final image = _rgb565Image(200, 3);
+    for (var x = 0; x < 200; x++) {
+      _setPixel(image, x, 2, 0x1234);
+    }
+    _setPixel(image, 199, 1, 0xABCD);
+
+    final runs = Uint8List(RLEFrame.maxEncodedLength(200 * 3));
+    final length = RLEFrame.encodeRuns(image, runs);
+
+    expect(runs.sublist(0, length), [
+      4, 0, // run count
+      255, 0x00, 0x00, // rows 0 and 1 ...
+      144, 0x00, 0x00,
+      1, 0xCD, 0xAB,
+      200, 0x34, 0x12,
+    ]);
+  });
+
+  test('packets serialize in one pass into a reused buffer', () {
+    final packet = RLEDeltaFramePacket(
+      [
+        RLEDamageRect(
+          const IntRect.fromLTWH(1, 2, 3, 1),
+          Uint8List.fromList([1, 0, 3, 0x34, 0x12]),
+        ),
+      ],
+      pixelFormat: PixelFormat.rgb565,
+    );
+
+    const expected = [
+      9, 3, // frame packet, RLE deltaframe
+      1, 0, // rect count
+      1, 2, 3, 1, // rect
+      1, 0, 3, 0x34, 0x12, // runs
+    ];
+
+    expect(packet.encodedLength, expected.length);
+    expect(packet.toBytes(), expected);
+
+    final buffer = Uint8List(32);
+    final end = packet.writeInto(ByteData.sublistView(buffer), 4);
+
+    expect(end, 4 + expected.length);
+    expect(buffer.sublist(4, end), expected);
+  });
+
+  test('palette indices are packed LSB first', () {
+    final image = _rgb565Image(3, 2);
+    _setPixel(image, 0, 0, 0x1111);
+    _setPixel(image, 1, 0, 0x2222);
+    _setPixel(image, 2, 0, 0x1111);
+    for (var x = 0; x < 3; x++) {
+      _setPixel(image, x, 1, 0x3333);
+    }
+
+    final packet = PaletteKeyFramePacket.build(image)!;
+
+    expect(packet.palette.rle, isFalse);
+    expect(packet.toBytes(), [
+      9, 4, // frame packet, palette keyframe
+      2, 2, // 3 colors, 2 bits per index
+      0x11, 0x11, 0x22, 0x22, 0x33, 0x33, // colors
+      0 | 1 << 2 | 0 << 4 | 2 << 6, 2 | 2 << 2, // indices
+    ]);
+  });
+
+  test('palette indices are RLE encoded if that is smaller', () {
+    final image = _rgb565Image(20, 20);
+    for (var y = 10; y < 20; y++) {
+      for (var x = 0; x < 20; x++) {
+        _setPixel(image, x, y, 0xFFFF);
+      }
+    }
+
+    final packet = PaletteKeyFramePacket.build(image)!;
+
+    expect(packet.palette.rle, isTrue);
+    expect(packet.palette.colors, [0x0000, 0xFFFF]);
+    expect(packet.indices, [2, 0, 200, 0, 200, 1]);
+  });
+
+  test('frames with more than 256 colors are not palette encoded', () {
+    final image = _rgb565Image(17, 16);
+    for (var y = 0; y < 16; y++) {
+      for (var x = 0; x < 17; x++) {
+        _setPixel(image, x, y, y * 17 + x);
+      }
+    }
+
+    expect(PaletteKeyFramePacket.build(image), isNull);
+  });
+
+  test('keyframes fall back to raw if RLE is bigger', () {
+    final flat = _rgb565Image(32, 32);
+
+    final gradient = _rgb565Image(32, 32);
+    for (var y = 0; y < 32; y++) {
+      for (var x = 0; x < 32; x++) {
+        _setPixel(gradient, x, y, y * 32 + x);
+      }
+    }
+
+    final flatPacket = FramePacket.build(flat)!;
+    final gradientPacket = FramePacket.build(gradient)!;
+
+    // A single color is slightly smaller with 1 byte palette indices than
+    // with 2 byte colors.
+    expect(flatPacket, isA<PaletteKeyFramePacket>());
+    expect(gradientPacket, isA<RawKeyFramePacket>());
+    expect(gradientPacket.encodedLength, 2 + 32 * 32 * 2);
+
+    // Everything changed, so a keyframe is smaller than a deltaframe.
+    final deltaPacket = FramePacket.build(gradient, old: flat)!;
+    expect(deltaPacket, isA<RawKeyFramePacket>());
+  });
+
+  test('LZ encodes noise, runs and repeats losslessly', () {
+    final image = _ditheredGradient(64, 48);
+    for (var y = 10; y < 20; y++) {
+      for (var x = 0; x < 64; x++) {
+        _setPixel(image, x, y, 0x07E0);
+      }
+    }
+    for (var x = 0; x < 64; x++) {
+      _setPixel(image, x, 30, (x * 2654435761) >> 7 & 0xFFFF);
+    }
+
+    final view = image.view(const IntRect.fromLTRB(3, 2, 60, 40));
+    final into = Uint8List(LZFrame.maxEncodedLength(57 * 38));
+    final length = LZFrame.encode(view, into);
+
+    expect(length, lessThan(57 * 38 * 2 ~/ 4));
+    expect(
+      _lzDecode(into.sublistView(0, length), 57 * 38),
+      [
+        for (var y = 0; y < 38; y++) ...view.getRow(y),
+      ],
+    );
+
+    expect(LZFrame.encode(view, into, maxLength: length - 1), -1);
+  });
+
+  test('dithered deltaframes are LZ encoded', () {
+    final oldImage = _rgb565Image(64, 48);
+    final newImage = _ditheredGradient(64, 48);
+
+    final packet = FramePacket.build(newImage, old: oldImage)!;
+
+    expect(packet, isA<LZDeltaFramePacket>());
+    expect(packet.encodedLength, lessThan(64 * 48 * 2 ~/ 4));
+  });
+
+  group('FrameQuality', () {
+    // Every RGB565 color once.
+    final allColors = _rgb565Image(256, 256);
+    for (var y = 0; y < 256; y++) {
+      for (var x = 0; x < 256; x++) {
+        _setPixel(allColors, x, y, y * 256 + x);
+      }
+    }
+
+    Set<int> colorsOf(ImageData image) => {
+          for (var y = 0; y < image.height; y++) ...image.getRow(y),
+        };
+
+    test('reduces the colors, keeping black and white', () {
+      expect(FrameQuality.lossless.apply(allColors), same(allColors));
+
+      for (final (quality, nColors) in [
+        (FrameQuality.rgb444, 4096),
+        (FrameQuality.rgb332, 256),
+      ]) {
+        for (final dither in [false, true]) {
+          final colors = colorsOf(quality.apply(allColors, dither: dither));
+
+          expect(colors, hasLength(nColors));
+          expect(colors, containsAll([0x0000, 0xFFFF]));
+        }
+      }
+    });
+
+    test('rounds to the nearest level, and keeps colors on a level', () {
+      final reduced = FrameQuality.rgb444.apply(allColors);
+
+      // 0x0842: red 1 of 31 and green 2 of 63 are closest to 0 of 15, blue
+      // 2 of 31 to 1 of 15, which is 2 of 31.
+      expect(reduced.getPixelValue(0x42, 0x08), 0x0002);
+      expect(FrameQuality.rgb444.apply(reduced).bytes, reduced.bytes);
+    });
+
+    test('makes gradients RLE encode smaller', () {
+      final gradient = _rgb565Image(64, 48);
+      for (var y = 0; y < 48; y++) {
+        for (var x = 0; x < 64; x++) {
+          _setPixel(gradient, x, y, (x ~/ 2) << 11 | y << 5 | x ~/ 2);
+        }
+      }
+
+      final lossless = RLEKeyFramePacket.build(gradient);
+      final lossy = RLEKeyFramePacket.build(
+        FrameQuality.rgb332.apply(gradient),
+      );
+
+      expect(lossy.encodedLength, lessThan(lossless.encodedLength ~/ 3));
+    });
+  });
+
+  test('AdaptiveQuality reduces quality if frames take too long', () {
+    final quality = AdaptiveQuality(
+      maxLatency: const Duration(milliseconds: 100),
+    );
+
+    // Frames aren't limited until the throughput was measured, and small
+    // transfers aren't measured.
+    expect(quality.maxFrameBytes, isNull);
+    quality.addSample(100, const Duration(seconds: 1));
+    expect(quality.bytesPerSecond, isNull);
+
+    quality.addSample(10000, const Duration(milliseconds: 100));
+    expect(quality.bytesPerSecond, 100000);
+    expect(quality.maxFrameBytes, 10000);
+
+    // Samples are smoothed.
+    quality.addSample(10000, const Duration(milliseconds: 50));
+    expect(quality.bytesPerSecond, closeTo(130000, 1e-6));
+  });
+
+  group('FrameEncoder', () {
+    test('reduces the quality to fit maxBytes, and refreshes', () {
+      final gradient = _rgb565Image(64, 48);
+      for (var y = 0; y < 48; y++) {
+        for (var x = 0; x < 64; x++) {
+          _setPixel(gradient, x, y, (x ~/ 2) << 11 | y << 5 | x ~/ 2);
+        }
+      }
+
+      final lossless = FrameEncoder().encode(gradient)!;
+      expect(lossless.isLossless, isTrue);
+
+      final encoder = FrameEncoder();
+      final lossy = encoder.encode(gradient, maxBytes: 2000)!;
+
+      expect(lossy.isLossless, isFalse);
+      expect(lossy.bytes.length, lessThan(lossless.bytes.length));
+
+      expect(encoder.refresh()!.isLossless, isTrue);
+      expect(encoder.refresh(), isNull);
+      expect(encoder.encode(gradient), isNull);
+    });
+
+    test('only looks for changes in damaged regions', () {
+      final oldImage = _rgb565Image(64, 48);
+      final newImage = _rgb565Image(64, 48);
+      _setPixel(newImage, 40, 30, 0xFFFF);
+
+      final encoder = FrameEncoder()..encode(oldImage);
+
+      expect(encoder.encode(newImage, damagedRegions: []), isNull);
+
+      // Switching qualities changes pixels anywhere.
+      final frame = encoder.encode(
+        newImage,
+        quality: FrameQuality.rgb444,
+        damagedRegions: [],
+      );
+      expect(frame, isNotNull);
+    });
+
+    test('resends the last frame as a lossless keyframe', () {
+      final gradient = _rgb565Image(64, 48);
+      for (var y = 0; y < 48; y++) {
+        for (var x = 0; x < 64; x++) {
+          _setPixel(gradient, x, y, (x ~/ 2) << 11 | y << 5 | x ~/ 2);
+        }
+      }
+
+      final encoder = FrameEncoder();
+      expect(encoder.keyframe(), isNull);
+
+      encoder.encode(gradient, maxBytes: 2000);
+
+      final keyframe = encoder.keyframe()!;
+      expect(keyframe.isLossless, isTrue);
+      expect(keyframe.bytes[0], PacketType.framePacket.index);
+      expect(FrameEncoding.values[keyframe.bytes[1]].isKeyframe, isTrue);
+
+      // The device shows the lossless frame now.
+      expect(encoder.refresh(), isNull);
+      expect(encoder.encode(gradient), isNull);
+    });
+
+    test('encodes the same frames on a background isolate', () async {
+      final frames = [
+        for (final offset in [0, 3, 9]) _scrolledList(32, 40, offset),
+      ];
+
+      final encoder = FrameEncoder(copyRects: true, tileCacheSlots: 4);
+      final isolate = await FrameEncoderIsolate.spawn(
+        copyRects: true,
+        tileCacheSlots: 4,
+      );
+
+      for (final frame in frames) {
+        final expected = encoder.encode(frame)!;
+        final actual = (await isolate.encode(frame))!;
+
+        expect(actual.bytes, expected.bytes);
+        expect(actual.isLossless, isTrue);
+      }
+
+      expect(await isolate.encode(frames.last), isNull);
+      expect(await isolate.refresh(), isNull);
+
+      isolate.close();
+    });
+  });
+
+  group('FramePipeline', () {
+    test('keeps at most maxFramesInFlight frames in flight', () async {
+      final sends = <int, Completer<void>>{};
+      final pipeline = FramePipeline<int>(
+        send: (frame) => (sends[frame] = Completer()).future,
+        maxFramesInFlight: 2,
+      );
+
+      final done = <int>[];
+      for (var frame = 0; frame < 3; frame++) {
+        pipeline.add(frame).then((_) => done.add(frame));
+      }
+
+      expect(sends.keys, [0, 1]);
+      expect(pipeline.framesInFlight, 2);
+
+      sends[0]!.complete();
+      await _flushMicrotasks();
+
+      expect(done, [0]);
+      expect(sends.keys, [0, 1, 2]);
+
+      sends[1]!.complete();
+      sends[2]!.complete();
+      await _flushMicrotasks();
+
+      expect(done, [0, 1, 2]);
+      expect(pipeline.isIdle, isTrue);
+    });
+
+    test('supersedes frames waiting for the link', () async {
+      final sends = <int, Completer<void>>{};
+      final pipeline = FramePipeline<int>(
+        send: (frame) => (sends[frame] = Completer()).future,
+        maxFramesInFlight: 1,
+      );
+
+      final done = <int>[];
+      for (var frame = 0; frame < 4; frame++) {
+        pipeline.add(frame).then((_) => done.add(frame));
+      }
+      await _flushMicrotasks();
+
+      // 1 and 2 were replaced before they could be sent.
+      expect(done, [1, 2]);
+      expect(pipeline.supersededFrames, 2);
+
+      sends[0]!.complete();
+      await _flushMicrotasks();
+      sends[3]!.complete();
+      await _flushMicrotasks();
+
+      expect(sends.keys, [0, 3]);
+      expect(done, [1, 2, 0, 3]);
+    });
+
+    test('passes send errors to the frame', () async {
+      final pipeline = FramePipeline<int>(
+        send: (frame) => throw RemoteDisplayException.connectionLost(),
+      );
+
+      await expectLater(
+        pipeline.add(0),
+        throwsA(isA<RemoteDisplayException>()),
+      );
+      await _flushMicrotasks();
+      expect(pipeline.isIdle, isTrue);
+    });
+  });
+
+  group('DisplayToHostParser', () {
+    final packets = <DisplayToHostPacket>[
+      TouchEvent(
+        pointer: 0,
+        phase: TouchEventPhase.down,
+        timestamp: 0x12345678,
+        position: (120, 200),
+      ),
+      TouchEvent(
+        pointer: 0,
+        phase: TouchEventPhase.move,
+        timestamp: 0xFFFFFFFF,
+        position: (121, 199),
+      ),
+      AccelerationEvent(AccelerationEventKind.wake),
+      PongPacket(),
+      DeviceInfoPacket(
+        width: 240,
+        height: 240,
+        widthMm: 28,
+        heightMm: 28,
+        supportsBacklight: true,
+        supportsTouch: true,
+        supportsCopyRects: true,
+        tileCacheSlots: 256,
+      ),
+      PhysicalButtonEvent(1),
+      KeyframeRequestPacket(),
+      TouchEvent(
+        pointer: 1,
+        phase: TouchEventPhase.up,
+        timestamp: 42,
+        position: (0, 255),
+      ),
+    ];
+    final stream = Uint8List.fromList([
+      for (final packet in packets) ...packet.toBytes(),
+    ]);
+
+    String describe(DisplayToHostPacket packet) => switch (packet) {
+          TouchEvent e =>
+            'touch ${e.pointer} ${e.phase} ${e.timestamp} ${e.position}',
+          AccelerationEvent e => 'accel ${e.kind}',
+          PhysicalButtonEvent e => 'button ${e.button}',
+          PongPacket() => 'pong',
+          DeviceInfoPacket i => 'info ${i.width}x${i.height} '
+              '${i.widthMm}x${i.heightMm}mm ${i.supportsVibration} '
+              '${i.supportsBacklight} ${i.supportsTouch} '
+              '${i.supportsAccelerometer} ${i.supportsCopyRects} '
+              '${i.tileCacheSlots}',
+          KeyframeRequestPacket() => 'keyframe request',
+          _ => '$packet',
+        };
+
+    test('parses packets split across chunks anywhere', () {
+      for (var split = 0; split <= stream.length; split++) {
+        final parsed = <DisplayToHostPacket>[];
+        final parser = DisplayToHostParser(parsed.add);
+
+        parser.add(Uint8List.sublistView(stream, 0, split));
+        parser.add(Uint8List.sublistView(stream, split));
+
+        expect(parsed.map(describe), packets.map(describe));
+        expect(parser.skippedBytes, 0);
+      }
+    });
+
+    test('parses packets arriving byte by byte', () {
+      final parsed = <DisplayToHostPacket>[];
+      final parser = DisplayToHostParser(parsed.add);
+
+      for (var i = 0; i < stream.length; i++) {
+        parser.add(Uint8List.sublistView(stream, i, i + 1));
+      }
+
+      expect(parsed.map(describe), packets.map(describe));
+    });
+
+    test('skips malformed packets instead of throwing', () {
+      final parsed = <DisplayToHostPacket>[];
+      final parser = DisplayToHostParser(parsed.add);
+      final touch = packets.first.toBytes();
+
+      parser.add(
+        Uint8List.fromList([
+          0xFF, // Unknown packet type.
+          ...touch.sublist(0, 6),
+          9, // Out of range phase.
+          ...touch.sublist(7),
+          PacketType.accelerationEvent.index,
+          AccelerationEventKind.values.length,
+          ...packets.first.toBytes(),
+        ]),
+      );
+
+      expect(parsed.map(describe), [describe(packets.first)]);
+      expect(parser.skippedBytes, 1 + 9 + 2);
+    });
+  });
+
+  group('C decoder round-trip', () {
+    // The host build of the decoder, see flutterino_esp32/host.
+    final decoder = Platform.environment['FLRD_DECODE'];
+    final skip = decoder == null
+        ? 'Set FLRD_DECODE to the host-built flrd_decode to run this.'
+        : false;
+
+    /// Decodes [packets] using flrd_decode and returns the framebuffer.
+    Uint8List decode(
+      List<Packet> packets, {
+      required int width,
+      required int height,
+      bool streaming = false,
+    }) {
+      final dir = Directory.systemTemp.createTempSync('flrd_decode');
+
+      try {
+        final stream = File('${dir.path}/stream');
+        final framebuffer = File('${dir.path}/framebuffer');
+
+        stream.writeAsBytesSync([
+          for (final packet in packets) ...packet.toBytes(),
+        ]);
+
+        final result = Process.runSync(decoder!, [
+          '-W',
+          '$width',
+          '-H',
+          '$height',
+          if (streaming) '-S',
+          '-o',
+          framebuffer.path,
+          stream.path,
+        ]);
+
+        expect(result.exitCode, 0, reason: '${result.stderr}');
+
+        return framebuffer.readAsBytesSync();
+      } finally {
+        dir.deleteSync(recursive: true);
+      }
+    }
+
+    for (final streaming in [false, true]) {
+      test(
+        'raw deltaframes (streaming: $streaming)',
+        () {
+          final oldImage = _rgb565Image(64, 48);
+          final newImage = _rgb565Image(64, 48);
+
+          for (var y = 0; y < 48; y++) {
+            for (var x = 0; x < 64; x++) {
+              _setPixel(oldImage, x, y, x * 3 + y * 5);
+              _setPixel(newImage, x, y, x * 3 + y * 5);
+            }
+          }
+
+          for (var y = 4; y < 9; y++) {
+            for (var x = 2; x < 20; x++) {
+              _setPixel(newImage, x, y, 0xF800 ^ (x * 31 + y));
+            }
+          }
+          _setPixel(newImage, 63, 47, 0x07E0);
+
+          final delta = RawDeltaFramePacket.build(
+            newImage,
+            oldImage: oldImage,
+          )!;
+
+          expect(delta.rects, hasLength(2));
+
+          final framebuffer = decode(
+            [RawKeyFramePacket.build(oldImage), delta],
+            width: 64,
+            height: 48,
+            streaming: streaming,
+          );
+
+          expect(framebuffer, newImage.bytes);
+        },
+        skip: skip,
+      );
+
+      test(
+        'palette frames (streaming: $streaming)',
+        () {
+          final keyImage = _rgb565Image(64, 48);
+          final packedImage = _rgb565Image(64, 48);
+          final rleImage = _rgb565Image(64, 48);
+
+          // 12 colors in a checkered pattern, so the indices are packed.
+          for (var y = 0; y < 48; y++) {
+            for (var x = 0; x < 64; x++) {
+              final color = ((x + y) % 12) * 0x1111;
+              _setPixel(keyImage, x, y, color);
+              _setPixel(packedImage, x, y, color);
+              _setPixel(rleImage, x, y, color);
+            }
+          }
+
+          for (var y = 5; y < 10; y++) {
+            for (var x = 3; x < 11; x++) {
+              _setPixel(packedImage, x, y, x % 2 == 0 ? 0xF800 : 0x001F);
+              _setPixel(rleImage, x, y, x % 2 == 0 ? 0xF800 : 0x001F);
+            }
+          }
+
+          // Long runs of 2 colors, so the indices are RLE encoded.
+          for (var y = 20; y < 40; y++) {
+            for (var x = 0; x < 64; x++) {
+              _setPixel(rleImage, x, y, y < 30 ? 0x07E0 : 0xFFFF);
+            }
+          }
+
+          final keyframe = PaletteKeyFramePacket.build(keyImage)!;
+          final packedDelta = PaletteDeltaFramePacket.build(
+            packedImage,
+            oldImage: keyImage,
+          )!;
+          final rleDelta = PaletteDeltaFramePacket.build(
+            rleImage,
+            oldImage: packedImage,
+          )!;
+
+          expect(keyframe.palette.bitsPerIndex, 4);
+          expect(packedDelta.palette.rle, isFalse);
+          expect(rleDelta.palette.rle, isTrue);
+
+          final framebuffer = decode(
+            [keyframe, packedDelta, rleDelta],
+            width: 64,
+            height: 48,
+            streaming: streaming,
+          );
+
+          expect(framebuffer, rleImage.bytes);
+        },
+        skip: skip,
+      );
+
+      test(
+        'LZ deltaframes (streaming: $streaming)',
+        () {
+          final oldImage = _rgb565Image(160, 120);
+          final newImage = _ditheredGradient(160, 120);
+          for (var x = 0; x < 160; x++) {
+            _setPixel(newImage, x, 60, (x * 2654435761) >> 7 & 0xFFFF);
+          }
+
+          final delta = LZDeltaFramePacket.build(
+            newImage,
+            oldImage: oldImage,
+            damagedRects: [
+              const IntRect.fromLTRB(0, 0, 160, 100),
+              const IntRect.fromLTRB(5, 100, 17, 120),
+            ],
+          )!;
+
+          final framebuffer = decode(
+            [RawKeyFramePacket.build(oldImage), delta],
+            width: 160,
+            height: 120,
+            streaming: streaming,
+          );
+
+          // Outside of the damaged rects, the old pixels stay.
+          for (var y = 100; y < 120; y++) {
+            for (var x = 0; x < 160; x++) {
+              if (x < 5 || x >= 17) {
+                _setPixel(newImage, x, y, 0);
+              }
+            }
+          }
+
+          expect(framebuffer, newImage.bytes);
+        },
+        skip: skip,
+      );
+
+      test(
+        'tile frames (streaming: $streaming)',
+        () {
+          final frames = [
+            for (final digits in [
+              [0, 0, 0],
+              [1, 0, 0],
+              [2, 1, 0],
+              [1, 2, 0],
+              [3, 2, 1],
+              [0, 4, 1],
+              [4, 0, 3],
+            ])
+              _digits(digits),
+          ];
+
+          final packets = _tilePackets(TileCache(slots: 2), frames);
+          expect(packets.whereType<TilesFramePacket>(), hasLength(5));
+
+          final framebuffer = decode(
+            packets,
+            width: 48,
+            height: 16,
+            streaming: streaming,
+          );
+
+          expect(framebuffer, frames.last.bytes);
+        },
+        skip: skip,
+      );
+
+      test(
+        'copy rects frames (streaming: $streaming)',
+        () {
+          final oldImage = _scrolledList(64, 48, 0);
+          final newImage = _scrolledList(64, 48, 7);
+
+          final packet = CopyRectsFramePacket.build(
+            newImage,
+            oldImage: oldImage,
+            detector: ScrollDetector(),
+          )!;
+
+          final framebuffer = decode(
+            [RawKeyFramePacket.build(oldImage), packet],
+            width: 64,
+            height: 48,
+            streaming: streaming,
+          );
+
+          expect(framebuffer, newImage.bytes);
+        },
+        skip: skip,
+      );
+    }
+  });
+
+  group('TileCache', () {
+    List<(bool, int, int, int)> opsOf(FramePacket packet) => [
+          for (final op in (packet as TilesFramePacket).ops)
+            (op.store, op.x, op.y, op.slot),
+        ];
+
+    test('stores sent tiles and draws them when they come back', () {
+      final packets = _tilePackets(TileCache(slots: 2), [
+        _digits([0, 0, 0]),
+        _digits([1, 0, 0]),
+        _digits([2, 1, 0]),
+        _digits([1, 2, 0]),
+      ]);
+
+      expect(packets[1], isNot(isA<TilesFramePacket>()));
+
+      // The 1 is stored from the previous frame, then drawn next to it.
+      expect(opsOf(packets[2]), [(true, 0, 0, 0), (false, 16, 0, 0)]);
+      expect((packets[2] as TilesFramePacket).patch, isNotNull);
+
+      expect(opsOf(packets[3]), [
+        (true, 0, 0, 1),
+        (false, 0, 0, 0),
+        (false, 16, 0, 1),
+      ]);
+      expect((packets[3] as TilesFramePacket).patch, isNull);
+    });
+
+    test('evicts the least recently used slot', () {
+      final packets = _tilePackets(TileCache(slots: 2), [
+        _digits([0, 0, 0]),
+        _digits([1, 0, 0]),
+        _digits([2, 1, 0]),
+        _digits([1, 2, 0]),
+        _digits([3, 2, 1]),
+        _digits([0, 4, 1]),
+        _digits([4, 0, 3]),
+      ]);
+
+      // The 1 in slot 0 was drawn last, so the 3 replaces the 2 in slot 1.
+      expect(opsOf(packets[4]), [(false, 32, 0, 0)]);
+      expect(opsOf(packets[5]), [(true, 0, 0, 1)]);
+      expect(opsOf(packets[6]), [
+        (true, 0, 0, 0),
+        (true, 16, 0, 1),
+        (false, 0, 0, 1),
+        (false, 16, 0, 0),
+      ]);
+    });
+
+    test('skips uniform tiles', () {
+      final blank = _rgb565Image(32, 16);
+      final packets = _tilePackets(TileCache(slots: 4), [
+        _digits([1, 2]),
+        blank,
+        _digits([1, 2]),
+        blank,
+      ]);
+
+      expect(packets[1], isNot(isA<TilesFramePacket>()));
+      expect(packets[2], isNot(isA<TilesFramePacket>()));
+
+      // Only the digits are stored, the blank tiles aren't drawn.
+      expect(opsOf(packets[3]), [(true, 0, 0, 0), (true, 16, 0, 1)]);
+    });
+  });
+
+  group('ScrollDetector', () {
+    test('finds a scrolled list below a static header', () {
+      final oldImage = _scrolledList(32, 40, 0);
+      final newImage = _scrolledList(32, 40, 5);
+
+      final copy = ScrollDetector().detect(
+        oldImage: oldImage,
+        newImage: newImage,
+      )!;
+
+      expect(copy.source, const IntRect.fromLTRB(0, 11, 32, 40));
+      expect(copy.dy, -5);
+      expect(copy.destination, const IntRect.fromLTRB(0, 6, 32, 35));
+    });
+
+    test('ignores frames that did not scroll', () {
+      final oldImage = _scrolledList(32, 40, 0);
+      final newImage = _scrolledList(32, 40, 0);
+      _setPixel(newImage, 3, 20, 0xFFFF);
+
+      final copy = ScrollDetector().detect(
+        oldImage: oldImage,
+        newImage: newImage,
+      );
+
+      expect(copy, isNull);
+    });
+
+    test('copy rects frames only patch the uncovered rows', () {
+      final oldImage = _scrolledList(32, 40, 0);
+      final newImage = _scrolledList(32, 40, 5);
+
+      final packet = CopyRectsFramePacket.build(
+        newImage,
+        oldImage: oldImage,
+        detector: ScrollDetector(),
+      )!;
+
+      final copied = CopyRectsFramePacket.applyTo(oldImage, packet.copies);
+      expect(
+        DeltaFrame.findDamagedRects(oldImage: copied, newImage: newImage),
+        [const IntRect.fromLTRB(0, 35, 32, 40)],
+      );
+
+      final bytes = packet.toBytes();
+      expect(bytes.sublist(0, 9), [
+        9, 6, // frame packet, copy rects
+        1, // copy count
+        0, 11, 32, 29, // source
+        0, 6, // destination
+      ]);
+      expect(bytes.length, 9 + packet.patch!.encodedLength);
+    });
+  });
+
+  group('findDamagedRects', () {
+    test('returns nothing for identical frames', () {
+      final rects = DeltaFrame.findDamagedRects(
+        oldImage: _rgb565Image(240, 240),
+        newImage: _rgb565Image(240, 240),
+      );
+
+      expect(rects, isEmpty);
+    });
+
+    test('returns one rect per band of damaged rows', () {
+      final oldImage = _rgb565Image(240, 240);
+      final newImage = _rgb565Image(240, 240);
+
+      // cursor in the top left, clock in the bottom right
+      _setPixel(newImage, 3, 2, 0xFFFF);
+      _setPixel(newImage, 5, 3, 0x00FF);
+      _setPixel(newImage, 200, 220, 0xFF00);
+      _setPixel(newImage, 239, 221, 0x0001);
+
+      final rects = DeltaFrame.findDamagedRects(
+        oldImage: oldImage,
+        newImage: newImage,
+      );
+
+      expect(rects, [
+        const IntRect.fromLTRB(3, 2, 6, 4),
+        const IntRect.fromLTRB(200, 220, 240, 222),
+      ]);
+    });
+
+    test('handles unaligned strides', () {
+      final oldImage = _rgb565Image(13, 7, stride: 27);
+      final newImage = _rgb565Image(13, 7, stride: 27);
+
+      _setPixel(newImage, 0, 0, 0x8000);
+      _setPixel(newImage, 12, 1, 0x0080);
+      _setPixel(newImage, 6, 6, 0x0100);
+
+      final rects = DeltaFrame.findDamagedRects(
+        oldImage: oldImage,
+        newImage: newImage,
+      );
+
+      expect(rects, [
+        const IntRect.fromLTRB(0, 0, 13, 2),
+        const IntRect.fromLTRB(6, 6, 7, 7),
+      ]);
+    });
+  });
+
+  group('TileDamageTracker', () {
+    test('keeps damage in opposite corners apart', () {
+      final oldImage = _rgb565Image(240, 240);
+      final newImage = _rgb565Image(240, 240);
+
+      // cursor in the top left, clock in the bottom right
+      _setPixel(newImage, 3, 2, 0xFFFF);
+      _setPixel(newImage, 200, 220, 0xFF00);
+      _setPixel(newImage, 220, 220, 0xFF00);
+      _setPixel(newImage, 200, 236, 0xFF00);
+      _setPixel(newImage, 220, 236, 0xFF00);
+
+      final rects = TileDamageTracker().findDamagedRects(
+        oldImage: oldImage,
+        newImage: newImage,
+      );
+
+      expect(rects, [
+        const IntRect.fromLTRB(0, 0, 16, 16),
+        const IntRect.fromLTRB(192, 208, 224, 240),
+      ]);
+    });
+
+    test('returns non-overlapping rects', () {
+      final oldImage = _rgb565Image(100, 100);
+      final newImage = _rgb565Image(100, 100);
+
+      // an L shape and a few scattered pixels
+      for (var y = 0; y < 100; y++) {
+        _setPixel(newImage, 5, y, 0xFFFF);
+      }
+      for (var x = 0; x < 100; x++) {
+        _setPixel(newImage, x, 90, 0xFFFF);
+      }
+      _setPixel(newImage, 40, 40, 0x1234);
+      _setPixel(newImage, 56, 40, 0x1234);
+      _setPixel(newImage, 99, 0, 0x1234);
+
+      final rects = TileDamageTracker().findDamagedRects(
+        oldImage: oldImage,
+        newImage: newImage,
+      );
+
+      for (final (i, a) in rects.indexed) {
+        for (final b in rects.skip(i + 1)) {
+          expect(a.overlaps(b), isFalse, reason: '\$a overlaps \$b');
+        }
+      }
+
+      // every damaged pixel is covered
+      const damaged = [(5, 0), (5, 99), (99, 90), (40, 40), (56, 40), (99, 0)];
+      for (final (x, y) in damaged) {
+        expect(rects.any((rect) => rect.contains((x, y))), isTrue);
+      }
+
+      expect(rects.length, lessThan(6));
+    });
+
+    test('only compares tiles in the given regions', () {
+      final oldImage = _rgb565Image(240, 240);
+      final newImage = _rgb565Image(240, 240);
+
+      _setPixel(newImage, 3, 2, 0xFFFF);
+      _setPixel(newImage, 200, 220, 0xFF00);
+      _setPixel(newImage, 120, 120, 0x1234);
+
+      final rects = TileDamageTracker().findDamagedRects(
+        oldImage: oldImage,
+        newImage: newImage,
+        regions: const [
+          // a repainted clock, straddling tile edges
+          IntRect.fromLTRB(190, 210, 210, 230),
+          // repainted, but unchanged
+          IntRect.fromLTRB(40, 40, 60, 60),
+        ],
+      );
+
+      expect(rects, [const IntRect.fromLTRB(192, 208, 208, 224)]);
+    });
+  });
+
+  group('RenderCaptureBoundary', () {
+    /// A static header of 40 rows above [child], in a 240x240 boundary.
+    Future<RenderCaptureBoundary> pumpBoundary(
+      WidgetTester tester,
+      Widget child,
+    ) async {
+      final key = GlobalKey();
+
+      await tester.pumpWidget(
+        Directionality(
+          textDirection: TextDirection.ltr,
+          child: Align(
+            alignment: Alignment.topLeft,
+            child: CaptureBoundary(
+              key: key,
+              child: SizedBox(
+                width: 240,
+                height: 240,
+                child: Column(
+                  children: [
+                    const SizedBox(
+                      height: 40,
+                      child: ColoredBox(color: Color(0xFF0000FF)),
+                    ),
+                    Expanded(child: child),
+                  ],
+                ),
+              ),
+            ),
+          ),
+        ),
+      );
+
+      final boundary =
+          tester.renderObject<RenderCaptureBoundary>(find.byKey(key));
+
+      // The first frame painted everything.
+      expect(boundary.takeRepainted(), (true, null));
+
+      await tester.pump();
+      expect(boundary.takeRepainted(), (false, null));
+
+      return boundary;
+    }
+
+    testWidgets('damages list items that scrolled', (tester) async {
+      final controller = ScrollController();
+      addTearDown(controller.dispose);
+
+      final boundary = await pumpBoundary(
+        tester,
+        // So scrolling doesn't repaint the capture boundary itself.
+        RepaintBoundary(
+          child: ListView.builder(
+            controller: controller,
+            itemExtent: 40,
+            itemBuilder: (context, index) => ColoredBox(
+              color: Color(0xFF000000 | (index * 0x302010) & 0xFFFFFF),
+            ),
+          ),
+        ),
+      );
+
+      // Scrolls item 5 in, and moves items 0 to 4 without repainting them.
+      controller.jumpTo(20);
+      await tester.pump();
+
+      final (repainted, regions) = boundary.takeRepainted();
+      expect(repainted, isTrue);
+      expect(regions, isNotNull);
+
+      // the header didn't change
+      for (final rect in regions!) {
+        expect(rect.top, greaterThanOrEqualTo(40));
+      }
+
+      // every row of the list did
+      for (var y = 40; y < 240; y++) {
+        expect(
+          regions.any((rect) => rect.contains((120, y))),
+          isTrue,
+          reason: 'row $y',
+        );
+      }
+    });
+
+    testWidgets('damages content that faded', (tester) async {
+      final opacity = AnimationController(vsync: tester, value: 0.5);
+      addTearDown(opacity.dispose);
+
+      final boundary = await pumpBoundary(
+        tester,
+        Align(
+          alignment: Alignment.topLeft,
+          child: FadeTransition(
+            opacity: opacity,
+            child: const SizedBox(
+              width: 100,
+              height: 100,
+              child: ColoredBox(color: Color(0xFFFF0000)),
+            ),
+          ),
+        ),
+      );
+
+      // Only updates the alpha of the OpacityLayer.
+      opacity.value = 0.25;
+      await tester.pump();
+
+      final (repainted, regions) = boundary.takeRepainted();
+      expect(repainted, isTrue);
+      // where it was, and where it is
+      expect(regions, isNotEmpty);
+      expect(regions, everyElement(const IntRect.fromLTRB(0, 40, 100, 140)));
+    });
+  });
 }
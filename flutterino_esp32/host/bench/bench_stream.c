@@ -0,0 +1,685 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "flutter_remote_display.h"
+
+#include "bench_stream.h"
+
+void bench_stream_init(struct bench_stream *stream) {
+    memset(stream, 0, sizeof *stream);
+}
+
+void bench_stream_deinit(struct bench_stream *stream) {
+    free(stream->bytes);
+    free(stream->packet_ends);
+    memset(stream, 0, sizeof *stream);
+}
+
+int bench_stream_append(struct bench_stream *stream, size_t n_bytes, const void *bytes) {
+    if (stream->n_bytes + n_bytes > stream->capacity) {
+        size_t capacity = stream->capacity ? stream->capacity : 4096;
+        while (capacity < stream->n_bytes + n_bytes) {
+            capacity *= 2;
+        }
+
+        uint8_t *grown = realloc(stream->bytes, capacity);
+        if (grown == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+
+        stream->bytes = grown;
+        stream->capacity = capacity;
+    }
+
+    memcpy(stream->bytes + stream->n_bytes, bytes, n_bytes);
+    stream->n_bytes += n_bytes;
+    return 0;
+}
+
+int bench_stream_append_file(struct bench_stream *stream, const char *path) {
+    uint8_t buffer[4096];
+    size_t n_read;
+    FILE *file;
+    int ok = 0;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    while (ok == 0 && (n_read = fread(buffer, 1, sizeof buffer, file)) > 0) {
+        ok = bench_stream_append(stream, n_read, buffer);
+    }
+
+    if (ferror(file)) {
+        perror(path);
+        ok = 1;
+    }
+
+    fclose(file);
+    return ok;
+}
+
+int bench_stream_write_file(const struct bench_stream *stream, const char *path) {
+    FILE *file;
+    int ok = 0;
+
+    file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    if (fwrite(stream->bytes, 1, stream->n_bytes, file) != stream->n_bytes) {
+        perror(path);
+        ok = 1;
+    }
+
+    fclose(file);
+    return ok;
+}
+
+static bool stream_read_u8(const struct bench_stream *stream, size_t *offset, uint8_t *value_out) {
+    if (*offset + 1 > stream->n_bytes) {
+        return false;
+    }
+
+    *value_out = stream->bytes[*offset];
+    *offset += 1;
+    return true;
+}
+
+static bool stream_read_u16(const struct bench_stream *stream, size_t *offset, uint16_t *value_out) {
+    if (*offset + 2 > stream->n_bytes) {
+        return false;
+    }
+
+    *value_out = stream->bytes[*offset] | (stream->bytes[*offset + 1] << 8);
+    *offset += 2;
+    return true;
+}
+
+static bool stream_skip(const struct bench_stream *stream, size_t *offset, size_t n_bytes) {
+    if (*offset + n_bytes > stream->n_bytes) {
+        return false;
+    }
+
+    *offset += n_bytes;
+    return true;
+}
+
+// Skips the palette of a palette encoded frame, and returns its format byte.
+static bool stream_skip_palette(const struct bench_stream *stream, size_t *offset, uint8_t *format_out) {
+    uint8_t n_colors_minus_one;
+
+    return stream_read_u8(stream, offset, &n_colors_minus_one) &&
+        stream_read_u8(stream, offset, format_out) &&
+        stream_skip(stream, offset, ((size_t) n_colors_minus_one + 1) * 2);
+}
+
+static bool stream_skip_indexed_pixels(const struct bench_stream *stream, size_t *offset, uint8_t format, size_t n_pixels) {
+    uint16_t n_runs;
+
+    if (format & 0x80) {
+        return stream_read_u16(stream, offset, &n_runs) &&
+            stream_skip(stream, offset, (size_t) n_runs * 2);
+    }
+
+    return stream_skip(stream, offset, (n_pixels * (format & 0x0F) + 7) / 8);
+}
+
+static bool stream_skip_lz_length(const struct bench_stream *stream, size_t *offset, size_t nibble, size_t *length_out) {
+    uint8_t byte;
+
+    *length_out = nibble;
+    if (nibble != 15) {
+        return true;
+    }
+
+    do {
+        if (!stream_read_u8(stream, offset, &byte)) {
+            return false;
+        }
+        *length_out += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+static bool stream_skip_lz_pixels(const struct bench_stream *stream, size_t *offset, size_t n_pixels) {
+    size_t n_decoded = 0, length;
+    uint8_t token;
+
+    while (n_decoded < n_pixels) {
+        if (!stream_read_u8(stream, offset, &token) ||
+            !stream_skip_lz_length(stream, offset, token >> 4, &length) ||
+            !stream_skip(stream, offset, length * 2)) {
+            return false;
+        }
+
+        n_decoded += length;
+        if (n_decoded >= n_pixels) {
+            break;
+        }
+
+        if (!stream_skip(stream, offset, 2) ||
+            !stream_skip_lz_length(stream, offset, token & 0x0F, &length)) {
+            return false;
+        }
+
+        n_decoded += length + FLRD_LZ_MIN_MATCH;
+    }
+
+    return n_decoded == n_pixels;
+}
+
+static bool stream_skip_frame(const struct bench_stream *stream, size_t *offset, int width, int height) {
+    uint8_t encoding, x, y, rect_width, rect_height, n_rects_u8, format;
+    uint16_t n_runs, n_rects;
+
+    if (!stream_read_u8(stream, offset, &encoding)) {
+        return false;
+    }
+
+    switch (encoding) {
+        case FLRD_FRAME_ENCODING_KEYFRAME_RAW:
+            return stream_skip(stream, offset, (size_t) width * height * 2);
+
+        case FLRD_FRAME_ENCODING_KEYFRAME_RLE:
+            return stream_read_u16(stream, offset, &n_runs) &&
+                stream_skip(stream, offset, (size_t) n_runs * 3);
+
+        case FLRD_FRAME_ENCODING_DELTAFRAME_RAW:
+            if (!stream_read_u8(stream, offset, &n_rects_u8)) {
+                return false;
+            }
+
+            for (int i = 0; i < n_rects_u8; i++) {
+                if (!stream_read_u8(stream, offset, &x) ||
+                    !stream_read_u8(stream, offset, &y) ||
+                    !stream_read_u8(stream, offset, &rect_width) ||
+                    !stream_read_u8(stream, offset, &rect_height) ||
+                    !stream_skip(stream, offset, (size_t) rect_width * rect_height * 2)) {
+                    return false;
+                }
+            }
+            return true;
+
+        case FLRD_FRAME_ENCODING_DELTAFRAME_RLE:
+            if (!stream_read_u16(stream, offset, &n_rects)) {
+                return false;
+            }
+
+            for (int i = 0; i < n_rects; i++) {
+                if (!stream_skip(stream, offset, 4) ||
+                    !stream_read_u16(stream, offset, &n_runs) ||
+                    !stream_skip(stream, offset, (size_t) n_runs * 3)) {
+                    return false;
+                }
+            }
+            return true;
+
+        case FLRD_FRAME_ENCODING_KEYFRAME_PALETTE:
+            return stream_skip_palette(stream, offset, &format) &&
+                stream_skip_indexed_pixels(stream, offset, format, (size_t) width * height);
+
+        case FLRD_FRAME_ENCODING_DELTAFRAME_PALETTE:
+            if (!stream_skip_palette(stream, offset, &format) || !stream_read_u16(stream, offset, &n_rects)) {
+                return false;
+            }
+
+            for (int i = 0; i < n_rects; i++) {
+                if (!stream_read_u8(stream, offset, &x) ||
+                    !stream_read_u8(stream, offset, &y) ||
+                    !stream_read_u8(stream, offset, &rect_width) ||
+                    !stream_read_u8(stream, offset, &rect_height) ||
+                    !stream_skip_indexed_pixels(stream, offset, format, (size_t) rect_width * rect_height)) {
+                    return false;
+                }
+            }
+            return true;
+
+        case FLRD_FRAME_ENCODING_COPY_RECTS:
+            return stream_read_u8(stream, offset, &n_rects_u8) &&
+                stream_skip(stream, offset, (size_t) n_rects_u8 * 6);
+
+        case FLRD_FRAME_ENCODING_DELTAFRAME_LZ:
+            if (!stream_read_u16(stream, offset, &n_rects)) {
+                return false;
+            }
+
+            for (int i = 0; i < n_rects; i++) {
+                if (!stream_read_u8(stream, offset, &x) ||
+                    !stream_read_u8(stream, offset, &y) ||
+                    !stream_read_u8(stream, offset, &rect_width) ||
+                    !stream_read_u8(stream, offset, &rect_height) ||
+                    !stream_skip_lz_pixels(stream, offset, (size_t) rect_width * rect_height)) {
+                    return false;
+                }
+            }
+            return true;
+
+        case FLRD_FRAME_ENCODING_TILES:
+            return stream_read_u16(stream, offset, &n_rects) &&
+                stream_skip(stream, offset, (size_t) n_rects * sizeof(struct flrd_tile_op));
+
+        default:
+            fprintf(stderr, "unsupported frame encoding %d at offset %zu\n", encoding, *offset - 1);
+            return false;
+    }
+}
+
+int bench_stream_index_packets(struct bench_stream *stream, int width, int height) {
+    size_t offset = 0, capacity = 0;
+
+    free(stream->packet_ends);
+    stream->packet_ends = NULL;
+    stream->n_packets = 0;
+
+    while (offset < stream->n_bytes) {
+        uint8_t type = stream->bytes[offset++];
+        bool ok;
+
+        switch (type) {
+            case FLRD_PACKET_BACKLIGHT:
+            case FLRD_PACKET_VIBRATION:
+                ok = stream_skip(stream, &offset, 1);
+                break;
+            case FLRD_PACKET_PING:
+                ok = true;
+                break;
+            case FLRD_PACKET_FRAME:
+                ok = stream_skip_frame(stream, &offset, width, height);
+                break;
+            default:
+                fprintf(stderr, "unsupported packet type %d at offset %zu\n", type, offset - 1);
+                return 1;
+        }
+
+        if (!ok) {
+            fprintf(stderr, "stream ends in the middle of a %s\n", flrd_packet_type_to_string(type));
+            return 1;
+        }
+
+        if (stream->n_packets == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+
+            size_t *grown = realloc(stream->packet_ends, capacity * sizeof(size_t));
+            if (grown == NULL) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+
+            stream->packet_ends = grown;
+        }
+
+        stream->packet_ends[stream->n_packets++] = offset;
+    }
+
+    return 0;
+}
+
+static int append_u8(struct bench_stream *stream, uint8_t value) {
+    return bench_stream_append(stream, 1, &value);
+}
+
+static int append_u16(struct bench_stream *stream, uint16_t value) {
+    uint8_t bytes[2] = { value & 0xFF, value >> 8 };
+    return bench_stream_append(stream, 2, bytes);
+}
+
+// Appends the RLE runs for the given rect of the framebuffer, one row at a
+// time. Unlike RLEFrame.encodeRuns on the flutter side, runs never cross rows.
+static int append_rle_runs(struct bench_stream *stream, const uint16_t *fb, int stride, struct rect rect) {
+    size_t n_runs_offset = stream->n_bytes;
+    size_t n_runs = 0;
+    int ok;
+
+    ok = append_u16(stream, 0);
+
+    for (int y = rect.top; y < rect.top + rect.height && ok == 0; y++) {
+        const uint16_t *row = fb + (size_t) y * stride + rect.left;
+        int x = 0;
+
+        while (x < rect.width && ok == 0) {
+            int length = 1;
+            while (x + length < rect.width && length < 255 && row[x + length] == row[x]) {
+                length++;
+            }
+
+            ok = append_u8(stream, length);
+            if (ok == 0) {
+                ok = append_u16(stream, row[x]);
+            }
+
+            n_runs++;
+            x += length;
+        }
+    }
+
+    if (ok == 0) {
+        if (n_runs > UINT16_MAX) {
+            fprintf(stderr, "too many runs for a single rect\n");
+            return 1;
+        }
+
+        stream->bytes[n_runs_offset] = n_runs & 0xFF;
+        stream->bytes[n_runs_offset + 1] = n_runs >> 8;
+    }
+
+    return ok;
+}
+
+static int append_lz_length(struct bench_stream *stream, size_t length) {
+    int ok = 0;
+
+    for (; length >= 255 && ok == 0; length -= 255) {
+        ok = append_u8(stream, 255);
+    }
+
+    return ok == 0 ? append_u8(stream, length) : ok;
+}
+
+// Appends one LZ sequence: the literal pixels, then a match of n_match
+// pixels (none if zero) starting offset pixels back.
+static int append_lz_sequence(struct bench_stream *stream, const uint16_t *literals, size_t n_literals, size_t offset, size_t n_match) {
+    size_t match_nibble = n_match > 0 ? n_match - FLRD_LZ_MIN_MATCH : 0;
+    int ok;
+
+    ok = append_u8(stream, ((n_literals < 15 ? n_literals : 15) << 4) | (match_nibble < 15 ? match_nibble : 15));
+    if (ok == 0 && n_literals >= 15) ok = append_lz_length(stream, n_literals - 15);
+
+    for (size_t i = 0; i < n_literals && ok == 0; i++) {
+        ok = append_u16(stream, literals[i]);
+    }
+
+    if (n_match > 0) {
+        if (ok == 0) ok = append_u16(stream, offset);
+        if (ok == 0 && match_nibble >= 15) ok = append_lz_length(stream, match_nibble - 15);
+    }
+
+    return ok;
+}
+
+#define LZ_HASH_BITS 12
+
+// Appends the given rect of the framebuffer LZ encoded. Same greedy
+// algorithm as LZFrame.encode on the flutter side: a hash of every pair of
+// pixels points to the last position it was seen at, and the match there
+// is extended as far as possible.
+static int append_lz_pixels(struct bench_stream *stream, const uint16_t *fb, int stride, struct rect rect) {
+    size_t n_pixels = (size_t) rect.width * rect.height;
+    size_t anchor = 0, i = 0;
+    uint16_t *pixels;
+    long *table;
+    int ok = 0;
+
+    pixels = malloc(n_pixels * sizeof *pixels);
+    table = malloc(sizeof(long) << LZ_HASH_BITS);
+    if (pixels == NULL || table == NULL) {
+        fprintf(stderr, "out of memory\n");
+        free(pixels);
+        free(table);
+        return 1;
+    }
+
+    for (int y = 0; y < rect.height; y++) {
+        memcpy(pixels + (size_t) y * rect.width, fb + (size_t) (rect.top + y) * stride + rect.left, rect.width * sizeof *pixels);
+    }
+
+    for (size_t h = 0; h < (1 << LZ_HASH_BITS); h++) {
+        table[h] = -1;
+    }
+
+    while (i + FLRD_LZ_MIN_MATCH <= n_pixels && ok == 0) {
+        uint32_t key = pixels[i] | ((uint32_t) pixels[i + 1] << 16);
+        uint32_t h = (key * 2654435761u) >> (32 - LZ_HASH_BITS);
+        long candidate = table[h];
+
+        table[h] = i;
+
+        if (candidate < 0 || i - candidate > FLRD_LZ_WINDOW ||
+            pixels[candidate] != pixels[i] || pixels[candidate + 1] != pixels[i + 1]) {
+            i++;
+            continue;
+        }
+
+        size_t n_match = FLRD_LZ_MIN_MATCH;
+        while (i + n_match < n_pixels && pixels[candidate + n_match] == pixels[i + n_match]) {
+            n_match++;
+        }
+
+        ok = append_lz_sequence(stream, pixels + anchor, i - anchor, i - candidate, n_match);
+
+        i += n_match;
+        anchor = i;
+    }
+
+    if (anchor < n_pixels && ok == 0) {
+        ok = append_lz_sequence(stream, pixels + anchor, n_pixels - anchor, 0, 0);
+    }
+
+    free(pixels);
+    free(table);
+    return ok;
+}
+
+int bench_stream_append_frame(struct bench_stream *stream, enum flrd_frame_encoding encoding, const uint16_t *fb, int width, int height) {
+    struct rect screen = { 0, 0, width, height };
+    int ok;
+
+    ok = append_u8(stream, FLRD_PACKET_FRAME);
+    if (ok == 0) ok = append_u8(stream, encoding);
+
+    switch (encoding) {
+        case FLRD_FRAME_ENCODING_KEYFRAME_RAW:
+            for (size_t i = 0; i < (size_t) width * height && ok == 0; i++) {
+                ok = append_u16(stream, fb[i]);
+            }
+            return ok;
+
+        case FLRD_FRAME_ENCODING_KEYFRAME_RLE:
+            return ok == 0 ? append_rle_runs(stream, fb, width, screen) : ok;
+
+        case FLRD_FRAME_ENCODING_DELTAFRAME_LZ:
+            if (ok == 0) ok = append_u16(stream, 1);
+            if (ok == 0) ok = append_u8(stream, 0);
+            if (ok == 0) ok = append_u8(stream, 0);
+            if (ok == 0) ok = append_u8(stream, width);
+            if (ok == 0) ok = append_u8(stream, height);
+            return ok == 0 ? append_lz_pixels(stream, fb, width, screen) : ok;
+
+        default:
+            fprintf(stderr, "can't encode frames as %s\n", flrd_frame_encoding_to_string(encoding));
+            return 1;
+    }
+}
+
+static void fill_rect(uint16_t *fb, int stride, int left, int top, int width, int height, uint16_t rgb565) {
+    for (int y = top; y < top + height; y++) {
+        for (int x = left; x < left + width; x++) {
+            fb[y * stride + x] = rgb565;
+        }
+    }
+}
+
+static void draw_scene(uint16_t *fb, int width, int height, int frame) {
+    const uint16_t white = 0xFFFF, black = 0x0000, accent = 0x1F << 11;
+
+    fill_rect(fb, width, 0, 0, width, height, white);
+
+    // title bar
+    fill_rect(fb, width, 0, 0, width, height / 8, accent);
+
+    // lines of "text": short runs of dark pixels, different per line
+    for (int y = height / 8 + 4; y < height; y++) {
+        int line = y / 12;
+        if (y % 12 >= 8) {
+            continue;
+        }
+
+        for (int x = 4; x < width - 4; x++) {
+            unsigned hash = (x / 2) * 2654435761u ^ (line * 40503u) ^ ((y % 12) * 97u);
+            if ((hash >> 13) % 3 == 0) {
+                fb[y * width + x] = black;
+            }
+        }
+    }
+
+    // a ticking clock in the top right corner
+    int clock_width = width / 4, clock_height = height / 10;
+    for (int y = 2; y < 2 + clock_height; y++) {
+        for (int x = width - clock_width - 2; x < width - 2; x++) {
+            unsigned hash = (x / 3) * 2246822519u ^ ((y / 3) * 3266489917u) ^ (frame * 668265263u);
+            fb[y * width + x] = (hash >> 15) % 2 ? white : black;
+        }
+    }
+
+    // a box moving back and forth through the middle of the screen
+    int box_size = width / 12;
+    int travel = width - box_size;
+    int position = frame % (2 * travel);
+    if (position >= travel) {
+        position = 2 * travel - position;
+    }
+    fill_rect(fb, width, position, height / 2, box_size, box_size, 0x3F << 5);
+}
+
+#define DENSE_TILE_SIZE 30
+
+static bool is_dense_tile_damaged(int tile, int frame) {
+    return frame == 0 || (tile + frame) % 3 == 0;
+}
+
+static void draw_dense_scene(uint16_t *fb, int width, int height, int frame) {
+    int n_columns = width / DENSE_TILE_SIZE;
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int tile = (y / DENSE_TILE_SIZE) * n_columns + x / DENSE_TILE_SIZE;
+
+            // tiles keep their content until they're damaged again
+            int version = frame;
+            while (version > 0 && !is_dense_tile_damaged(tile, version)) {
+                version--;
+            }
+
+            unsigned hash = (x / 2) * 2654435761u ^ (y * 40503u) ^ (version * 668265263u);
+            fb[y * width + x] = (hash >> 13) % 3 == 0 ? 0x0000 : 0xFFFF;
+        }
+    }
+}
+
+static int append_dense_deltaframe(struct bench_stream *stream, const uint16_t *fb, int width, int height, int frame) {
+    int n_columns = width / DENSE_TILE_SIZE, n_rows = height / DENSE_TILE_SIZE;
+    int n_rects = 0, ok;
+
+    for (int tile = 0; tile < n_columns * n_rows; tile++) {
+        n_rects += is_dense_tile_damaged(tile, frame);
+    }
+
+    ok = append_u8(stream, FLRD_PACKET_FRAME);
+    if (ok == 0) ok = append_u8(stream, FLRD_FRAME_ENCODING_DELTAFRAME_RLE);
+    if (ok == 0) ok = append_u16(stream, n_rects);
+
+    for (int tile = 0; tile < n_columns * n_rows && ok == 0; tile++) {
+        if (!is_dense_tile_damaged(tile, frame)) {
+            continue;
+        }
+
+        struct rect rect = {
+            .left = (tile % n_columns) * DENSE_TILE_SIZE,
+            .top = (tile / n_columns) * DENSE_TILE_SIZE,
+            .width = DENSE_TILE_SIZE,
+            .height = DENSE_TILE_SIZE,
+        };
+
+        ok = append_u8(stream, rect.left);
+        if (ok == 0) ok = append_u8(stream, rect.top);
+        if (ok == 0) ok = append_u8(stream, rect.width);
+        if (ok == 0) ok = append_u8(stream, rect.height);
+        if (ok == 0) ok = append_rle_runs(stream, fb, width, rect);
+    }
+
+    return ok;
+}
+
+static bool find_damaged_rect(const uint16_t *old_fb, const uint16_t *new_fb, int width, int height, struct rect *rect_out) {
+    int left = width, top = height, right = 0, bottom = 0;
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            if (old_fb[y * width + x] != new_fb[y * width + x]) {
+                if (x < left) left = x;
+                if (x >= right) right = x + 1;
+                if (y < top) top = y;
+                if (y >= bottom) bottom = y + 1;
+            }
+        }
+    }
+
+    if (left >= right || top >= bottom) {
+        return false;
+    }
+
+    *rect_out = (struct rect) {
+        .left = left,
+        .top = top,
+        .width = right - left,
+        .height = bottom - top,
+    };
+    return true;
+}
+
+int bench_stream_synthesize(struct bench_stream *stream, enum bench_scene scene, int width, int height, int n_frames) {
+    uint16_t *old_fb, *new_fb;
+    int ok = 0;
+
+    old_fb = malloc((size_t) width * height * sizeof(uint16_t));
+    new_fb = malloc((size_t) width * height * sizeof(uint16_t));
+    if (old_fb == NULL || new_fb == NULL) {
+        fprintf(stderr, "out of memory\n");
+        free(old_fb);
+        free(new_fb);
+        return 1;
+    }
+
+    for (int frame = 0; frame < n_frames && ok == 0; frame++) {
+        struct rect damage;
+
+        if (scene == BENCH_SCENE_DENSE_DELTAS) {
+            draw_dense_scene(new_fb, width, height, frame);
+        } else {
+            draw_scene(new_fb, width, height, frame);
+        }
+
+        if (frame == 0) {
+            ok = append_u8(stream, FLRD_PACKET_FRAME);
+            if (ok == 0) ok = append_u8(stream, FLRD_FRAME_ENCODING_KEYFRAME_RLE);
+            if (ok == 0) ok = append_rle_runs(stream, new_fb, width, (struct rect) { 0, 0, width, height });
+        } else if (scene == BENCH_SCENE_DENSE_DELTAS) {
+            ok = append_dense_deltaframe(stream, new_fb, width, height, frame);
+        } else if (find_damaged_rect(old_fb, new_fb, width, height, &damage)) {
+            ok = append_u8(stream, FLRD_PACKET_FRAME);
+            if (ok == 0) ok = append_u8(stream, FLRD_FRAME_ENCODING_DELTAFRAME_RLE);
+            if (ok == 0) ok = append_u16(stream, 1);
+            if (ok == 0) ok = append_u8(stream, damage.left);
+            if (ok == 0) ok = append_u8(stream, damage.top);
+            if (ok == 0) ok = append_u8(stream, damage.width);
+            if (ok == 0) ok = append_u8(stream, damage.height);
+            if (ok == 0) ok = append_rle_runs(stream, new_fb, width, damage);
+        }
+
+        uint16_t *tmp = old_fb;
+        old_fb = new_fb;
+        new_fb = tmp;
+    }
+
+    free(old_fb);
+    free(new_fb);
+    return ok;
+}
@@ -0,0 +1,52 @@
+#ifndef _FLRD_BENCH_STREAM_H
+#define _FLRD_BENCH_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flutter_remote_display.h"
+
+// A host -> display SPP byte stream, plus the offsets at which each packet
+// in it ends.
+struct bench_stream {
+    uint8_t *bytes;
+    size_t n_bytes;
+    size_t capacity;
+
+    size_t n_packets;
+    size_t *packet_ends;
+};
+
+void bench_stream_init(struct bench_stream *stream);
+
+void bench_stream_deinit(struct bench_stream *stream);
+
+int bench_stream_append(struct bench_stream *stream, size_t n_bytes, const void *bytes);
+
+int bench_stream_append_file(struct bench_stream *stream, const char *path);
+
+int bench_stream_write_file(const struct bench_stream *stream, const char *path);
+
+// Walks the stream and records where each packet ends.
+// Fails if the stream contains packets the decoder can't handle.
+int bench_stream_index_packets(struct bench_stream *stream, int width, int height);
+
+// Appends a frame packet with the whole width x height framebuffer, as a
+// raw or RLE keyframe, or as an LZ deltaframe with one rect covering it.
+int bench_stream_append_frame(struct bench_stream *stream, enum flrd_frame_encoding encoding, const uint16_t *fb, int width, int height);
+
+enum bench_scene {
+    // What the flutter host sends for a simple watch UI: one RLE keyframe
+    // followed by RLE deltaframes of a ticking clock and a moving box, over
+    // a background of text-like short runs.
+    BENCH_SCENE_WATCH_UI,
+
+    // One RLE keyframe followed by RLE deltaframes that each update a third
+    // of a grid of 30x30 tiles full of text-like short runs. Lots of rects
+    // and runs per packet.
+    BENCH_SCENE_DENSE_DELTAS,
+};
+
+int bench_stream_synthesize(struct bench_stream *stream, enum bench_scene scene, int width, int height, int n_frames);
+
+#endif
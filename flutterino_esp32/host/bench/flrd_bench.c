@@ -0,0 +1,438 @@
+// Host benchmark for the flrd decoder.
+//
+// Feeds recorded (or synthesized) Bluetooth SPP byte streams through
+// flrd_add_btspp_bytes -> packet_builder_task -> flrd_frame_present into a
+// null display driver, and reports throughput and per-packet latency.
+//
+// The null display can optionally simulate the time an SPI display takes to
+// transfer pixels (-M), either blocking in every driver call, or, with -A,
+// asynchronously like a DMA transfer that only blocks in wait_async.
+//
+// A recorded stream is just the raw bytes the host sent over SPP, e.g. dumped
+// from BluetoothDisplayConnection.addPacket.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "flutter_remote_display.h"
+
+#include "bench_stream.h"
+#include "heap_stats.h"
+
+struct bench_options {
+    int width, height;
+    size_t chunk_size;
+    int repeat;
+    int n_synthetic_frames;
+    enum bench_scene scene;
+    const char *dump_path;
+    bool streaming;
+    double spi_mhz;
+    bool async;
+    int rle_coalesce_cutoff;
+    bool shadow_framebuffer;
+};
+
+struct null_display {
+    uint64_t n_windows;
+    uint64_t n_pixels;
+    uint64_t n_calls;
+    uint64_t n_presents;
+
+    // Simulated SPI bus. If spi_mhz is zero, transfers take no time.
+    double spi_mhz;
+    int64_t busy_until;
+    int64_t time_waited;
+};
+
+// Fixed cost of every driver call (in us), i.e. starting an SPI transaction.
+#define SPI_CALL_OVERHEAD_US 1.0
+
+// Bytes sent for a set_window call (CASET, RASET, RAMWR and their arguments).
+#define SPI_SET_WINDOW_BYTES 11
+
+static void spin_until(int64_t deadline) {
+    while (esp_timer_get_time() < deadline) {}
+}
+
+// Queues a transfer of n_bytes on the simulated bus, after any
+// transfer that is still in flight.
+static void null_display_transfer(struct null_display *display, size_t n_bytes) {
+    int64_t now;
+
+    if (display->spi_mhz <= 0) {
+        return;
+    }
+
+    now = esp_timer_get_time();
+    if (display->busy_until < now) {
+        display->busy_until = now;
+    }
+
+    display->busy_until += (int64_t) (SPI_CALL_OVERHEAD_US + n_bytes * 8 / display->spi_mhz);
+}
+
+static void null_display_wait(struct null_display *display) {
+    int64_t now = esp_timer_get_time();
+
+    if (display->busy_until > now) {
+        display->time_waited += display->busy_until - now;
+        spin_until(display->busy_until);
+    }
+}
+
+struct feeder {
+    struct flrd *flrd;
+    const struct bench_stream *stream;
+    size_t chunk_size;
+    int repeat;
+
+    // Time (in us) at which the last byte of each packet was handed
+    // to flrd_add_btspp_bytes. Indexed by repeat * n_packets + packet.
+    int64_t *fed_at;
+};
+
+static void null_display_set_window(void *context, struct rect window) {
+    struct null_display *display = context;
+
+    display->n_windows++;
+    display->n_calls++;
+
+    null_display_transfer(display, SPI_SET_WINDOW_BYTES);
+    null_display_wait(display);
+}
+
+static void null_display_write_pixels(void *context, size_t n_pixels, uint16_t *rgb565_pixels) {
+    struct null_display *display = context;
+
+    display->n_pixels += n_pixels;
+    display->n_calls++;
+
+    null_display_transfer(display, n_pixels * 2);
+    null_display_wait(display);
+}
+
+static void null_display_write_pixel_run(void *context, size_t n_pixels, uint16_t rgb565) {
+    struct null_display *display = context;
+
+    display->n_pixels += n_pixels;
+    display->n_calls++;
+
+    null_display_transfer(display, n_pixels * 2);
+    null_display_wait(display);
+}
+
+static void null_display_write_pixels_async(void *context, size_t n_pixels, uint16_t *rgb565_pixels) {
+    struct null_display *display = context;
+
+    display->n_pixels += n_pixels;
+    display->n_calls++;
+
+    null_display_transfer(display, n_pixels * 2);
+}
+
+static void null_display_wait_async(void *context) {
+    null_display_wait(context);
+}
+
+static void null_display_present(void *context) {
+    struct null_display *display = context;
+
+    display->n_presents++;
+}
+
+static const struct flrd_display_driver null_display_driver = {
+    .set_window = null_display_set_window,
+    .write_pixels = null_display_write_pixels,
+    .write_pixel_run = null_display_write_pixel_run,
+    .present = null_display_present
+};
+
+static const struct flrd_display_driver null_display_async_driver = {
+    .set_window = null_display_set_window,
+    .write_pixels = null_display_write_pixels,
+    .write_pixel_run = null_display_write_pixel_run,
+    .present = null_display_present,
+    .write_pixels_async = null_display_write_pixels_async,
+    .wait_async = null_display_wait_async
+};
+
+static void null_btspp_send_bytes(void *context, size_t n_bytes, void *bytes) {}
+
+static const struct flrd_btspp_interface null_btspp_driver = {
+    .send_bytes = null_btspp_send_bytes
+};
+
+static void feeder_task(void *arg) {
+    struct feeder *feeder = arg;
+    const struct bench_stream *stream = feeder->stream;
+    size_t i_packet_total = 0;
+
+    for (int r = 0; r < feeder->repeat; r++) {
+        size_t i_packet = 0;
+
+        for (size_t offset = 0; offset < stream->n_bytes; offset += feeder->chunk_size) {
+            size_t n_bytes = stream->n_bytes - offset;
+            if (n_bytes > feeder->chunk_size) {
+                n_bytes = feeder->chunk_size;
+            }
+
+            int64_t now = esp_timer_get_time();
+            while (i_packet < stream->n_packets && stream->packet_ends[i_packet] <= offset + n_bytes) {
+                feeder->fed_at[i_packet_total++] = now;
+                i_packet++;
+            }
+
+            flrd_add_btspp_bytes(feeder->flrd, n_bytes, stream->bytes + offset);
+        }
+    }
+
+    vTaskDelete(NULL);
+}
+
+static int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void print_usage(const char *argv0) {
+    fprintf(
+        stderr,
+        "Usage: %s [options] [recorded-stream...]\n"
+        "\n"
+        "Options:\n"
+        "  -W <width>     display width in pixels (default 240)\n"
+        "  -H <height>    display height in pixels (default 240)\n"
+        "  -c <bytes>     SPP chunk size handed to flrd_add_btspp_bytes (default 990)\n"
+        "  -r <count>     how often to replay the stream (default 1)\n"
+        "  -s <frames>    synthesize a stream of <frames> frames instead of reading files\n"
+        "  -D             synthesize dense RLE deltaframes (many rects and runs per frame)\n"
+        "  -o <path>      write the (synthesized or concatenated) stream to <path>\n"
+        "  -S             stream frames straight to the display (flrd_set_display_driver)\n"
+        "  -M <MHz>       simulate the time an SPI display at <MHz> takes to transfer pixels\n"
+        "  -A             use asynchronous (DMA-style) display writes\n"
+        "  -C <pixels>    coalesce RLE runs shorter than <pixels> (default FLRD_RLE_COALESCE_CUTOFF)\n"
+        "  -F             keep a shadow framebuffer (flrd_set_shadow_framebuffer)\n"
+        "  -v             enable decoder info logging\n",
+        argv0
+    );
+}
+
+static int run_bench(const struct bench_options *options, const struct bench_stream *stream) {
+    struct null_display display = { .spi_mhz = options->spi_mhz };
+    const struct flrd_display_driver *driver = options->async ? &null_display_async_driver : &null_display_driver;
+    struct feeder feeder;
+    struct flrd flrd;
+    uint16_t *shadow = NULL;
+    size_t n_total;
+    int64_t *latencies;
+    uint64_t n_frames = 0;
+    BaseType_t ok;
+
+    n_total = stream->n_packets * options->repeat;
+    if (n_total == 0) {
+        fprintf(stderr, "stream contains no packets\n");
+        return 1;
+    }
+
+    feeder.fed_at = calloc(n_total, sizeof(int64_t));
+    latencies = calloc(n_total, sizeof(int64_t));
+    if (options->shadow_framebuffer) {
+        shadow = calloc((size_t) options->width * options->height, sizeof(uint16_t));
+    }
+
+    if (feeder.fed_at == NULL || latencies == NULL || (options->shadow_framebuffer && shadow == NULL)) {
+        fprintf(stderr, "out of memory\n");
+        free(feeder.fed_at);
+        free(latencies);
+        free(shadow);
+        return 1;
+    }
+
+    flrd_init(&flrd, options->width, options->height, &null_btspp_driver, NULL);
+
+    if (options->rle_coalesce_cutoff >= 0) {
+        flrd_set_rle_coalesce_cutoff(&flrd, options->rle_coalesce_cutoff);
+    }
+
+    if (options->streaming) {
+        flrd_set_display_driver(&flrd, driver, &display);
+    }
+
+    flrd_set_shadow_framebuffer(&flrd, shadow);
+
+    feeder.flrd = &flrd;
+    feeder.stream = stream;
+    feeder.chunk_size = options->chunk_size;
+    feeder.repeat = options->repeat;
+
+    struct heap_stats heap_before, heap_after;
+    heap_stats_get(&heap_before);
+
+    int64_t start = esp_timer_get_time();
+
+    ok = xTaskCreate(feeder_task, "feeder_task", 4096, &feeder, 5, NULL);
+    if (ok != pdPASS) {
+        fprintf(stderr, "could not start feeder task\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < n_total; i++) {
+        struct flrd_packet *packet = flrd_wait_for_packet(&flrd);
+        if (packet == NULL) {
+            fprintf(stderr, "flrd_wait_for_packet failed\n");
+            return 1;
+        }
+
+        if (packet->type == FLRD_PACKET_FRAME) {
+            flrd_frame_present(&flrd, &packet->frame, driver, &display);
+            n_frames++;
+        }
+
+        flrd_packet_free(packet);
+
+        latencies[i] = esp_timer_get_time() - feeder.fed_at[i];
+    }
+
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    heap_stats_get(&heap_after);
+
+    flrd_deinit(&flrd);
+
+    qsort(latencies, n_total, sizeof(int64_t), compare_int64);
+
+    int64_t latency_sum = 0;
+    for (size_t i = 0; i < n_total; i++) {
+        latency_sum += latencies[i];
+    }
+
+    double seconds = elapsed / 1e6;
+    uint64_t n_bytes = (uint64_t) stream->n_bytes * options->repeat;
+
+    printf("packets:       %zu (%llu frames)\n", n_total, (unsigned long long) n_frames);
+    printf("bytes:         %llu\n", (unsigned long long) n_bytes);
+    printf("elapsed:       %.3f ms\n", elapsed / 1e3);
+    printf("throughput:    %.2f MB/s\n", n_bytes / seconds / 1e6);
+    printf("frame rate:    %.1f frames/s\n", n_frames / seconds);
+    printf(
+        "latency (us):  min %lld, avg %lld, p50 %lld, p99 %lld, max %lld\n",
+        (long long) latencies[0],
+        (long long) (latency_sum / (int64_t) n_total),
+        (long long) latencies[n_total / 2],
+        (long long) latencies[(n_total * 99) / 100],
+        (long long) latencies[n_total - 1]
+    );
+    printf(
+        "display:       %llu pixels, %llu windows, %llu driver calls\n",
+        (unsigned long long) display.n_pixels,
+        (unsigned long long) display.n_windows,
+        (unsigned long long) display.n_calls
+    );
+
+    if (options->spi_mhz > 0) {
+        printf("display wait:  %.3f ms\n", display.time_waited / 1e3);
+    }
+
+    printf(
+        "heap:          %llu allocations, %llu frees (%.2f allocations per packet)\n",
+        (unsigned long long) (heap_after.n_allocs - heap_before.n_allocs),
+        (unsigned long long) (heap_after.n_frees - heap_before.n_frees),
+        (double) (heap_after.n_allocs - heap_before.n_allocs) / n_total
+    );
+
+    free(latencies);
+    free(feeder.fed_at);
+    free(shadow);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct bench_options options = {
+        .width = 240,
+        .height = 240,
+        .chunk_size = 990,
+        .repeat = 1,
+        .n_synthetic_frames = 0,
+        .scene = BENCH_SCENE_WATCH_UI,
+        .dump_path = NULL,
+        .streaming = false,
+        .spi_mhz = 0,
+        .async = false,
+        .rle_coalesce_cutoff = -1,
+        .shadow_framebuffer = false,
+    };
+    struct bench_stream stream;
+    bool verbose = false;
+    int opt, ok;
+
+    while ((opt = getopt(argc, argv, "W:H:c:r:s:Do:SM:AC:Fvh")) != -1) {
+        switch (opt) {
+            case 'W': options.width = atoi(optarg); break;
+            case 'H': options.height = atoi(optarg); break;
+            case 'c': options.chunk_size = strtoul(optarg, NULL, 10); break;
+            case 'r': options.repeat = atoi(optarg); break;
+            case 's': options.n_synthetic_frames = atoi(optarg); break;
+            case 'D': options.scene = BENCH_SCENE_DENSE_DELTAS; break;
+            case 'o': options.dump_path = optarg; break;
+            case 'S': options.streaming = true; break;
+            case 'M': options.spi_mhz = atof(optarg); break;
+            case 'A': options.async = true; break;
+            case 'C': options.rle_coalesce_cutoff = atoi(optarg); break;
+            case 'F': options.shadow_framebuffer = true; break;
+            case 'v': verbose = true; break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (options.width <= 0 || options.width > 255 || options.height <= 0 || options.height > 255 ||
+        options.chunk_size == 0 || options.repeat <= 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (options.n_synthetic_frames <= 0 && optind >= argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // The decoder logs every received chunk at info level, which would
+    // dominate the measurement.
+    esp_log_level_set("*", verbose ? ESP_LOG_INFO : ESP_LOG_WARN);
+
+    bench_stream_init(&stream);
+
+    if (options.n_synthetic_frames > 0) {
+        ok = bench_stream_synthesize(&stream, options.scene, options.width, options.height, options.n_synthetic_frames);
+    } else {
+        ok = 0;
+        for (int i = optind; i < argc && ok == 0; i++) {
+            ok = bench_stream_append_file(&stream, argv[i]);
+        }
+    }
+
+    if (ok == 0) {
+        ok = bench_stream_index_packets(&stream, options.width, options.height);
+    }
+
+    if (ok == 0 && options.dump_path != NULL) {
+        ok = bench_stream_write_file(&stream, options.dump_path);
+    }
+
+    if (ok == 0) {
+        ok = run_bench(&options, &stream);
+    }
+
+    bench_stream_deinit(&stream);
+    return ok;
+}
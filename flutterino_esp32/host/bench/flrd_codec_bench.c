@@ -0,0 +1,287 @@
+// Compares the frame encodings on a corpus of frames: encoded size, and how
+// long the flrd decoder takes per frame.
+//
+// Every frame is sent whole, as a raw keyframe, an RLE keyframe and an LZ
+// deltaframe with one rect covering the screen, so the encodings are
+// compared on the same pixels. Frames are streamed to a null display
+// driver (or buffered and presented with -P), so the decode time includes
+// handing the bytes to flrd, but no display transfers.
+//
+// The corpus is a list of raw little endian RGB565 frames, e.g. the frames
+// used by flutter_remote_display/benchmark/rle_benchmark.dart, or
+// synthesized anti-aliased text over a dithered gradient, which RLE
+// compresses badly.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "flutter_remote_display.h"
+
+#include "bench_stream.h"
+
+struct feeder {
+    struct flrd *flrd;
+    const struct bench_stream *stream;
+    size_t chunk_size;
+};
+
+static void null_display_set_window(void *context, struct rect window) {}
+
+static void null_display_write_pixels(void *context, size_t n_pixels, uint16_t *rgb565_pixels) {
+    uint64_t *n_pixels_total = context;
+    *n_pixels_total += n_pixels;
+}
+
+static void null_display_write_pixel_run(void *context, size_t n_pixels, uint16_t rgb565) {
+    uint64_t *n_pixels_total = context;
+    *n_pixels_total += n_pixels;
+}
+
+static void null_display_present(void *context) {}
+
+static const struct flrd_display_driver null_display_driver = {
+    .set_window = null_display_set_window,
+    .write_pixels = null_display_write_pixels,
+    .write_pixel_run = null_display_write_pixel_run,
+    .present = null_display_present
+};
+
+static void null_btspp_send_bytes(void *context, size_t n_bytes, void *bytes) {}
+
+static const struct flrd_btspp_interface null_btspp_driver = {
+    .send_bytes = null_btspp_send_bytes
+};
+
+static void feeder_task(void *arg) {
+    struct feeder *feeder = arg;
+    const struct bench_stream *stream = feeder->stream;
+
+    for (size_t offset = 0; offset < stream->n_bytes; offset += feeder->chunk_size) {
+        size_t n_bytes = stream->n_bytes - offset;
+        if (n_bytes > feeder->chunk_size) {
+            n_bytes = feeder->chunk_size;
+        }
+
+        flrd_add_btspp_bytes(feeder->flrd, n_bytes, stream->bytes + offset);
+    }
+
+    vTaskDelete(NULL);
+}
+
+// Anti-aliased "glyphs" (soft-edged blobs) over a vertical gradient with
+// 4x4 ordered dithering, scrolled by one row per frame.
+static void draw_frame(uint16_t *fb, int width, int height, int frame) {
+    static const uint8_t bayer[4][4] = {
+        { 0, 8, 2, 10 },
+        { 12, 4, 14, 6 },
+        { 3, 11, 1, 9 },
+        { 15, 7, 13, 5 },
+    };
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            // 0..255, dithered down to 5 bits of blue and 6 bits of green
+            int level = (y + frame) * 255 / (height + frame) + bayer[y % 4][x % 4] / 2;
+            int shade = 0;
+
+            int line = (y + frame) / 14, row = (y + frame) % 14;
+            if (row >= 2 && row < 12 && x >= 6 && x < width - 6) {
+                int glyph = (x - 6) / 7, column = (x - 6) % 7;
+                unsigned hash = glyph * 2654435761u ^ line * 40503u;
+
+                // distance from the stroke in the middle of the glyph
+                int dx = abs(column * 2 - 6), dy = abs(row * 2 - 13);
+                int distance = (hash >> 11) % 2 ? dx : dy;
+                if ((hash >> 17) % 5 != 0) {
+                    shade = distance < 2 ? 255 : distance < 4 ? 160 : distance < 5 ? 64 : 0;
+                }
+            }
+
+            int blue = (level >> 3) * (255 - shade) / 255;
+            int green = (level >> 2) * (255 - shade) / 255;
+            fb[(size_t) y * width + x] = (green << 5) | blue;
+        }
+    }
+}
+
+static int load_frames(struct bench_stream *frames, int argc, char **argv, size_t frame_size, size_t *n_frames_out) {
+    for (int i = 0; i < argc; i++) {
+        size_t n_bytes = frames->n_bytes;
+
+        if (bench_stream_append_file(frames, argv[i]) != 0) {
+            return 1;
+        }
+
+        if (frames->n_bytes - n_bytes != frame_size) {
+            fprintf(stderr, "%s has %zu bytes, expected %zu\n", argv[i], frames->n_bytes - n_bytes, frame_size);
+            return 1;
+        }
+    }
+
+    *n_frames_out = argc;
+    return 0;
+}
+
+// Decodes all packets of stream, and returns the elapsed time in us, or -1.
+static int64_t decode(const struct bench_stream *stream, int width, int height, bool streaming) {
+    uint64_t n_pixels = 0;
+    struct feeder feeder;
+    struct flrd flrd;
+
+    flrd_init(&flrd, width, height, &null_btspp_driver, NULL);
+
+    if (streaming) {
+        flrd_set_display_driver(&flrd, &null_display_driver, &n_pixels);
+    }
+
+    feeder.flrd = &flrd;
+    feeder.stream = stream;
+    feeder.chunk_size = 990;
+
+    int64_t start = esp_timer_get_time();
+
+    if (xTaskCreate(feeder_task, "feeder_task", 4096, &feeder, 5, NULL) != pdPASS) {
+        fprintf(stderr, "could not start feeder task\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < stream->n_packets; i++) {
+        struct flrd_packet *packet = flrd_wait_for_packet(&flrd);
+        if (packet == NULL) {
+            fprintf(stderr, "flrd_wait_for_packet failed\n");
+            return -1;
+        }
+
+        if (packet->type == FLRD_PACKET_FRAME) {
+            flrd_frame_present(&flrd, &packet->frame, &null_display_driver, &n_pixels);
+        }
+
+        flrd_packet_free(packet);
+    }
+
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    flrd_deinit(&flrd);
+
+    if (n_pixels != (uint64_t) width * height * stream->n_packets) {
+        fprintf(stderr, "decoded %llu pixels, expected %llu\n", (unsigned long long) n_pixels, (unsigned long long) width * height * stream->n_packets);
+        return -1;
+    }
+
+    return elapsed;
+}
+
+static void print_usage(const char *argv0) {
+    fprintf(
+        stderr,
+        "Usage: %s [options] [raw-rgb565-frame...]\n"
+        "\n"
+        "Options:\n"
+        "  -W <width>     display width in pixels (default 240)\n"
+        "  -H <height>    display height in pixels (default 240)\n"
+        "  -s <frames>    synthesize <frames> frames instead of reading files\n"
+        "  -P             buffer frames and present them, instead of streaming them\n",
+        argv0
+    );
+}
+
+int main(int argc, char **argv) {
+    static const enum flrd_frame_encoding encodings[] = {
+        FLRD_FRAME_ENCODING_KEYFRAME_RAW,
+        FLRD_FRAME_ENCODING_KEYFRAME_RLE,
+        FLRD_FRAME_ENCODING_DELTAFRAME_LZ,
+    };
+    struct bench_stream frames;
+    int width = 240, height = 240, n_synthetic_frames = 0;
+    bool streaming = true;
+    size_t n_frames = 0, frame_size, raw_bytes = 0;
+    int opt, ok = 0;
+
+    while ((opt = getopt(argc, argv, "W:H:s:Ph")) != -1) {
+        switch (opt) {
+            case 'W': width = atoi(optarg); break;
+            case 'H': height = atoi(optarg); break;
+            case 's': n_synthetic_frames = atoi(optarg); break;
+            case 'P': streaming = false; break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (width <= 0 || width > 255 || height <= 0 || height > 255 || (n_synthetic_frames <= 0 && optind >= argc)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    esp_log_level_set("*", ESP_LOG_WARN);
+
+    frame_size = (size_t) width * height * sizeof(uint16_t);
+
+    bench_stream_init(&frames);
+
+    if (n_synthetic_frames > 0) {
+        uint16_t *fb = malloc(frame_size);
+
+        ok = fb == NULL;
+        for (int i = 0; i < n_synthetic_frames && ok == 0; i++) {
+            draw_frame(fb, width, height, i);
+            ok = bench_stream_append(&frames, frame_size, fb);
+        }
+
+        n_frames = n_synthetic_frames;
+        free(fb);
+    } else {
+        ok = load_frames(&frames, argc - optind, argv + optind, frame_size, &n_frames);
+    }
+
+    printf("%zu frames, %dx%d, %s\n", n_frames, width, height, streaming ? "streaming" : "buffered");
+
+    for (size_t e = 0; e < sizeof encodings / sizeof encodings[0] && ok == 0; e++) {
+        struct bench_stream stream;
+
+        bench_stream_init(&stream);
+
+        for (size_t i = 0; i < n_frames && ok == 0; i++) {
+            // The frames are little endian, like the decoder's host.
+            ok = bench_stream_append_frame(&stream, encodings[e], (const uint16_t *) (frames.bytes + i * frame_size), width, height);
+        }
+
+        if (ok == 0) {
+            ok = bench_stream_index_packets(&stream, width, height);
+        }
+
+        if (ok == 0) {
+            int64_t elapsed = decode(&stream, width, height, streaming);
+
+            if (elapsed < 0) {
+                ok = 1;
+            } else {
+                if (raw_bytes == 0) {
+                    raw_bytes = stream.n_bytes;
+                }
+
+                printf(
+                    "%-34s %8zu bytes/frame, ratio %5.2f, decode %8.1f us/frame\n",
+                    flrd_frame_encoding_to_string(encodings[e]),
+                    stream.n_bytes / n_frames,
+                    (double) raw_bytes / stream.n_bytes,
+                    (double) elapsed / n_frames
+                );
+            }
+        }
+
+        bench_stream_deinit(&stream);
+    }
+
+    bench_stream_deinit(&frames);
+    return ok;
+}
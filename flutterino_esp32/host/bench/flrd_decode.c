@@ -0,0 +1,277 @@
+// Decodes a recorded host -> display SPP byte stream with the flrd decoder
+// into a framebuffer, and writes the framebuffer (little endian RGB565) to
+// a file, or compares it against an expected one.
+//
+// Used to check the encoders on the flutter side against the actual decoder,
+// see flutter_remote_display/test.
+//
+// The decoder keeps a shadow framebuffer and a tile cache of
+// TILE_CACHE_SLOTS tiles, so copy rect and tile frames work, unless -N is
+// given. Then, their ops are dropped, and -k checks that the decoder
+// asked the host to resend a keyframe instead.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+
+#include "flutter_remote_display.h"
+
+#include "bench_stream.h"
+
+#define TILE_CACHE_SLOTS 64
+
+struct framebuffer {
+    int width, height;
+    uint16_t *pixels;
+
+    struct rect window;
+    size_t cursor;
+};
+
+struct feeder {
+    struct flrd *flrd;
+    const struct bench_stream *stream;
+};
+
+static void framebuffer_put(struct framebuffer *fb, uint16_t rgb565) {
+    struct rect window = fb->window;
+
+    if (window.width > 0) {
+        int x = window.left + fb->cursor % window.width;
+        int y = window.top + fb->cursor / window.width;
+
+        if (x >= 0 && x < fb->width && y >= 0 && y < fb->height) {
+            fb->pixels[(size_t) y * fb->width + x] = rgb565;
+        }
+    }
+
+    fb->cursor++;
+}
+
+static void framebuffer_set_window(void *context, struct rect window) {
+    struct framebuffer *fb = context;
+
+    fb->window = window;
+    fb->cursor = 0;
+}
+
+static void framebuffer_write_pixels(void *context, size_t n_pixels, uint16_t *rgb565_pixels) {
+    for (size_t i = 0; i < n_pixels; i++) {
+        framebuffer_put(context, rgb565_pixels[i]);
+    }
+}
+
+static void framebuffer_write_pixel_run(void *context, size_t n_pixels, uint16_t rgb565) {
+    for (size_t i = 0; i < n_pixels; i++) {
+        framebuffer_put(context, rgb565);
+    }
+}
+
+static void framebuffer_present(void *context) {}
+
+static const struct flrd_display_driver framebuffer_driver = {
+    .set_window = framebuffer_set_window,
+    .write_pixels = framebuffer_write_pixels,
+    .write_pixel_run = framebuffer_write_pixel_run,
+    .present = framebuffer_present
+};
+
+// Counts the keyframe requests the decoder sends to the host.
+static void counting_btspp_send_bytes(void *context, size_t n_bytes, void *bytes) {
+    int *n_keyframe_requests = context;
+
+    if (n_bytes == 1 && *(uint8_t*) bytes == FLRD_PACKET_KEYFRAME_REQUEST) {
+        __atomic_add_fetch(n_keyframe_requests, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static const struct flrd_btspp_interface counting_btspp_driver = {
+    .send_bytes = counting_btspp_send_bytes
+};
+
+static void feeder_task(void *arg) {
+    struct feeder *feeder = arg;
+
+    flrd_add_btspp_bytes(feeder->flrd, feeder->stream->n_bytes, feeder->stream->bytes);
+
+    vTaskDelete(NULL);
+}
+
+static void print_usage(const char *argv0) {
+    fprintf(
+        stderr,
+        "Usage: %s [options] <recorded-stream>\n"
+        "\n"
+        "Options:\n"
+        "  -W <width>     display width in pixels (default 240)\n"
+        "  -H <height>    display height in pixels (default 240)\n"
+        "  -S             stream frames straight to the display (flrd_set_display_driver)\n"
+        "  -N             no shadow framebuffer and tile cache\n"
+        "  -k             fail unless the decoder requested a keyframe\n"
+        "  -o <path>      write the final framebuffer to <path>\n"
+        "  -e <path>      compare the final framebuffer against <path>\n",
+        argv0
+    );
+}
+
+static int decode(struct bench_stream *stream, struct framebuffer *fb, bool streaming, bool shadow_framebuffer, int *n_keyframe_requests) {
+    struct feeder feeder;
+    struct flrd flrd;
+    uint16_t *shadow = NULL, *tiles = NULL;
+
+    if (shadow_framebuffer) {
+        shadow = calloc((size_t) fb->width * fb->height, sizeof(uint16_t));
+        tiles = calloc((size_t) TILE_CACHE_SLOTS * FLRD_TILE_SIZE * FLRD_TILE_SIZE, sizeof(uint16_t));
+        if (shadow == NULL || tiles == NULL) {
+            fprintf(stderr, "out of memory\n");
+            free(shadow);
+            free(tiles);
+            return 1;
+        }
+    }
+
+    flrd_init(&flrd, fb->width, fb->height, &counting_btspp_driver, n_keyframe_requests);
+    flrd_set_shadow_framebuffer(&flrd, shadow);
+    flrd_set_tile_cache(&flrd, tiles, TILE_CACHE_SLOTS);
+
+    if (streaming) {
+        flrd_set_display_driver(&flrd, &framebuffer_driver, fb);
+    }
+
+    feeder.flrd = &flrd;
+    feeder.stream = stream;
+
+    if (xTaskCreate(feeder_task, "feeder_task", 4096, &feeder, 5, NULL) != pdPASS) {
+        fprintf(stderr, "could not start feeder task\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < stream->n_packets; i++) {
+        struct flrd_packet *packet = flrd_wait_for_packet(&flrd);
+        if (packet == NULL) {
+            fprintf(stderr, "flrd_wait_for_packet failed\n");
+            return 1;
+        }
+
+        if (packet->type == FLRD_PACKET_FRAME) {
+            flrd_frame_present(&flrd, &packet->frame, &framebuffer_driver, fb);
+        }
+
+        flrd_packet_free(packet);
+    }
+
+    flrd_deinit(&flrd);
+    free(shadow);
+    free(tiles);
+    return 0;
+}
+
+static int compare(const struct framebuffer *fb, const char *path) {
+    struct bench_stream expected;
+    size_t n_bytes = (size_t) fb->width * fb->height * 2;
+    int ok;
+
+    bench_stream_init(&expected);
+
+    ok = bench_stream_append_file(&expected, path);
+    if (ok == 0 && expected.n_bytes != n_bytes) {
+        fprintf(stderr, "%s has %zu bytes, expected %zu\n", path, expected.n_bytes, n_bytes);
+        ok = 1;
+    }
+
+    for (int i = 0; ok == 0 && i < fb->width * fb->height; i++) {
+        uint16_t rgb565 = expected.bytes[i * 2] | (expected.bytes[i * 2 + 1] << 8);
+
+        if (fb->pixels[i] != rgb565) {
+            fprintf(
+                stderr,
+                "pixel (%d, %d) is 0x%04x, expected 0x%04x\n",
+                i % fb->width, i / fb->width, fb->pixels[i], rgb565
+            );
+            ok = 1;
+        }
+    }
+
+    bench_stream_deinit(&expected);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    struct framebuffer fb = { .width = 240, .height = 240 };
+    struct bench_stream stream;
+    const char *output_path = NULL, *expected_path = NULL;
+    bool streaming = false, shadow_framebuffer = true, expect_keyframe_request = false;
+    int n_keyframe_requests = 0;
+    int opt, ok;
+
+    while ((opt = getopt(argc, argv, "W:H:SNko:e:h")) != -1) {
+        switch (opt) {
+            case 'W': fb.width = atoi(optarg); break;
+            case 'H': fb.height = atoi(optarg); break;
+            case 'S': streaming = true; break;
+            case 'N': shadow_framebuffer = false; break;
+            case 'k': expect_keyframe_request = true; break;
+            case 'o': output_path = optarg; break;
+            case 'e': expected_path = optarg; break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (fb.width <= 0 || fb.width > 255 || fb.height <= 0 || fb.height > 255 || optind != argc - 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    esp_log_level_set("*", ESP_LOG_WARN);
+
+    fb.pixels = calloc((size_t) fb.width * fb.height, sizeof(uint16_t));
+    if (fb.pixels == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    bench_stream_init(&stream);
+
+    ok = bench_stream_append_file(&stream, argv[optind]);
+    if (ok == 0) {
+        ok = bench_stream_index_packets(&stream, fb.width, fb.height);
+    }
+
+    if (ok == 0) {
+        ok = decode(&stream, &fb, streaming, shadow_framebuffer, &n_keyframe_requests);
+    }
+
+    if (ok == 0 && expect_keyframe_request && n_keyframe_requests == 0) {
+        fprintf(stderr, "the decoder didn't request a keyframe\n");
+        ok = 1;
+    }
+
+    if (ok == 0 && output_path != NULL) {
+        FILE *file = fopen(output_path, "wb");
+
+        if (file == NULL || fwrite(fb.pixels, sizeof(uint16_t), (size_t) fb.width * fb.height, file) != (size_t) fb.width * fb.height) {
+            fprintf(stderr, "could not write %s\n", output_path);
+            ok = 1;
+        }
+
+        if (file != NULL) {
+            fclose(file);
+        }
+    }
+
+    if (ok == 0 && expected_path != NULL) {
+        ok = compare(&fb, expected_path);
+    }
+
+    bench_stream_deinit(&stream);
+    free(fb.pixels);
+    return ok;
+}
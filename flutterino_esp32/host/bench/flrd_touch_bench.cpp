@@ -0,0 +1,414 @@
+// Host benchmark for touch input latency.
+//
+// Simulates a FocalTech touch controller behind mock I2C callbacks, read
+// through the real FocalTech_Class, and a finger tapping and dragging on it.
+// The same gestures are read by touch_input_task twice: polling the
+// controller, like the watch did before it used the INT line, and woken up
+// by the simulated INT line. Reports the latency from the finger moving to
+// the touch event, and the I2C reads while nobody touches the screen.
+//
+// Fails if an event is missed or wrong, if interrupt mode reads the
+// controller while idle, or if it's not faster than polling.
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "focaltech_touch.h"
+#include "touch_input.h"
+
+#define FT5206_VENDID                   (0x11)
+
+#define FOCALTECH_REGISTER_STATUS       (0x02)
+#define FOCALTECH_REGISTER_TOUCH1_XH    (0x03)
+#define FOCALTECH_REGISTER_INT_STATUS   (0xA4)
+#define FOCALTECH_REGISTER_VENDOR_ID    (0xA3)
+
+// A register read on the watch's 100kHz I2C bus takes about this long
+// (address, register and 5 data bytes).
+#define I2C_READ_US 800
+
+// Moves are further apart than two poll intervals, so polling sees all of
+// them and both modes report the same events.
+#define MOVES_PER_TOUCH 3
+#define MIN_HOLD_MS 35
+#define MIN_IDLE_MS 40
+
+// The simulated controller, shared by the I2C callbacks (which have no
+// context) and the finger.
+static struct mock_controller {
+    pthread_mutex_t mutex;
+
+    bool touched;
+    uint16_t x, y;
+
+    // Written by FocalTech_Class::enableINT. Only pulses INT if set.
+    uint8_t int_mode;
+
+    // The INT line, or NULL if it isn't wired up.
+    struct touch_input *int_line;
+
+    // Whether the finger is up and touch_input already reported that.
+    bool idle;
+
+    uint64_t n_reads;
+    uint64_t n_idle_reads;
+} controller;
+
+struct recorded_event {
+    uint8_t phase;
+    uint16_t x, y;
+    int64_t time;
+};
+
+struct event_log {
+    pthread_mutex_t mutex;
+    struct recorded_event *events;
+    size_t n_events, capacity;
+};
+
+struct touch_bench {
+    FocalTech_Class *touchscreen;
+
+    // What the finger did, and what touch_input reported.
+    struct event_log expected, reported;
+};
+
+struct bench_result {
+    size_t n_events;
+    bool events_match;
+    double mean_latency_ms;
+    double max_latency_ms;
+    uint64_t n_reads;
+    uint64_t n_idle_reads;
+};
+
+static void sleep_us(int64_t us) {
+    struct timespec duration = {
+        .tv_sec = (time_t) (us / 1000000),
+        .tv_nsec = (long) (us % 1000000) * 1000L,
+    };
+
+    while (nanosleep(&duration, &duration) != 0 && errno == EINTR);
+}
+
+static uint8_t mock_i2c_read(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t len) {
+    uint8_t registers[256] = {0};
+
+    if (dev_addr != FOCALTECH_SLAVE_ADDRESS || reg_addr + len > 256) {
+        return 0;
+    }
+
+    // The bus is busy for the whole transfer, the registers are sampled at
+    // the end of it.
+    sleep_us(I2C_READ_US);
+
+    pthread_mutex_lock(&controller.mutex);
+
+    registers[FOCALTECH_REGISTER_VENDOR_ID] = FT5206_VENDID;
+    registers[FOCALTECH_REGISTER_INT_STATUS] = controller.int_mode;
+    registers[FOCALTECH_REGISTER_STATUS] = controller.touched ? 1 : 0;
+
+    // Event flag (press down, lift up or contact) and the first point.
+    registers[FOCALTECH_REGISTER_TOUCH1_XH] = (controller.touched ? FOCALTECH_EVENT_CONTACT : FOCALTECH_EVENT_UP) << 6 | controller.x >> 8;
+    registers[FOCALTECH_REGISTER_TOUCH1_XH + 1] = controller.x & 0xFF;
+    registers[FOCALTECH_REGISTER_TOUCH1_XH + 2] = controller.y >> 8;
+    registers[FOCALTECH_REGISTER_TOUCH1_XH + 3] = controller.y & 0xFF;
+
+    memcpy(data, registers + reg_addr, len);
+
+    controller.n_reads++;
+    if (controller.idle) {
+        controller.n_idle_reads++;
+    }
+
+    pthread_mutex_unlock(&controller.mutex);
+    return 1;
+}
+
+static uint8_t mock_i2c_write(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t len) {
+    if (dev_addr != FOCALTECH_SLAVE_ADDRESS || len != 1) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&controller.mutex);
+    if (reg_addr == FOCALTECH_REGISTER_INT_STATUS) {
+        controller.int_mode = data[0];
+    }
+    pthread_mutex_unlock(&controller.mutex);
+
+    return 1;
+}
+
+static int event_log_init(struct event_log *log, size_t capacity) {
+    pthread_mutex_init(&log->mutex, NULL);
+    log->events = (struct recorded_event*) calloc(capacity, sizeof *log->events);
+    log->n_events = 0;
+    log->capacity = capacity;
+    return log->events == NULL;
+}
+
+static void event_log_deinit(struct event_log *log) {
+    free(log->events);
+    pthread_mutex_destroy(&log->mutex);
+}
+
+// Must be called with the log locked.
+static void event_log_add(struct event_log *log, uint8_t phase, uint16_t x, uint16_t y) {
+    if (log->n_events < log->capacity) {
+        struct recorded_event *event = log->events + log->n_events;
+
+        event->phase = phase;
+        event->x = x;
+        event->y = y;
+        event->time = esp_timer_get_time();
+    }
+
+    log->n_events++;
+}
+
+static bool on_read_point(void *context, uint16_t *x, uint16_t *y) {
+    struct touch_bench *bench = (struct touch_bench*) context;
+
+    return bench->touchscreen->getPoint(*x, *y);
+}
+
+static void on_touch_event(void *context, struct flrd_touch_event_packet *event) {
+    struct touch_bench *bench = (struct touch_bench*) context;
+
+    pthread_mutex_lock(&bench->reported.mutex);
+    event_log_add(&bench->reported, event->phase, event->x, event->y);
+    pthread_mutex_unlock(&bench->reported.mutex);
+
+    if (event->phase == FLRD_TOUCH_EVENT_PHASE_UP) {
+        pthread_mutex_lock(&controller.mutex);
+        controller.idle = !controller.touched;
+        pthread_mutex_unlock(&controller.mutex);
+    }
+}
+
+static const struct touch_input_driver touch_driver = {
+    .read_point = on_read_point,
+    .on_touch_event = on_touch_event,
+};
+
+// Puts the finger down (or moves it) at x, y, or lifts it, and pulses INT
+// like the controller does for every new report.
+static void finger_set(struct touch_bench *bench, bool touched, uint16_t x, uint16_t y) {
+    struct touch_input *int_line;
+    uint8_t phase;
+
+    pthread_mutex_lock(&controller.mutex);
+    pthread_mutex_lock(&bench->expected.mutex);
+
+    if (touched) {
+        phase = controller.touched ? FLRD_TOUCH_EVENT_PHASE_MOVE : FLRD_TOUCH_EVENT_PHASE_DOWN;
+        controller.x = x;
+        controller.y = y;
+        controller.idle = false;
+    } else {
+        phase = FLRD_TOUCH_EVENT_PHASE_UP;
+    }
+
+    controller.touched = touched;
+    event_log_add(&bench->expected, phase, controller.x, controller.y);
+
+    int_line = controller.int_mode != 0 ? controller.int_line : NULL;
+
+    pthread_mutex_unlock(&bench->expected.mutex);
+    pthread_mutex_unlock(&controller.mutex);
+
+    if (int_line != NULL) {
+        touch_input_notify_from_isr(int_line);
+    }
+}
+
+static int run(bool use_int, int n_touches, int poll_ms, unsigned seed, struct bench_result *result) {
+    size_t capacity = (size_t) n_touches * (MOVES_PER_TOUCH + 2);
+    FocalTech_Class touchscreen;
+    struct touch_bench bench;
+    struct touch_input input;
+    TaskHandle_t task;
+    double total_latency_ms = 0;
+    int ok = 0;
+
+    srand(seed);
+
+    memset(result, 0, sizeof *result);
+    controller.touched = false;
+    controller.int_mode = 0;
+    controller.int_line = NULL;
+
+    if (!touchscreen.begin(mock_i2c_read, mock_i2c_write)) {
+        fprintf(stderr, "FocalTech_Class::begin failed\n");
+        return 1;
+    }
+
+    bench.touchscreen = &touchscreen;
+    if (event_log_init(&bench.expected, capacity) != 0 || event_log_init(&bench.reported, capacity) != 0) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    touch_input_init(&input, &touch_driver, &bench, use_int ? 0 : pdMS_TO_TICKS(poll_ms));
+
+    // Same as app_main.
+    if (use_int) {
+        touchscreen.enableINT();
+        controller.int_line = &input;
+    }
+
+    pthread_mutex_lock(&controller.mutex);
+    controller.n_reads = 0;
+    controller.n_idle_reads = 0;
+    controller.idle = true;
+    pthread_mutex_unlock(&controller.mutex);
+
+    xTaskCreate(touch_input_task, "touch_task", 4096, &input, 5, &task);
+
+    for (int i = 0; i < n_touches; i++) {
+        uint16_t x = rand() % 240, y = rand() % 240;
+
+        vTaskDelay(pdMS_TO_TICKS(MIN_IDLE_MS + rand() % 40));
+        finger_set(&bench, true, x, y);
+
+        for (int j = 0; j < MOVES_PER_TOUCH; j++) {
+            vTaskDelay(pdMS_TO_TICKS(MIN_HOLD_MS + rand() % 15));
+
+            x = (x + 1 + rand() % 16) % 240;
+            y = (y + 1 + rand() % 16) % 240;
+            finger_set(&bench, true, x, y);
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(MIN_HOLD_MS + rand() % 15));
+        finger_set(&bench, false, 0, 0);
+    }
+
+    vTaskDelay(pdMS_TO_TICKS(MIN_IDLE_MS + 4 * poll_ms));
+    vTaskDelete(task);
+
+    pthread_mutex_lock(&controller.mutex);
+    controller.int_line = NULL;
+    result->n_reads = controller.n_reads;
+    result->n_idle_reads = controller.n_idle_reads;
+    pthread_mutex_unlock(&controller.mutex);
+
+    result->n_events = bench.reported.n_events;
+    result->events_match = bench.reported.n_events == bench.expected.n_events;
+
+    for (size_t i = 0; i < bench.expected.n_events && result->events_match; i++) {
+        const struct recorded_event *expected = bench.expected.events + i;
+        const struct recorded_event *reported = bench.reported.events + i;
+        double latency_ms = (reported->time - expected->time) / 1000.0;
+
+        if (reported->phase != expected->phase || reported->x != expected->x || reported->y != expected->y) {
+            fprintf(
+                stderr,
+                "event %zu: expected phase %d at %d, %d, got phase %d at %d, %d\n",
+                i, expected->phase, expected->x, expected->y, reported->phase, reported->x, reported->y
+            );
+            result->events_match = false;
+            break;
+        }
+
+        total_latency_ms += latency_ms;
+        if (latency_ms > result->max_latency_ms) {
+            result->max_latency_ms = latency_ms;
+        }
+    }
+
+    if (!result->events_match) {
+        fprintf(stderr, "expected %zu events, got %zu\n", bench.expected.n_events, bench.reported.n_events);
+        ok = 1;
+    } else if (bench.expected.n_events > 0) {
+        result->mean_latency_ms = total_latency_ms / bench.expected.n_events;
+    }
+
+    touch_input_deinit(&input);
+    event_log_deinit(&bench.reported);
+    event_log_deinit(&bench.expected);
+    return ok;
+}
+
+static void print_result(const char *name, const struct bench_result *result) {
+    printf(
+        "%-16s %4zu events, latency mean %6.2f ms, max %6.2f ms, %5llu I2C reads, %5llu while idle\n",
+        name,
+        result->n_events,
+        result->mean_latency_ms,
+        result->max_latency_ms,
+        (unsigned long long) result->n_reads,
+        (unsigned long long) result->n_idle_reads
+    );
+}
+
+static void print_usage(const char *argv0) {
+    fprintf(
+        stderr,
+        "Usage: %s [options]\n"
+        "\n"
+        "Options:\n"
+        "  -n <touches>   number of simulated touches (default 10)\n"
+        "  -p <ms>        poll interval to compare against (default 16)\n",
+        argv0
+    );
+}
+
+int main(int argc, char **argv) {
+    struct bench_result polling, interrupt;
+    int n_touches = 10, poll_ms = 16;
+    char name[32];
+    int opt, ok;
+
+    while ((opt = getopt(argc, argv, "n:p:h")) != -1) {
+        switch (opt) {
+            case 'n': n_touches = atoi(optarg); break;
+            case 'p': poll_ms = atoi(optarg); break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (n_touches <= 0 || poll_ms <= 0 || poll_ms * 2 >= MIN_HOLD_MS) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    esp_log_level_set("*", ESP_LOG_WARN);
+    pthread_mutex_init(&controller.mutex, NULL);
+
+    ok = run(false, n_touches, poll_ms, 1, &polling);
+    if (ok == 0) {
+        ok = run(true, n_touches, poll_ms, 1, &interrupt);
+    }
+
+    if (ok != 0) {
+        return ok;
+    }
+
+    snprintf(name, sizeof name, "polling (%d ms)", poll_ms);
+    print_result(name, &polling);
+    print_result("interrupt", &interrupt);
+
+    if (interrupt.n_idle_reads != 0) {
+        fprintf(stderr, "interrupt mode read the controller while idle\n");
+        ok = 1;
+    }
+
+    if (interrupt.mean_latency_ms >= polling.mean_latency_ms) {
+        fprintf(stderr, "interrupt mode isn't faster than polling\n");
+        ok = 1;
+    }
+
+    return ok;
+}
@@ -0,0 +1,39 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "heap_stats.h"
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n_members, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static uint64_t n_allocs = 0;
+static uint64_t n_frees = 0;
+
+void *__wrap_malloc(size_t size) {
+    __atomic_add_fetch(&n_allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n_members, size_t size) {
+    __atomic_add_fetch(&n_allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(n_members, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&n_allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+    if (ptr != NULL) {
+        __atomic_add_fetch(&n_frees, 1, __ATOMIC_RELAXED);
+    }
+    __real_free(ptr);
+}
+
+void heap_stats_get(struct heap_stats *stats_out) {
+    stats_out->n_allocs = __atomic_load_n(&n_allocs, __ATOMIC_RELAXED);
+    stats_out->n_frees = __atomic_load_n(&n_frees, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,16 @@
+#ifndef _FLRD_BENCH_HEAP_STATS_H
+#define _FLRD_BENCH_HEAP_STATS_H
+
+#include <stdint.h>
+
+// Counts heap operations of the whole process. The counters are fed by
+// malloc/calloc/realloc/free wrappers, so the executable has to be linked with
+// -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free
+struct heap_stats {
+    uint64_t n_allocs;
+    uint64_t n_frees;
+};
+
+void heap_stats_get(struct heap_stats *stats_out);
+
+#endif
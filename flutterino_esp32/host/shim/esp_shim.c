@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+static esp_log_level_t log_level = ESP_LOG_INFO;
+
+static const char log_level_letters[] = { 'N', 'E', 'W', 'I', 'D', 'V' };
+
+void esp_log_level_set(const char *tag, esp_log_level_t level) {
+    (void) tag;
+    log_level = level;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...) {
+    va_list args;
+
+    if (level > log_level || level == ESP_LOG_NONE) {
+        return;
+    }
+
+    fprintf(stderr, "%c (%lld) %s: ", log_level_letters[level], (long long) (esp_timer_get_time() / 1000), tag);
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+
+    fputc('\n', stderr);
+}
+
+int64_t esp_timer_get_time(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+struct tskTaskControlBlock {
+    pthread_t thread;
+    TaskFunction_t task_code;
+    void *parameters;
+};
+
+static void timespec_from_ticks(struct timespec *deadline, TickType_t ticks) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+
+    deadline->tv_sec += ticks / 1000;
+    deadline->tv_nsec += (long) (ticks % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// Waits on cond until it's signalled or the timeout expires.
+// Returns false on timeout. A timeout of 0 never waits.
+static bool cond_wait_ticks(pthread_cond_t *cond, pthread_mutex_t *mutex, TickType_t ticks, const struct timespec *deadline) {
+    if (ticks == 0) {
+        return false;
+    } else if (ticks == portMAX_DELAY) {
+        pthread_cond_wait(cond, mutex);
+        return true;
+    } else {
+        return pthread_cond_timedwait(cond, mutex, deadline) != ETIMEDOUT;
+    }
+}
+
+static void unlock_mutex(void *mutex) {
+    pthread_mutex_unlock(mutex);
+}
+
+QueueHandle_t xQueueCreateStatic(
+    UBaseType_t length,
+    UBaseType_t item_size,
+    uint8_t *storage,
+    StaticQueue_t *queue_buffer
+) {
+    pthread_condattr_t attr;
+
+    memset(queue_buffer, 0, sizeof *queue_buffer);
+
+    pthread_mutex_init(&queue_buffer->mutex, NULL);
+
+    // timed waits use CLOCK_MONOTONIC, so the conditions have to as well.
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue_buffer->not_empty, &attr);
+    pthread_cond_init(&queue_buffer->not_full, &attr);
+    pthread_condattr_destroy(&attr);
+
+    queue_buffer->length = length;
+    queue_buffer->item_size = item_size;
+    queue_buffer->storage = storage;
+    return queue_buffer;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait) {
+    struct timespec deadline;
+    // volatile because pthread_cleanup_push may be implemented using setjmp
+    volatile BaseType_t result = pdPASS;
+
+    timespec_from_ticks(&deadline, ticks_to_wait);
+
+    pthread_mutex_lock(&queue->mutex);
+    pthread_cleanup_push(unlock_mutex, &queue->mutex);
+
+    while (queue->count == queue->length) {
+        if (!cond_wait_ticks(&queue->not_full, &queue->mutex, ticks_to_wait, &deadline)) {
+            result = pdFAIL;
+            break;
+        }
+    }
+
+    if (result == pdPASS) {
+        UBaseType_t tail = (queue->head + queue->count) % queue->length;
+
+        if (queue->item_size != 0) {
+            memcpy(queue->storage + tail * queue->item_size, item, queue->item_size);
+        }
+
+        queue->count++;
+        pthread_cond_signal(&queue->not_empty);
+    }
+
+    pthread_cleanup_pop(1);
+    return result;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks_to_wait) {
+    struct timespec deadline;
+    // volatile because pthread_cleanup_push may be implemented using setjmp
+    volatile BaseType_t result = pdPASS;
+
+    timespec_from_ticks(&deadline, ticks_to_wait);
+
+    pthread_mutex_lock(&queue->mutex);
+    pthread_cleanup_push(unlock_mutex, &queue->mutex);
+
+    while (queue->count == 0) {
+        if (!cond_wait_ticks(&queue->not_empty, &queue->mutex, ticks_to_wait, &deadline)) {
+            result = pdFAIL;
+            break;
+        }
+    }
+
+    if (result == pdPASS) {
+        if (queue->item_size != 0) {
+            memcpy(item, queue->storage + queue->head * queue->item_size, queue->item_size);
+        }
+
+        queue->head = (queue->head + 1) % queue->length;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+
+    pthread_cleanup_pop(1);
+    return result;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    UBaseType_t count;
+
+    pthread_mutex_lock(&queue->mutex);
+    count = queue->count;
+    pthread_mutex_unlock(&queue->mutex);
+
+    return count;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->mutex);
+}
+
+static void *task_entry(void *arg) {
+    struct tskTaskControlBlock *task = arg;
+
+    task->task_code(task->parameters);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(
+    TaskFunction_t task_code,
+    const char *name,
+    uint32_t stack_depth,
+    void *parameters,
+    UBaseType_t priority,
+    TaskHandle_t *created_task
+) {
+    struct tskTaskControlBlock *task;
+    int ok;
+
+    task = malloc(sizeof *task);
+    if (task == NULL) {
+        return pdFAIL;
+    }
+
+    task->task_code = task_code;
+    task->parameters = parameters;
+
+    ok = pthread_create(&task->thread, NULL, task_entry, task);
+    if (ok != 0) {
+        free(task);
+        return pdFAIL;
+    }
+
+    if (created_task != NULL) {
+        *created_task = task;
+    }
+
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    if (task == NULL || pthread_equal(task->thread, pthread_self())) {
+        // Deleting the calling task. The handle is leaked, same as a task
+        // that returns from its task function.
+        pthread_exit(NULL);
+    }
+
+    pthread_cancel(task->thread);
+    pthread_join(task->thread, NULL);
+    free(task);
+}
+
+void vTaskDelay(TickType_t ticks_to_delay) {
+    struct timespec duration = {
+        .tv_sec = ticks_to_delay / 1000,
+        .tv_nsec = (long) (ticks_to_delay % 1000) * 1000000L,
+    };
+
+    while (nanosleep(&duration, &duration) != 0 && errno == EINTR);
+}
+
+TickType_t xTaskGetTickCount(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (TickType_t) (now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
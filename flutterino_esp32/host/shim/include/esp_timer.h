@@ -0,0 +1,17 @@
+#ifndef _FLRD_SHIM_ESP_TIMER_H
+#define _FLRD_SHIM_ESP_TIMER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Microseconds since an arbitrary, monotonic point in time.
+int64_t esp_timer_get_time(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
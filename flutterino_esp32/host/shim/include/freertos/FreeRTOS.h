@@ -0,0 +1,51 @@
+// Minimal FreeRTOS API shim so the flrd decoder can be built and benchmarked
+// on a POSIX host. Only the parts of the API used by flutter_remote_display.c
+// and touch_input.c are provided, implemented on top of pthreads.
+#ifndef _FLRD_SHIM_FREERTOS_H
+#define _FLRD_SHIM_FREERTOS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE ((BaseType_t) 0)
+#define pdTRUE ((BaseType_t) 1)
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define portMAX_DELAY ((TickType_t) 0xFFFFFFFFUL)
+#define portTICK_PERIOD_MS ((TickType_t) 1)
+#define pdMS_TO_TICKS(ms) ((TickType_t) (ms))
+
+#define portYIELD_FROM_ISR(...) ((void) 0)
+
+// On the host, a queue is a ring of fixed-size items guarded by a mutex.
+// Semaphores are queues with an item size of zero, just like in FreeRTOS.
+typedef struct QueueDefinition {
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+    uint8_t *storage;
+} StaticQueue_t;
+
+typedef StaticQueue_t StaticSemaphore_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
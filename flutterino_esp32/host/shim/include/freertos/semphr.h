@@ -0,0 +1,21 @@
+#ifndef _FLRD_SHIM_SEMPHR_H
+#define _FLRD_SHIM_SEMPHR_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#define xSemaphoreCreateBinaryStatic(semaphore_buffer) \
+    xQueueCreateStatic(1, 0, NULL, (semaphore_buffer))
+
+#define xSemaphoreGive(semaphore) xQueueSend((semaphore), NULL, 0)
+
+// There are no interrupts on the host, so "ISRs" are just other threads,
+// which never preempt the task they wake up.
+#define xSemaphoreGiveFromISR(semaphore, higher_priority_task_woken) \
+    (*(higher_priority_task_woken) = pdFALSE, xQueueSend((semaphore), NULL, 0))
+
+#define xSemaphoreTake(semaphore, ticks_to_wait) xQueueReceive((semaphore), NULL, (ticks_to_wait))
+
+#define vSemaphoreDelete(semaphore) vQueueDelete(semaphore)
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef _FLRD_SHIM_TASK_H
+#define _FLRD_SHIM_TASK_H
+
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct tskTaskControlBlock *TaskHandle_t;
+
+typedef void (*TaskFunction_t)(void *);
+
+// Tasks are plain pthreads. Stack depth and priority are accepted for API
+// compatibility but ignored.
+BaseType_t xTaskCreate(
+    TaskFunction_t task_code,
+    const char *name,
+    uint32_t stack_depth,
+    void *parameters,
+    UBaseType_t priority,
+    TaskHandle_t *created_task
+);
+
+void vTaskDelete(TaskHandle_t task);
+
+void vTaskDelay(TickType_t ticks_to_delay);
+
+TickType_t xTaskGetTickCount(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,3 +1,5 @@
+#include <assert.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <freertos/FreeRTOS.h>
@@ -7,26 +9,24 @@
 #include "flutter_remote_display.h"
 
 #include <esp_log.h>
-#include "esp_timer.h"
 
-struct byte_data {
-    int64_t timestamp;
-    
-    size_t n_bytes;
-    uint8_t bytes[];
-};
+static_assert(sizeof(struct flrd_rle_run) == 3, "struct flrd_rle_run must match the wire format");
+static_assert(sizeof(struct flrd_palette_run) == 2, "struct flrd_palette_run must match the wire format");
+static_assert(sizeof(struct flrd_copy_rect) == 6, "struct flrd_copy_rect must match the wire format");
+static_assert(sizeof(struct flrd_tile_op) == 4, "struct flrd_tile_op must match the wire format");
+static_assert((FLRD_BTSPP_RING_SIZE & (FLRD_BTSPP_RING_SIZE - 1)) == 0, "FLRD_BTSPP_RING_SIZE must be a power of two");
+static_assert((FLRD_LZ_WINDOW & (FLRD_LZ_WINDOW - 1)) == 0, "FLRD_LZ_WINDOW must be a power of two");
 
 struct byte_reader {
-    QueueHandle_t queue;
-    struct byte_data *data;
+    struct flrd *flrd;
 
-    size_t offset;
+    // The part of the ring buffer acquired by the reader, and how much of it
+    // is not consumed yet.
+    const uint8_t *bytes;
+    size_t n_acquired;
+    size_t n_bytes;
 };
 
-size_t sizeof_byte_data(size_t n_bytes) {
-    return sizeof(struct byte_data) + n_bytes;
-}
-
 int flrd_init(struct flrd *flrd, int width, int height, const struct flrd_btspp_interface *btspp_driver, void *btspp_driver_context) {
     memset(flrd, 0, sizeof(struct flrd));
 
@@ -37,77 +37,133 @@ int flrd_init(struct flrd *flrd, int width, int height, const struct flrd_btspp_
         &flrd->packet_handler_queue_buffer
     );
 
-    flrd->btspp_buffer_queue = xQueueCreateStatic(
-        sizeof(flrd->btspp_buffer_queue_storage) / sizeof(void*),
-        sizeof(void*),
-        flrd->btspp_buffer_queue_storage,
-        &flrd->btspp_buffer_queue_buffer
-    );
-
     flrd->width = width;
     flrd->height = height;
+    flrd->rle_coalesce_cutoff = FLRD_RLE_COALESCE_CUTOFF;
 
     flrd->btspp_byte_data_consumed = xSemaphoreCreateBinaryStatic(&flrd->btspp_byte_data_consumed_buffer);
+    flrd->btspp_byte_data_available = xSemaphoreCreateBinaryStatic(&flrd->btspp_byte_data_available_buffer);
     memcpy(&flrd->btspp_driver, btspp_driver, sizeof(struct flrd_btspp_interface));
     flrd->btspp_driver_context = btspp_driver_context;
+
+#if FLRD_PACKET_SLAB_COUNT > 0
+    flrd->packet_slab_pool = xQueueCreateStatic(
+        FLRD_PACKET_SLAB_COUNT,
+        sizeof(void*),
+        flrd->packet_slab_pool_storage,
+        &flrd->packet_slab_pool_buffer
+    );
+
+    for (int i = 0; i < FLRD_PACKET_SLAB_COUNT; i++) {
+        void *slab = NULL;
+        xQueueSend(flrd->packet_slab_pool, &slab, 0);
+    }
+#endif
+
     return 0;
 }
 
 void flrd_deinit(struct flrd *flrd) {
     vTaskDelete(flrd->packet_builder_task);
+    vSemaphoreDelete(flrd->btspp_byte_data_available);
     vSemaphoreDelete(flrd->btspp_byte_data_consumed);
     vQueueDelete(flrd->packet_handler_queue);
-    vQueueDelete(flrd->btspp_buffer_queue);
+
+#if FLRD_PACKET_SLAB_COUNT > 0
+    // Slabs of packets that weren't freed yet are leaked.
+    void *slab;
+    while (xQueueReceive(flrd->packet_slab_pool, &slab, 0) == pdPASS) {
+        free(slab);
+    }
+
+    vQueueDelete(flrd->packet_slab_pool);
+#endif
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+// Upper bound for how many bytes the packet builder task acquires from the
+// ring at once. Acquired bytes are only handed back to the bluetooth spp task
+// after all of them were consumed.
+#define BYTE_READER_MAX_ACQUIRE (FLRD_BTSPP_RING_SIZE / 16)
+
+// Hands the bytes acquired by the reader back to the ring, then acquires the
+// next contiguous part of it, blocking until there's at least one byte available.
+static void byte_reader_refill(struct byte_reader *reader) {
+    struct flrd *flrd = reader->flrd;
+    size_t read_offset, write_offset, space_wanted, index;
+
+    read_offset = flrd->btspp_ring_read_offset + reader->n_acquired;
+    reader->n_acquired = 0;
+    reader->n_bytes = 0;
+
+    __atomic_store_n(&flrd->btspp_ring_read_offset, read_offset, __ATOMIC_SEQ_CST);
+
+    // Only wake up the bluetooth spp task if it's waiting for space, and
+    // enough space is free now. Otherwise both tasks would ping-pong.
+    space_wanted = __atomic_load_n(&flrd->btspp_ring_space_wanted, __ATOMIC_SEQ_CST);
+    if (space_wanted != 0) {
+        size_t space = FLRD_BTSPP_RING_SIZE - (__atomic_load_n(&flrd->btspp_ring_write_offset, __ATOMIC_ACQUIRE) - read_offset);
+        if (space >= space_wanted) {
+            xSemaphoreGive(flrd->btspp_byte_data_consumed);
+        }
+    }
 
-static inline void byte_reader_read_bytes(
+    // If we don't have data yet, wait for the bluetooth spp task to give us some
+    while ((write_offset = __atomic_load_n(&flrd->btspp_ring_write_offset, __ATOMIC_ACQUIRE)) == read_offset) {
+        xSemaphoreTake(flrd->btspp_byte_data_available, portMAX_DELAY);
+    }
+
+    index = read_offset & (FLRD_BTSPP_RING_SIZE - 1);
+
+    reader->bytes = flrd->btspp_ring + index;
+    reader->n_acquired = min(min(write_offset - read_offset, FLRD_BTSPP_RING_SIZE - index), BYTE_READER_MAX_ACQUIRE);
+    reader->n_bytes = reader->n_acquired;
+}
+
+static void byte_reader_read_bytes_slow(
     struct byte_reader *reader,
     size_t n_bytes,
     void *bytes_out
 ) {
-    static int64_t last_receive = 0;
-
     while (n_bytes > 0) {
-        static_assert(sizeof(void*) == sizeof(uint32_t));
-
-        // If we don't have data yet, wait for the bluetooth spp task to give us some
-        if (reader->data == NULL) {
-            BaseType_t ok = xQueueReceive(reader->queue, &reader->data, portMAX_DELAY);
-            if (ok != pdPASS) {
-                ESP_LOGE("flrd", "Error receiving data from the bluetooth spp task");
-                return;
-            }
-
-            reader->offset = 0;
-
-            last_receive = esp_timer_get_time();
-
-            ESP_LOGD("flrd", "Scheduling overhead (acquire) %lld us", last_receive - reader->data->timestamp);
+        if (reader->n_bytes == 0) {
+            byte_reader_refill(reader);
         }
 
-        size_t to_copy = min(n_bytes, reader->data->n_bytes - reader->offset);
+        size_t to_copy = min(n_bytes, reader->n_bytes);
 
         // bytes_out can be NULL if we just want to discard the data
         if (bytes_out != NULL) {
-            memcpy(bytes_out, reader->data->bytes + reader->offset, to_copy);
+            memcpy(bytes_out, reader->bytes, to_copy);
+            bytes_out = (uint8_t*) bytes_out + to_copy;
         }
 
+        reader->bytes += to_copy;
+        reader->n_bytes -= to_copy;
         n_bytes -= to_copy;
-        reader->offset += to_copy;
-
-        // Signal to the bluetooth spp task that we consumed all it's data
-        if (reader->data->n_bytes == reader->offset) {
-            free(reader->data);
-            reader->data = NULL;
+    }
+}
 
-            int64_t now = esp_timer_get_time();
-            if (last_receive != 0) {
-                ESP_LOGI("flrd", "Processing data took %lld us", now - last_receive);
-            }
+static inline void byte_reader_read_bytes(
+    struct byte_reader *reader,
+    size_t n_bytes,
+    void *bytes_out
+) {
+    // Fast path: everything we need was already acquired.
+    if (n_bytes <= reader->n_bytes) {
+        // bytes_out can be NULL if we just want to discard the data
+        if (bytes_out != NULL) {
+            memcpy(bytes_out, reader->bytes, n_bytes);
         }
+
+        reader->bytes += n_bytes;
+        reader->n_bytes -= n_bytes;
+        return;
     }
+
+    byte_reader_read_bytes_slow(reader, n_bytes, bytes_out);
 }
 
 static inline uint8_t byte_reader_read_byte(
@@ -130,30 +186,291 @@ static inline uint16_t byte_reader_read_word(
     return result;
 }
 
-static bool read_rle_runs(struct byte_reader *reader, struct flrd_rle_runs *runs_out) {
+// Every packet, and everything it points to (rects, runs, pixels), is
+// allocated from one bump arena. The arena is a slab from flrd->packet_slab_pool,
+// with the packet itself at the start, so flrd_packet_free can release the
+// whole packet at once.
+//
+// Allocations that don't fit into the slab (e.g. raw keyframes) spill over
+// into separately malloced chunks of at least FLRD_PACKET_SLAB_SIZE bytes,
+// which are bump-allocated from as well.
+struct packet_arena_chunk {
+    struct packet_arena_chunk *next;
+};
+
+struct packet_arena {
+    struct flrd *flrd;
+    bool pooled;
+    size_t size, used;
+
+    struct packet_arena_chunk *overflow;
+    uint8_t *overflow_cursor;
+    size_t overflow_remaining;
+
+    struct flrd_packet packet;
+};
+
+#define PACKET_ARENA_ALIGN 8
+
+#define packet_arena_align(n) (((n) + PACKET_ARENA_ALIGN - 1) & ~((size_t) PACKET_ARENA_ALIGN - 1))
+
+static inline struct packet_arena *packet_arena_of(struct flrd_packet *packet) {
+    return (struct packet_arena*) ((uint8_t*) packet - offsetof(struct packet_arena, packet));
+}
+
+static struct flrd_packet *packet_new(struct flrd *flrd, enum flrd_packet_type type) {
+    struct packet_arena *arena = NULL;
+
+#if FLRD_PACKET_SLAB_COUNT > 0
+    // Slabs are only malloced the first time they're needed, the pool
+    // starts out with FLRD_PACKET_SLAB_COUNT NULL entries.
+    // If all slabs are in use, this waits for the packet handler to free one.
+    xQueueReceive(flrd->packet_slab_pool, &arena, portMAX_DELAY);
+    if (arena == NULL) {
+        arena = malloc(FLRD_PACKET_SLAB_SIZE);
+        if (arena == NULL) {
+            xQueueSend(flrd->packet_slab_pool, &arena, portMAX_DELAY);
+            return NULL;
+        }
+    }
+
+    arena->pooled = true;
+    arena->size = FLRD_PACKET_SLAB_SIZE;
+#else
+    // Sized up to the alignment, so the arena starts out exactly full and
+    // every allocation goes to an overflow chunk.
+    arena = malloc(packet_arena_align(sizeof *arena));
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    arena->pooled = false;
+    arena->size = packet_arena_align(sizeof *arena);
+#endif
+
+    arena->flrd = flrd;
+    arena->used = packet_arena_align(sizeof *arena);
+    arena->overflow = NULL;
+    arena->overflow_cursor = NULL;
+    arena->overflow_remaining = 0;
+
+    memset(&arena->packet, 0, sizeof arena->packet);
+    arena->packet.type = type;
+
+    return &arena->packet;
+}
+
+// Allocates memory that lives as long as the packet. Never returns NULL for
+// a zero size.
+static void *packet_alloc(struct flrd_packet *packet, size_t size) {
+    struct packet_arena *arena = packet_arena_of(packet);
+    struct packet_arena_chunk *chunk;
+    size_t chunk_size;
+    void *memory;
+
+    size = packet_arena_align(size);
+
+    if (arena->size - arena->used >= size) {
+        memory = (uint8_t*) arena + arena->used;
+        arena->used += size;
+        return memory;
+    }
+
+    if (arena->overflow_remaining < size) {
+#if FLRD_PACKET_SLAB_COUNT > 0
+        chunk_size = max(size, (size_t) FLRD_PACKET_SLAB_SIZE);
+#else
+        chunk_size = size;
+#endif
+
+        chunk = malloc(packet_arena_align(sizeof *chunk) + chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+
+        chunk->next = arena->overflow;
+        arena->overflow = chunk;
+        arena->overflow_cursor = (uint8_t*) chunk + packet_arena_align(sizeof *chunk);
+        arena->overflow_remaining = chunk_size;
+    }
+
+    memory = arena->overflow_cursor;
+    arena->overflow_cursor += size;
+    arena->overflow_remaining -= size;
+    return memory;
+}
+
+static bool read_rle_runs(struct byte_reader *reader, struct flrd_packet *packet, struct flrd_rle_runs *runs_out) {
     struct flrd_rle_run *runs;
 
     size_t n_runs = byte_reader_read_word(reader);
 
-    if (runs_out != NULL) {
-        runs = malloc(n_runs * sizeof(struct flrd_rle_run));
+    if (packet != NULL) {
+        runs = packet_alloc(packet, n_runs * sizeof(struct flrd_rle_run));
     } else {
         runs = NULL;
     }
 
-    if (runs != NULL) {
-        for (size_t i = 0; i < n_runs; i++) {
-            runs[i].n_pixels = byte_reader_read_byte(reader);
-            runs[i].rgb565 = byte_reader_read_word(reader);
-        }
-    } else {
-        byte_reader_read_bytes(reader, n_runs * (sizeof(uint8_t) + sizeof(uint16_t)), NULL);
+    // runs is NULL if we just want to discard the data
+    byte_reader_read_bytes(reader, n_runs * sizeof(struct flrd_rle_run), runs);
+    if (runs == NULL) {
+        return false;
     }
 
     runs_out->n_runs = n_runs;
     runs_out->runs = runs;
 
-    return runs != NULL;
+    return true;
+}
+
+// The second byte of a palette is the number of bits per packed index,
+// or'ed with PALETTE_FORMAT_RLE if the indices are RLE encoded instead.
+#define PALETTE_FORMAT_RLE 0x80
+#define PALETTE_FORMAT_BITS_PER_INDEX_MASK 0x0F
+
+// Reads a palette: the number of colors minus one, the format, then the colors.
+// rgb565_colors must have space for 256 colors, or be NULL to discard them.
+// Returns false if the format is invalid, the rest of the frame can't be
+// decoded then.
+static bool read_palette(struct byte_reader *reader, uint16_t *rgb565_colors, struct flrd_palette *palette_out) {
+    size_t n_colors = (size_t) byte_reader_read_byte(reader) + 1;
+    uint8_t format = byte_reader_read_byte(reader);
+    uint8_t bits_per_index = format & PALETTE_FORMAT_BITS_PER_INDEX_MASK;
+
+    byte_reader_read_bytes(reader, n_colors * sizeof(uint16_t), rgb565_colors);
+    if (rgb565_colors != NULL) {
+        memset(rgb565_colors + n_colors, 0, (256 - n_colors) * sizeof(uint16_t));
+    }
+
+    palette_out->n_colors = n_colors;
+    palette_out->rgb565_colors = rgb565_colors;
+    palette_out->rle = (format & PALETTE_FORMAT_RLE) != 0;
+    palette_out->bits_per_index = bits_per_index;
+
+    if (!palette_out->rle && bits_per_index != 1 && bits_per_index != 2 && bits_per_index != 4 && bits_per_index != 8) {
+        ESP_LOGE("flrd", "Invalid palette format 0x%02x.", format);
+        return false;
+    }
+
+    return true;
+}
+
+static inline size_t packed_indices_size(size_t n_pixels, unsigned bits_per_index) {
+    return (n_pixels * bits_per_index + 7) / 8;
+}
+
+static bool read_indexed_pixels(struct byte_reader *reader, struct flrd_packet *packet, const struct flrd_palette *palette, size_t n_pixels, union flrd_indexed_pixels *pixels_out) {
+    if (palette->rle) {
+        struct flrd_palette_run *runs;
+        size_t n_runs = byte_reader_read_word(reader);
+
+        if (packet != NULL) {
+            runs = packet_alloc(packet, n_runs * sizeof(struct flrd_palette_run));
+        } else {
+            runs = NULL;
+        }
+
+        // runs is NULL if we just want to discard the data
+        byte_reader_read_bytes(reader, n_runs * sizeof(struct flrd_palette_run), runs);
+        if (runs == NULL) {
+            return false;
+        }
+
+        pixels_out->rle.n_runs = n_runs;
+        pixels_out->rle.runs = runs;
+    } else {
+        uint8_t *indices;
+        size_t n_bytes = packed_indices_size(n_pixels, palette->bits_per_index);
+
+        if (packet != NULL) {
+            indices = packet_alloc(packet, n_bytes);
+        } else {
+            indices = NULL;
+        }
+
+        byte_reader_read_bytes(reader, n_bytes, indices);
+        if (indices == NULL) {
+            return false;
+        }
+
+        pixels_out->packed_indices = indices;
+    }
+
+    return true;
+}
+
+// Reads the rest of an LZ literal or match length, if its token nibble
+// was 15: bytes that are added to it, up to and including the first one
+// that isn't 255.
+static size_t lz_read_length(struct byte_reader *reader, size_t nibble) {
+    size_t length = nibble;
+    uint8_t byte;
+
+    if (nibble == 15) {
+        do {
+            byte = byte_reader_read_byte(reader);
+            length += byte;
+        } while (byte == 255);
+    }
+
+    return length;
+}
+
+// Clamps the length of an LZ sequence to the pixels left in the rect.
+// Only corrupt data overruns a rect.
+static inline size_t lz_clamp_length(size_t length, size_t n_left) {
+    if (length > n_left) {
+        ESP_LOGE("flrd", "LZ sequence overruns its rect.");
+        return n_left;
+    }
+
+    return length;
+}
+
+static inline bool lz_is_valid_offset(size_t offset, size_t n_decoded) {
+    if (offset == 0 || offset > n_decoded || offset > FLRD_LZ_WINDOW) {
+        ESP_LOGE("flrd", "Invalid LZ match offset %zu after %zu pixels.", offset, n_decoded);
+        return false;
+    }
+
+    return true;
+}
+
+// Decodes n_pixels LZ encoded pixels into rgb565_pixels.
+// rgb565_pixels can be NULL if we just want to discard the data.
+static void read_lz_pixels(struct byte_reader *reader, size_t n_pixels, uint16_t *rgb565_pixels) {
+    size_t n_decoded = 0;
+
+    while (n_decoded < n_pixels) {
+        uint8_t token = byte_reader_read_byte(reader);
+        size_t n_literals = lz_clamp_length(lz_read_length(reader, token >> 4), n_pixels - n_decoded);
+
+        byte_reader_read_bytes(
+            reader,
+            n_literals * sizeof(uint16_t),
+            rgb565_pixels != NULL ? rgb565_pixels + n_decoded : NULL
+        );
+        n_decoded += n_literals;
+
+        // The last sequence of a rect has no match.
+        if (n_decoded == n_pixels) {
+            break;
+        }
+
+        size_t offset = byte_reader_read_word(reader);
+        size_t n_match = lz_clamp_length(lz_read_length(reader, token & 0x0F) + FLRD_LZ_MIN_MATCH, n_pixels - n_decoded);
+
+        if (rgb565_pixels != NULL) {
+            bool valid = lz_is_valid_offset(offset, n_decoded);
+
+            // Matches may overlap themselves, so copy one pixel at a time.
+            for (size_t i = n_decoded; i < n_decoded + n_match; i++) {
+                rgb565_pixels[i] = valid ? rgb565_pixels[i - offset] : 0;
+            }
+        }
+
+        n_decoded += n_match;
+    }
 }
 
 static struct flrd_packet *read_raw_keyframe_packet(struct flrd *flrd, struct byte_reader *reader) {
@@ -161,27 +478,26 @@ static struct flrd_packet *read_raw_keyframe_packet(struct flrd *flrd, struct by
     uint16_t *rgb565_pixels;
     size_t n_pixels;
 
-    packet = malloc(sizeof(struct flrd_packet));
-    if (packet == NULL) {
-        ESP_LOGE("flrd", "Out of memory while reading raw keyframe packet. Discarding the rest of the data.");
-    }
-
     n_pixels = flrd->width * flrd->height;
 
+    packet = packet_new(flrd, FLRD_PACKET_FRAME);
     if (packet != NULL) {
-        rgb565_pixels = malloc(n_pixels * sizeof(uint16_t));
-        if (rgb565_pixels == NULL) {
-            ESP_LOGE("flrd", "Out of memory while reading raw keyframe packet. Discarding the rest of the data.");
-            free(packet);
-        }
-    } else{
+        rgb565_pixels = packet_alloc(packet, n_pixels * sizeof(uint16_t));
+    } else {
         rgb565_pixels = NULL;
     }
 
+    if (rgb565_pixels == NULL) {
+        ESP_LOGE("flrd", "Out of memory while reading raw keyframe packet. Discarding the rest of the data.");
+        if (packet != NULL) {
+            flrd_packet_free(packet);
+            packet = NULL;
+        }
+    }
+
     byte_reader_read_bytes(reader, n_pixels * sizeof(uint16_t), rgb565_pixels);
 
     if (packet != NULL) {
-        packet->type = FLRD_PACKET_FRAME;
         packet->frame.encoding = FLRD_FRAME_ENCODING_KEYFRAME_RAW;
         packet->frame.keyframe.raw.rgb565_pixels = rgb565_pixels;
     }
@@ -193,217 +509,1041 @@ static struct flrd_packet *read_rle_keyframe_packet(struct flrd *flrd, struct by
     struct flrd_packet *packet;
     bool ok;
     
-    packet = calloc(1, sizeof(struct flrd_packet));
-    if (packet == NULL) {
+    packet = packet_new(flrd, FLRD_PACKET_FRAME);
+
+    ok = read_rle_runs(reader, packet, packet == NULL ? NULL : &packet->frame.keyframe.rle);
+    if (!ok) {
         ESP_LOGE("flrd", "Out of memory while reading RLE keyframe packet. Discarding the rest of the data.");
+        if (packet != NULL) {
+            flrd_packet_free(packet);
+            packet = NULL;
+        }
     }
 
-    ok = read_rle_runs(reader, packet == NULL ? NULL : &packet->frame.keyframe.rle);
-    if (!ok) {
+    if (packet != NULL) {
+        packet->frame.encoding = FLRD_FRAME_ENCODING_KEYFRAME_RLE;
+    }
+
+    return packet;
+}
+
+static struct flrd_packet *read_raw_deltaframe_packet(struct flrd *flrd, struct byte_reader *reader) {
+    struct flrd_frame_damaged_rect *rects;
+    struct flrd_packet *packet;
+    size_t n_rects;
+
+    packet = packet_new(flrd, FLRD_PACKET_FRAME);
+
+    n_rects = byte_reader_read_byte(reader);
+
+    if (packet != NULL) {
+        rects = packet_alloc(packet, n_rects * sizeof(struct flrd_frame_damaged_rect));
+    } else {
+        rects = NULL;
+    }
+
+    if (rects == NULL) {
+        ESP_LOGE("flrd", "Out of memory while reading raw deltaframe packet. Discarding the rest of the data.");
+        if (packet != NULL) {
+            flrd_packet_free(packet);
+            packet = NULL;
+        }
+    }
+
+    for (size_t i = 0; i < n_rects; i++) {
+        uint8_t header[4];
+
+        byte_reader_read_bytes(reader, sizeof(header), header);
+
+        uint8_t x = header[0];
+        uint8_t y = header[1];
+        uint8_t width = header[2];
+        uint8_t height = header[3];
+
+        size_t n_pixels = width * height;
+
+        uint16_t *rgb565_pixels;
+        
+        if (packet != NULL) {
+            rgb565_pixels = packet_alloc(packet, n_pixels * sizeof(uint16_t));
+            if (rgb565_pixels == NULL) {
+                ESP_LOGE("flrd", "Out of memory while reading raw deltaframe packet. Discarding the rest of the data.");
+                flrd_packet_free(packet);
+                packet = NULL;
+            }
+        } else {
+            rgb565_pixels = NULL;
+        }
+
+        byte_reader_read_bytes(reader, n_pixels * sizeof(uint16_t), rgb565_pixels);
+
+        if (packet != NULL) {
+            rects[i].x = x;
+            rects[i].y = y;
+            rects[i].width = width;
+            rects[i].height = height;
+            rects[i].raw.rgb565_pixels = rgb565_pixels;
+        }
+    }
+
+    if (packet != NULL) {
+        packet->frame.encoding = FLRD_FRAME_ENCODING_DELTAFRAME_RAW;
+        packet->frame.deltaframe.n_rects = n_rects;
+        packet->frame.deltaframe.rects = rects;
+    }
+
+    return packet;
+}
+
+static struct flrd_packet *read_rle_deltaframe_packet(struct flrd *flrd, struct byte_reader *reader) {
+    struct flrd_frame_damaged_rect *rects;
+    struct flrd_packet *packet;
+    size_t n_rects;
+
+    packet = packet_new(flrd, FLRD_PACKET_FRAME);
+
+    n_rects = byte_reader_read_word(reader);
+
+    if (packet != NULL) {
+        rects = packet_alloc(packet, n_rects * sizeof *rects);
+    } else {
+        rects = NULL;
+    }
+
+    if (rects == NULL) {
+        ESP_LOGE("flrd", "Out of memory while reading RLE deltaframe packet. Discarding the rest of the data.");
+        if (packet != NULL) {
+            flrd_packet_free(packet);
+            packet = NULL;
+        }
+    }
+
+    for (size_t i = 0; i < n_rects; i++) {
+        uint8_t header[4];
+
+        byte_reader_read_bytes(reader, sizeof(header), header);
+
+        uint8_t x = header[0];
+        uint8_t y = header[1];
+        uint8_t width = header[2];
+        uint8_t height = header[3];
+
         if (packet != NULL) {
-            free(packet);
+            rects[i].x = x;
+            rects[i].y = y;
+            rects[i].width = width;
+            rects[i].height = height;
+        }
+
+        bool ok = read_rle_runs(reader, packet, packet == NULL ? NULL : &rects[i].rle);
+        if (!ok && packet != NULL) {
+            ESP_LOGE("flrd", "Out of memory while reading RLE deltaframe packet. Discarding the rest of the data.");
+            flrd_packet_free(packet);
             packet = NULL;
         }
-    }
+    }
+
+    if (packet != NULL) {
+        packet->frame.encoding = FLRD_FRAME_ENCODING_DELTAFRAME_RLE;
+        packet->frame.deltaframe.n_rects = n_rects;
+        packet->frame.deltaframe.rects = rects;
+    }
+
+    return packet;
+}
+
+static struct flrd_packet *read_palette_keyframe_packet(struct flrd *flrd, struct byte_reader *reader) {
+    struct flrd_palette palette;
+    struct flrd_packet *packet;
+    uint16_t *rgb565_colors;
+    bool ok;
+
+    packet = packet_new(flrd, FLRD_PACKET_FRAME);
+    if (packet != NULL) {
+        rgb565_colors = packet_alloc(packet, 256 * sizeof(uint16_t));
+        if (rgb565_colors == NULL) {
+            flrd_packet_free(packet);
+            packet = NULL;
+        }
+    } else {
+        rgb565_colors = NULL;
+    }
+
+    if (!read_palette(reader, rgb565_colors, &palette)) {
+        if (packet != NULL) {
+            flrd_packet_free(packet);
+        }
+        return NULL;
+    }
+
+    ok = read_indexed_pixels(
+        reader,
+        packet,
+        &palette,
+        flrd->width * flrd->height,
+        packet == NULL ? NULL : &packet->frame.keyframe.indexed
+    );
+    if (!ok) {
+        ESP_LOGE("flrd", "Out of memory while reading palette keyframe packet. Discarding the rest of the data.");
+        if (packet != NULL) {
+            flrd_packet_free(packet);
+            packet = NULL;
+        }
+    }
+
+    if (packet != NULL) {
+        packet->frame.encoding = FLRD_FRAME_ENCODING_KEYFRAME_PALETTE;
+        packet->frame.palette = palette;
+    }
+
+    return packet;
+}
+
+static struct flrd_packet *read_palette_deltaframe_packet(struct flrd *flrd, struct byte_reader *reader) {
+    struct flrd_frame_damaged_rect *rects;
+    struct flrd_palette palette;
+    struct flrd_packet *packet;
+    uint16_t *rgb565_colors;
+    size_t n_rects;
+
+    packet = packet_new(flrd, FLRD_PACKET_FRAME);
+    if (packet != NULL) {
+        rgb565_colors = packet_alloc(packet, 256 * sizeof(uint16_t));
+        if (rgb565_colors == NULL) {
+            flrd_packet_free(packet);
+            packet = NULL;
+        }
+    } else {
+        rgb565_colors = NULL;
+    }
+
+    if (!read_palette(reader, rgb565_colors, &palette)) {
+        if (packet != NULL) {
+            flrd_packet_free(packet);
+        }
+        return NULL;
+    }
+
+    n_rects = byte_reader_read_word(reader);
+
+    if (packet != NULL) {
+        rects = packet_alloc(packet, n_rects * sizeof *rects);
+    } else {
+        rects = NULL;
+    }
+
+    if (rects == NULL) {
+        ESP_LOGE("flrd", "Out of memory while reading palette deltaframe packet. Discarding the rest of the data.");
+        if (packet != NULL) {
+            flrd_packet_free(packet);
+            packet = NULL;
+        }
+    }
+
+    for (size_t i = 0; i < n_rects; i++) {
+        uint8_t header[4];
+
+        byte_reader_read_bytes(reader, sizeof(header), header);
+
+        if (packet != NULL) {
+            rects[i].x = header[0];
+            rects[i].y = header[1];
+            rects[i].width = header[2];
+            rects[i].height = header[3];
+        }
+
+        bool ok = read_indexed_pixels(
+            reader,
+            packet,
+            &palette,
+            header[2] * header[3],
+            packet == NULL ? NULL : &rects[i].indexed
+        );
+        if (!ok && packet != NULL) {
+            ESP_LOGE("flrd", "Out of memory while reading palette deltaframe packet. Discarding the rest of the data.");
+            flrd_packet_free(packet);
+            packet = NULL;
+        }
+    }
+
+    if (packet != NULL) {
+        packet->frame.encoding = FLRD_FRAME_ENCODING_DELTAFRAME_PALETTE;
+        packet->frame.palette = palette;
+        packet->frame.deltaframe.n_rects = n_rects;
+        packet->frame.deltaframe.rects = rects;
+    }
+
+    return packet;
+}
+
+// LZ encoded rects are decoded while reading, so the packet is an ordinary
+// raw deltaframe.
+static struct flrd_packet *read_lz_deltaframe_packet(struct flrd *flrd, struct byte_reader *reader) {
+    struct flrd_frame_damaged_rect *rects;
+    struct flrd_packet *packet;
+    size_t n_rects;
+
+    packet = packet_new(flrd, FLRD_PACKET_FRAME);
+
+    n_rects = byte_reader_read_word(reader);
+
+    if (packet != NULL) {
+        rects = packet_alloc(packet, n_rects * sizeof *rects);
+    } else {
+        rects = NULL;
+    }
+
+    if (rects == NULL) {
+        ESP_LOGE("flrd", "Out of memory while reading LZ deltaframe packet. Discarding the rest of the data.");
+        if (packet != NULL) {
+            flrd_packet_free(packet);
+            packet = NULL;
+        }
+    }
+
+    for (size_t i = 0; i < n_rects; i++) {
+        uint8_t header[4];
+        uint16_t *rgb565_pixels;
+
+        byte_reader_read_bytes(reader, sizeof(header), header);
+
+        size_t n_pixels = header[2] * header[3];
+
+        if (packet != NULL) {
+            rgb565_pixels = packet_alloc(packet, n_pixels * sizeof(uint16_t));
+            if (rgb565_pixels == NULL) {
+                ESP_LOGE("flrd", "Out of memory while reading LZ deltaframe packet. Discarding the rest of the data.");
+                flrd_packet_free(packet);
+                packet = NULL;
+            }
+        } else {
+            rgb565_pixels = NULL;
+        }
+
+        read_lz_pixels(reader, n_pixels, rgb565_pixels);
+
+        if (packet != NULL) {
+            rects[i].x = header[0];
+            rects[i].y = header[1];
+            rects[i].width = header[2];
+            rects[i].height = header[3];
+            rects[i].raw.rgb565_pixels = rgb565_pixels;
+        }
+    }
+
+    if (packet != NULL) {
+        packet->frame.encoding = FLRD_FRAME_ENCODING_DELTAFRAME_RAW;
+        packet->frame.deltaframe.n_rects = n_rects;
+        packet->frame.deltaframe.rects = rects;
+    }
+
+    return packet;
+}
+
+static struct flrd_packet *read_copy_rects_packet(struct flrd *flrd, struct byte_reader *reader) {
+    struct flrd_copy_rect *copies;
+    struct flrd_packet *packet;
+    size_t n_copies;
+
+    packet = packet_new(flrd, FLRD_PACKET_FRAME);
+
+    n_copies = byte_reader_read_byte(reader);
+
+    if (packet != NULL) {
+        copies = packet_alloc(packet, n_copies * sizeof *copies);
+    } else {
+        copies = NULL;
+    }
+
+    // copies is NULL if we just want to discard the data
+    byte_reader_read_bytes(reader, n_copies * sizeof *copies, copies);
+
+    if (copies == NULL) {
+        ESP_LOGE("flrd", "Out of memory while reading copy rects packet. Discarding the rest of the data.");
+        if (packet != NULL) {
+            flrd_packet_free(packet);
+        }
+        return NULL;
+    }
+
+    packet->frame.encoding = FLRD_FRAME_ENCODING_COPY_RECTS;
+    packet->frame.copy_rects.n_copies = n_copies;
+    packet->frame.copy_rects.copies = copies;
+
+    return packet;
+}
+
+static struct flrd_packet *read_tiles_packet(struct flrd *flrd, struct byte_reader *reader) {
+    struct flrd_tile_op *ops;
+    struct flrd_packet *packet;
+    size_t n_ops;
+
+    packet = packet_new(flrd, FLRD_PACKET_FRAME);
+
+    n_ops = byte_reader_read_word(reader);
+
+    if (packet != NULL) {
+        ops = packet_alloc(packet, n_ops * sizeof *ops);
+    } else {
+        ops = NULL;
+    }
+
+    // ops is NULL if we just want to discard the data
+    byte_reader_read_bytes(reader, n_ops * sizeof *ops, ops);
+
+    if (ops == NULL) {
+        ESP_LOGE("flrd", "Out of memory while reading tiles packet. Discarding the rest of the data.");
+        if (packet != NULL) {
+            flrd_packet_free(packet);
+        }
+        return NULL;
+    }
+
+    packet->frame.encoding = FLRD_FRAME_ENCODING_TILES;
+    packet->frame.tiles.n_ops = n_ops;
+    packet->frame.tiles.ops = ops;
+
+    return packet;
+}
+
+static struct flrd_packet *read_backlight_packet(struct flrd *flrd, struct byte_reader *reader) {
+    struct flrd_packet *packet;
+    uint8_t intensity;
+
+    packet = packet_new(flrd, FLRD_PACKET_BACKLIGHT);
+    if (packet == NULL) {
+        // out of memory. just discard the rest of the data.
+    }
+
+    intensity = byte_reader_read_byte(reader);
+
+    if (packet != NULL) {
+        packet->backlight.intensity = intensity;
+    }
+
+    return packet;
+}
+
+static struct flrd_packet *read_vibration_packet(struct flrd *flrd, struct byte_reader *reader) {
+    struct flrd_packet *packet;
+    uint8_t duration_millis;
+
+    packet = packet_new(flrd, FLRD_PACKET_VIBRATION);
+    if (packet == NULL) {
+        // out of memory. just discard the rest of the data.
+    }
+
+    duration_millis = byte_reader_read_byte(reader);
+
+    if (packet != NULL) {
+        packet->vibration.duration_millis = duration_millis;
+    }
+
+    return packet;
+
+}
+
+static struct flrd_packet *read_ping_packet(struct flrd *flrd, struct byte_reader *reader) {
+    return packet_new(flrd, FLRD_PACKET_PING);
+}
+
+static struct flrd_packet *read_query_device_info_packet(struct flrd *flrd, struct byte_reader *reader) {
+    return packet_new(flrd, FLRD_PACKET_QUERY_DEVICE_INFO);
+}
+
+// Writes pixels to a display driver.
+//
+// If the driver supports asynchronous writes, pixels and RLE runs are
+// expanded into one of flrd->line_buffers while the other one is being
+// transferred to the display, and we only ever wait for the transfer of the
+// previous buffer, when changing the window or when presenting.
+//
+// Otherwise, RLE runs shorter than flrd->rle_coalesce_cutoff are expanded
+// into a line buffer and written with write_pixels, since for short runs the
+// per-call overhead of write_pixel_run is a lot more than the pixels cost.
+// Everything else is passed straight through to the driver.
+//
+// If there's a shadow framebuffer, all pixels are mirrored into it as well.
+struct display_writer {
+    // For requesting a keyframe when an op can't be applied.
+    struct flrd *flrd;
+
+    const struct flrd_display_driver *driver;
+    void *driver_context;
+    size_t rle_coalesce_cutoff;
+
+    uint16_t (*line_buffers)[FLRD_LINE_BUFFER_PIXELS];
+    int current;
+    size_t n_buffered;
+    bool transfer_pending;
+
+    uint16_t *shadow;
+    int shadow_width, shadow_height;
+
+    uint16_t *tile_cache;
+    size_t n_tile_slots;
+
+    // The current window, and how many pixels were written to it so far.
+    struct rect window;
+    size_t cursor;
+};
+
+static void display_writer_init(struct display_writer *writer, struct flrd *flrd, const struct flrd_display_driver *driver, void *driver_context) {
+    writer->flrd = flrd;
+    writer->driver = driver;
+    writer->driver_context = driver_context;
+    writer->rle_coalesce_cutoff = flrd->rle_coalesce_cutoff;
+    writer->line_buffers = flrd->line_buffers;
+    writer->current = 0;
+    writer->n_buffered = 0;
+    writer->transfer_pending = false;
+    writer->shadow = flrd->shadow_framebuffer;
+    writer->shadow_width = flrd->width;
+    writer->shadow_height = flrd->height;
+    writer->tile_cache = flrd->tile_cache;
+    writer->n_tile_slots = flrd->n_tile_slots;
+    writer->window = (struct rect) { 0 };
+    writer->cursor = 0;
+}
+
+static inline bool display_writer_is_async(const struct display_writer *writer) {
+    return writer->driver->write_pixels_async != NULL && writer->driver->wait_async != NULL;
+}
+
+static void display_writer_wait(struct display_writer *writer) {
+    if (writer->transfer_pending) {
+        writer->driver->wait_async(writer->driver_context);
+        writer->transfer_pending = false;
+    }
+}
+
+// Starts the transfer of the current line buffer and switches to the other one.
+static void display_writer_flush(struct display_writer *writer) {
+    if (writer->n_buffered == 0) {
+        return;
+    }
+
+    if (!display_writer_is_async(writer)) {
+        writer->driver->write_pixels(writer->driver_context, writer->n_buffered, writer->line_buffers[writer->current]);
+        writer->n_buffered = 0;
+        return;
+    }
+
+    // The other buffer is still being transferred. Once that's done, we can
+    // start this one and fill the other one in the meantime.
+    display_writer_wait(writer);
+
+    writer->driver->write_pixels_async(writer->driver_context, writer->n_buffered, writer->line_buffers[writer->current]);
+    writer->transfer_pending = true;
+
+    writer->current ^= 1;
+    writer->n_buffered = 0;
+}
+
+static void display_writer_set_window(struct display_writer *writer, struct rect window) {
+    display_writer_flush(writer);
+    display_writer_wait(writer);
+
+    writer->driver->set_window(writer->driver_context, window);
+
+    writer->window = window;
+    writer->cursor = 0;
+}
+
+// Mirrors pixels written to the current window into the shadow framebuffer.
+// Writes a run of rgb565 if rgb565_pixels is NULL.
+static void display_writer_shadow(struct display_writer *writer, size_t n_pixels, const uint16_t *rgb565_pixels, uint16_t rgb565) {
+    const struct rect window = writer->window;
+
+    if (writer->shadow == NULL || window.width <= 0) {
+        return;
+    }
+
+    while (n_pixels > 0) {
+        int x = window.left + writer->cursor % window.width;
+        int y = window.top + writer->cursor / window.width;
+        size_t n = min(n_pixels, window.width - writer->cursor % window.width);
+
+        // Rows that aren't completely on the screen are skipped.
+        if (x >= 0 && y >= 0 && x + n <= writer->shadow_width && y < writer->shadow_height) {
+            uint16_t *shadow = writer->shadow + (size_t) y * writer->shadow_width + x;
+
+            if (rgb565_pixels != NULL) {
+                memcpy(shadow, rgb565_pixels, n * sizeof(uint16_t));
+            } else {
+                for (size_t i = 0; i < n; i++) {
+                    shadow[i] = rgb565;
+                }
+            }
+        }
+
+        if (rgb565_pixels != NULL) {
+            rgb565_pixels += n;
+        }
+
+        writer->cursor += n;
+        n_pixels -= n;
+    }
+}
+
+// Writes pixels to the display, without mirroring them into the shadow
+// framebuffer.
+static void display_writer_emit_pixels(struct display_writer *writer, size_t n_pixels, uint16_t *rgb565_pixels) {
+    if (!display_writer_is_async(writer)) {
+        display_writer_flush(writer);
+        writer->driver->write_pixels(writer->driver_context, n_pixels, rgb565_pixels);
+        return;
+    }
+
+    while (n_pixels > 0) {
+        size_t n = min(n_pixels, FLRD_LINE_BUFFER_PIXELS - writer->n_buffered);
+
+        memcpy(writer->line_buffers[writer->current] + writer->n_buffered, rgb565_pixels, n * sizeof(uint16_t));
+        writer->n_buffered += n;
+        rgb565_pixels += n;
+        n_pixels -= n;
+
+        if (writer->n_buffered == FLRD_LINE_BUFFER_PIXELS) {
+            display_writer_flush(writer);
+        }
+    }
+}
+
+static void display_writer_write_pixels(struct display_writer *writer, size_t n_pixels, uint16_t *rgb565_pixels) {
+    display_writer_shadow(writer, n_pixels, rgb565_pixels, 0);
+    display_writer_emit_pixels(writer, n_pixels, rgb565_pixels);
+}
+
+static void display_writer_write_pixel_run(struct display_writer *writer, size_t n_pixels, uint16_t rgb565) {
+    display_writer_shadow(writer, n_pixels, NULL, rgb565);
+
+    if (!display_writer_is_async(writer) && n_pixels >= writer->rle_coalesce_cutoff) {
+        display_writer_flush(writer);
+        writer->driver->write_pixel_run(writer->driver_context, n_pixels, rgb565);
+        return;
+    }
+
+    while (n_pixels > 0) {
+        size_t n = min(n_pixels, FLRD_LINE_BUFFER_PIXELS - writer->n_buffered);
+        uint16_t *pixels = writer->line_buffers[writer->current] + writer->n_buffered;
+
+        for (size_t i = 0; i < n; i++) {
+            pixels[i] = rgb565;
+        }
+
+        writer->n_buffered += n;
+        n_pixels -= n;
+
+        if (writer->n_buffered == FLRD_LINE_BUFFER_PIXELS) {
+            display_writer_flush(writer);
+        }
+    }
+}
+
+// Expands n_pixels packed palette indices into the current line buffer,
+// flushing it whenever it's full.
+static void display_writer_write_packed_indices(struct display_writer *writer, const uint16_t *rgb565_colors, unsigned bits_per_index, size_t n_pixels, const uint8_t *indices) {
+    const unsigned mask = (1u << bits_per_index) - 1;
+    size_t bit = 0;
+
+    while (n_pixels > 0) {
+        size_t n = min(n_pixels, FLRD_LINE_BUFFER_PIXELS - writer->n_buffered);
+        uint16_t *pixels = writer->line_buffers[writer->current] + writer->n_buffered;
+
+        for (size_t i = 0; i < n; i++, bit += bits_per_index) {
+            pixels[i] = rgb565_colors[(indices[bit >> 3] >> (bit & 7)) & mask];
+        }
+
+        display_writer_shadow(writer, n, pixels, 0);
+
+        writer->n_buffered += n;
+        n_pixels -= n;
+
+        if (writer->n_buffered == FLRD_LINE_BUFFER_PIXELS) {
+            display_writer_flush(writer);
+        }
+    }
+}
+
+static void display_writer_write_indexed_pixels(struct display_writer *writer, const struct flrd_palette *palette, size_t n_pixels, const union flrd_indexed_pixels *pixels) {
+    if (palette->rle) {
+        for (size_t i = 0; i < pixels->rle.n_runs; i++) {
+            display_writer_write_pixel_run(
+                writer,
+                pixels->rle.runs[i].n_pixels,
+                palette->rgb565_colors[pixels->rle.runs[i].index]
+            );
+        }
+    } else {
+        display_writer_write_packed_indices(writer, palette->rgb565_colors, palette->bits_per_index, n_pixels, pixels->packed_indices);
+    }
+}
+
+// Copies a rect of the shadow framebuffer to another position, then writes
+// the destination rect to the display.
+//
+// Copies that can't be applied are dropped. The host assumes they were
+// applied, so every later delta would be drawn on top of the wrong pixels
+// until the next keyframe; one is requested.
+static void display_writer_copy_rect(struct display_writer *writer, const struct flrd_copy_rect *copy) {
+    const int stride = writer->shadow_width;
+    uint16_t *shadow = writer->shadow;
+
+    if (shadow == NULL) {
+        ESP_LOGE("flrd", "Can't copy rects without a shadow framebuffer, see flrd_set_shadow_framebuffer.");
+        flrd_request_keyframe(writer->flrd);
+        return;
+    }
+
+    if (copy->src_x + copy->width > writer->shadow_width || copy->src_y + copy->height > writer->shadow_height ||
+        copy->dst_x + copy->width > writer->shadow_width || copy->dst_y + copy->height > writer->shadow_height) {
+        ESP_LOGE("flrd", "Copy rect is out of bounds.");
+        flrd_request_keyframe(writer->flrd);
+        return;
+    }
+
+    // When copying downwards, start at the bottom, so source rows aren't
+    // overwritten before they were copied. memmove handles overlap within a row.
+    for (int i = 0; i < copy->height; i++) {
+        int row = copy->dst_y > copy->src_y ? copy->height - 1 - i : i;
+
+        memmove(
+            shadow + (size_t) (copy->dst_y + row) * stride + copy->dst_x,
+            shadow + (size_t) (copy->src_y + row) * stride + copy->src_x,
+            copy->width * sizeof(uint16_t)
+        );
+    }
+
+    display_writer_set_window(
+        writer,
+        (struct rect) {
+            .left = copy->dst_x,
+            .top = copy->dst_y,
+            .width = copy->width,
+            .height = copy->height,
+        }
+    );
 
-    if (packet != NULL) {
-        packet->type = FLRD_PACKET_FRAME;
-        packet->frame.encoding = FLRD_FRAME_ENCODING_KEYFRAME_RLE;
+    if (copy->width == stride) {
+        display_writer_emit_pixels(writer, copy->width * copy->height, shadow + (size_t) copy->dst_y * stride);
+        return;
     }
 
-    return packet;
+    for (int y = copy->dst_y; y < copy->dst_y + copy->height; y++) {
+        display_writer_emit_pixels(writer, copy->width, shadow + (size_t) y * stride + copy->dst_x);
+    }
 }
 
-static struct flrd_packet *read_raw_deltaframe_packet(struct flrd *flrd, struct byte_reader *reader) {
-    struct flrd_frame_damaged_rect *rects;
-    struct flrd_packet *packet;
-    size_t n_rects;
+// Stores the tile of the shadow framebuffer at (op->x, op->y) in the tile
+// cache, or draws a cached tile there.
+//
+// Like copy rects, ops that can't be applied are dropped and a keyframe is
+// requested, since the host assumes the op was applied.
+static void display_writer_tile_op(struct display_writer *writer, const struct flrd_tile_op *op) {
+    const int stride = writer->shadow_width;
+    size_t slot = op->slot & ~FLRD_TILE_OP_STORE;
+    uint16_t *tile;
+
+    if (writer->tile_cache == NULL || writer->shadow == NULL) {
+        ESP_LOGE("flrd", "Can't use tiles without a tile cache and shadow framebuffer, see flrd_set_tile_cache.");
+        flrd_request_keyframe(writer->flrd);
+        return;
+    }
 
-    packet = malloc(sizeof(struct flrd_packet));
-    if (packet == NULL) {
-        ESP_LOGE("flrd", "Out of memory while reading raw deltaframe packet. Discarding the rest of the data.");
+    if (slot >= writer->n_tile_slots || op->x + FLRD_TILE_SIZE > writer->shadow_width || op->y + FLRD_TILE_SIZE > writer->shadow_height) {
+        ESP_LOGE("flrd", "Tile op is out of bounds.");
+        flrd_request_keyframe(writer->flrd);
+        return;
     }
 
-    n_rects = byte_reader_read_byte(reader);
+    tile = writer->tile_cache + slot * FLRD_TILE_SIZE * FLRD_TILE_SIZE;
 
-    if (packet != NULL) {
-        rects = malloc(n_rects * sizeof(struct flrd_frame_damaged_rect));
-        if (rects == NULL) {
-            ESP_LOGE("flrd", "Out of memory while reading raw deltaframe packet. Discarding the rest of the data.");
-            free(packet);
+    if (op->slot & FLRD_TILE_OP_STORE) {
+        for (int y = 0; y < FLRD_TILE_SIZE; y++) {
+            memcpy(
+                tile + y * FLRD_TILE_SIZE,
+                writer->shadow + (size_t) (op->y + y) * stride + op->x,
+                FLRD_TILE_SIZE * sizeof(uint16_t)
+            );
         }
-    } else {
-        rects = NULL;
+        return;
     }
 
-    for (size_t i = 0; i < n_rects; i++) {
-        uint8_t x = byte_reader_read_byte(reader);
-        uint8_t y = byte_reader_read_byte(reader);
-        uint8_t width = byte_reader_read_byte(reader);
-        uint8_t height = byte_reader_read_byte(reader);
+    display_writer_set_window(
+        writer,
+        (struct rect) {
+            .left = op->x,
+            .top = op->y,
+            .width = FLRD_TILE_SIZE,
+            .height = FLRD_TILE_SIZE,
+        }
+    );
+    display_writer_write_pixels(writer, FLRD_TILE_SIZE * FLRD_TILE_SIZE, tile);
+}
 
-        size_t n_pixels = width * height;
+static void display_writer_present(struct display_writer *writer) {
+    display_writer_flush(writer);
+    display_writer_wait(writer);
 
-        uint16_t *rgb565_pixels;
-        
-        if (rects != NULL) {
-            rgb565_pixels = malloc(n_pixels * sizeof(uint16_t));
-            if (rgb565_pixels == NULL) {
-                ESP_LOGE("flrd", "Out of memory while reading raw deltaframe packet. Discarding the rest of the data.");
-                for (size_t j = 0; j < i; j++) {
-                    free(rects[j].raw.rgb565_pixels);
-                }
-                free(rects);
-                free(packet);
-                rects = NULL;
-                packet = NULL;
-                break;
-            }
-        } else {
-            rgb565_pixels = NULL;
-        }
+    writer->driver->present(writer->driver_context);
+}
 
-        byte_reader_read_bytes(reader, n_pixels * sizeof(uint16_t), rgb565_pixels);
+static void stream_pixels(struct flrd *flrd, struct display_writer *writer, struct byte_reader *reader, size_t n_pixels) {
+    const size_t max_pixels = sizeof(flrd->stream_scratch.rgb565_pixels) / sizeof(uint16_t);
 
-        if (rects != NULL) {
-            rects[i].x = x;
-            rects[i].y = y;
-            rects[i].width = width;
-            rects[i].height = height;
-            rects[i].raw.rgb565_pixels = rgb565_pixels;
-        }
-    }
+    while (n_pixels > 0) {
+        size_t n = min(n_pixels, max_pixels);
 
-    if (packet != NULL) {
-        packet->type = FLRD_PACKET_FRAME;
-        packet->frame.encoding = FLRD_FRAME_ENCODING_DELTAFRAME_RAW;
-        packet->frame.deltaframe.n_rects = n_rects;
-        packet->frame.deltaframe.rects = rects;
-    }
+        byte_reader_read_bytes(reader, n * sizeof(uint16_t), flrd->stream_scratch.rgb565_pixels);
+        display_writer_write_pixels(writer, n, flrd->stream_scratch.rgb565_pixels);
 
-    return packet;
+        n_pixels -= n;
+    }
 }
 
-static struct flrd_packet *read_rle_deltaframe_packet(struct flrd *flrd, struct byte_reader *reader) {
-    struct flrd_frame_damaged_rect *rects;
-    struct flrd_packet *packet;
-    size_t n_rects;
+static void stream_rle_runs(struct flrd *flrd, struct display_writer *writer, struct byte_reader *reader) {
+    const size_t max_runs = sizeof(flrd->stream_scratch.rle_runs) / sizeof(struct flrd_rle_run);
+    const struct flrd_rle_run *runs = flrd->stream_scratch.rle_runs;
+    size_t n_runs = byte_reader_read_word(reader);
 
-    packet = malloc(sizeof *packet);
-    if (packet == NULL) {
-        ESP_LOGE("flrd", "Out of memory while reading RLE deltaframe packet. Discarding the rest of the data.");
-    }
+    while (n_runs > 0) {
+        size_t n = min(n_runs, max_runs);
 
-    n_rects = byte_reader_read_word(reader);
+        byte_reader_read_bytes(reader, n * sizeof(struct flrd_rle_run), flrd->stream_scratch.rle_runs);
 
-    if (packet != NULL) {
-        rects = malloc(n_rects * sizeof *rects);
-        if (rects == NULL) {
-            ESP_LOGE("flrd", "Out of memory while reading RLE deltaframe packet. Discarding the rest of the data.");
-            free(packet);
-            packet = NULL;
+        for (size_t i = 0; i < n; i++) {
+            display_writer_write_pixel_run(writer, runs[i].n_pixels, runs[i].rgb565);
         }
-    } else {
-        rects = NULL;
+
+        n_runs -= n;
     }
+}
 
-    for (size_t i = 0; i < n_rects; i++) {
-        uint8_t x = byte_reader_read_byte(reader);
-        uint8_t y = byte_reader_read_byte(reader);
-        uint8_t width = byte_reader_read_byte(reader);
-        uint8_t height = byte_reader_read_byte(reader);
+static void stream_indexed_pixels(struct flrd *flrd, struct display_writer *writer, struct byte_reader *reader, const struct flrd_palette *palette, size_t n_pixels) {
+    if (palette->rle) {
+        const size_t max_runs = sizeof(flrd->stream_scratch.palette_runs) / sizeof(struct flrd_palette_run);
+        const struct flrd_palette_run *runs = flrd->stream_scratch.palette_runs;
+        size_t n_runs = byte_reader_read_word(reader);
 
-        if (rects != NULL) {
-            rects[i].x = x;
-            rects[i].y = y;
-            rects[i].width = width;
-            rects[i].height = height;
-        }
+        while (n_runs > 0) {
+            size_t n = min(n_runs, max_runs);
 
-        bool ok = read_rle_runs(reader, rects == NULL ? NULL : &rects[i].rle);
-        if (!ok) {
-            if (rects != NULL) {
-                for (size_t j = 0; j < i; j++) {
-                    free(rects[j].rle.runs);
-                }
-                free(rects);
-                rects = NULL;
-            }
-            if (packet != NULL) {
-                free(packet);
-                packet = NULL;
+            byte_reader_read_bytes(reader, n * sizeof(struct flrd_palette_run), flrd->stream_scratch.palette_runs);
+
+            for (size_t i = 0; i < n; i++) {
+                display_writer_write_pixel_run(writer, runs[i].n_pixels, palette->rgb565_colors[runs[i].index]);
             }
-            break;
+
+            n_runs -= n;
         }
-    }
+    } else {
+        const size_t indices_per_byte = 8 / palette->bits_per_index;
+        size_t n_bytes = packed_indices_size(n_pixels, palette->bits_per_index);
 
-    if (packet != NULL) {
-        packet->type = FLRD_PACKET_FRAME;
-        packet->frame.encoding = FLRD_FRAME_ENCODING_DELTAFRAME_RLE;
-        packet->frame.deltaframe.n_rects = n_rects;
-        packet->frame.deltaframe.rects = rects;
-    }
+        // Every byte holds a whole number of indices, so the indices can be
+        // expanded one chunk of bytes at a time.
+        while (n_bytes > 0) {
+            size_t n = min(n_bytes, sizeof(flrd->stream_scratch.bytes));
+            size_t n_chunk_pixels = min(n_pixels, n * indices_per_byte);
 
-    return packet;
+            byte_reader_read_bytes(reader, n, flrd->stream_scratch.bytes);
+            display_writer_write_packed_indices(writer, palette->rgb565_colors, palette->bits_per_index, n_chunk_pixels, flrd->stream_scratch.bytes);
+
+            n_pixels -= n_chunk_pixels;
+            n_bytes -= n;
+        }
+    }
 }
 
-static struct flrd_packet *read_backlight_packet(struct byte_reader *reader) {
-    struct flrd_packet *packet;
-    uint8_t intensity;
+static void stream_lz_flush(struct display_writer *writer, uint16_t *window, size_t *n_flushed, size_t n_decoded) {
+    while (*n_flushed < n_decoded) {
+        size_t index = *n_flushed & (FLRD_LZ_WINDOW - 1);
+        size_t n = min(n_decoded - *n_flushed, FLRD_LZ_WINDOW - index);
 
-    packet = malloc(sizeof(struct flrd_packet));
-    if (packet == NULL) {
-        // out of memory. just discard the rest of the data.
+        display_writer_write_pixels(writer, n, window + index);
+        *n_flushed += n;
     }
+}
 
-    intensity = byte_reader_read_byte(reader);
+// Decodes n_pixels LZ encoded pixels into flrd->stream_lz_window, which is
+// used as a ring buffer. Decoded pixels are written to the display at least
+// every half window, so they're written before they're overwritten.
+static void stream_lz_pixels(struct flrd *flrd, struct display_writer *writer, struct byte_reader *reader, size_t n_pixels) {
+    const size_t mask = FLRD_LZ_WINDOW - 1;
+    const size_t max_unflushed = FLRD_LZ_WINDOW / 2;
+    uint16_t *window = flrd->stream_lz_window;
+    size_t n_decoded = 0, n_flushed = 0;
+
+    while (n_decoded < n_pixels) {
+        uint8_t token = byte_reader_read_byte(reader);
+        size_t n_literals = lz_clamp_length(lz_read_length(reader, token >> 4), n_pixels - n_decoded);
+
+        while (n_literals > 0) {
+            size_t index = n_decoded & mask;
+            size_t n = min(min(n_literals, FLRD_LZ_WINDOW - index), max_unflushed);
+
+            if (n_decoded - n_flushed >= max_unflushed) {
+                stream_lz_flush(writer, window, &n_flushed, n_decoded);
+            }
 
-    if (packet != NULL) {
-        packet->type = FLRD_PACKET_BACKLIGHT;
-        packet->backlight.intensity = intensity;
-    }
+            byte_reader_read_bytes(reader, n * sizeof(uint16_t), window + index);
+            n_decoded += n;
+            n_literals -= n;
+        }
 
-    return packet;
-}
+        // The last sequence of a rect has no match.
+        if (n_decoded == n_pixels) {
+            break;
+        }
 
-static struct flrd_packet *read_vibration_packet(struct byte_reader *reader) {
-    struct flrd_packet *packet;
-    uint8_t duration_millis;
+        size_t offset = byte_reader_read_word(reader);
+        size_t n_match = lz_clamp_length(lz_read_length(reader, token & 0x0F) + FLRD_LZ_MIN_MATCH, n_pixels - n_decoded);
+        bool valid = lz_is_valid_offset(offset, n_decoded);
 
-    packet = malloc(sizeof(struct flrd_packet));
-    if (packet == NULL) {
-        // out of memory. just discard the rest of the data.
+        // Matches may overlap themselves, so copy one pixel at a time.
+        for (size_t end = n_decoded + n_match; n_decoded < end; n_decoded++) {
+            if (n_decoded - n_flushed >= max_unflushed) {
+                stream_lz_flush(writer, window, &n_flushed, n_decoded);
+            }
+
+            window[n_decoded & mask] = valid ? window[(n_decoded - offset) & mask] : 0;
+        }
     }
 
-    duration_millis = byte_reader_read_byte(reader);
+    stream_lz_flush(writer, window, &n_flushed, n_decoded);
+}
 
-    if (packet != NULL) {
-        packet->type = FLRD_PACKET_VIBRATION;
-        packet->vibration.duration_millis = duration_millis;
-    }
+static void stream_rect_header(struct display_writer *writer, struct byte_reader *reader, size_t *n_pixels_out) {
+    uint8_t header[4];
 
-    return packet;
+    byte_reader_read_bytes(reader, sizeof(header), header);
 
+    display_writer_set_window(
+        writer,
+        (struct rect) {
+            .left = header[0],
+            .top = header[1],
+            .width = header[2],
+            .height = header[3],
+        }
+    );
+
+    *n_pixels_out = header[2] * header[3];
 }
 
-static struct flrd_packet *read_ping_packet(struct byte_reader *reader) {
+// Decodes a frame straight to flrd->display_driver, as the data arrives.
+// The returned packet only notifies the packet handler that a frame was presented.
+static struct flrd_packet *stream_frame_packet(struct flrd *flrd, struct byte_reader *reader, enum flrd_frame_encoding encoding) {
+    struct display_writer writer;
+    struct flrd_palette palette;
     struct flrd_packet *packet;
+    size_t n_rects, n_pixels;
 
-    packet = malloc(sizeof(struct flrd_packet));
-    if (packet == NULL) {
-        // out of memory. just discard the rest of the data.
+    struct rect screen = {
+        .left = 0,
+        .top = 0,
+        .width = flrd->width,
+        .height = flrd->height,
+    };
+
+    display_writer_init(&writer, flrd, flrd->display_driver, flrd->display_driver_context);
+
+    switch (encoding) {
+        case FLRD_FRAME_ENCODING_KEYFRAME_RAW:
+            display_writer_set_window(&writer, screen);
+            stream_pixels(flrd, &writer, reader, flrd->width * flrd->height);
+            break;
+        case FLRD_FRAME_ENCODING_KEYFRAME_RLE:
+            display_writer_set_window(&writer, screen);
+            stream_rle_runs(flrd, &writer, reader);
+            break;
+        case FLRD_FRAME_ENCODING_DELTAFRAME_RAW:
+            n_rects = byte_reader_read_byte(reader);
+            for (size_t i = 0; i < n_rects; i++) {
+                stream_rect_header(&writer, reader, &n_pixels);
+                stream_pixels(flrd, &writer, reader, n_pixels);
+            }
+            break;
+        case FLRD_FRAME_ENCODING_DELTAFRAME_RLE:
+            n_rects = byte_reader_read_word(reader);
+            for (size_t i = 0; i < n_rects; i++) {
+                stream_rect_header(&writer, reader, &n_pixels);
+                stream_rle_runs(flrd, &writer, reader);
+            }
+            break;
+        case FLRD_FRAME_ENCODING_KEYFRAME_PALETTE:
+            if (!read_palette(reader, flrd->stream_palette, &palette)) {
+                return NULL;
+            }
+            display_writer_set_window(&writer, screen);
+            stream_indexed_pixels(flrd, &writer, reader, &palette, flrd->width * flrd->height);
+            break;
+        case FLRD_FRAME_ENCODING_DELTAFRAME_PALETTE:
+            if (!read_palette(reader, flrd->stream_palette, &palette)) {
+                return NULL;
+            }
+            n_rects = byte_reader_read_word(reader);
+            for (size_t i = 0; i < n_rects; i++) {
+                stream_rect_header(&writer, reader, &n_pixels);
+                stream_indexed_pixels(flrd, &writer, reader, &palette, n_pixels);
+            }
+            break;
+        case FLRD_FRAME_ENCODING_COPY_RECTS:
+            n_rects = byte_reader_read_byte(reader);
+            for (size_t i = 0; i < n_rects; i++) {
+                struct flrd_copy_rect copy;
+
+                byte_reader_read_bytes(reader, sizeof copy, &copy);
+                display_writer_copy_rect(&writer, &copy);
+            }
+            break;
+        case FLRD_FRAME_ENCODING_TILES:
+            n_rects = byte_reader_read_word(reader);
+            for (size_t i = 0; i < n_rects; i++) {
+                struct flrd_tile_op op;
+
+                byte_reader_read_bytes(reader, sizeof op, &op);
+                display_writer_tile_op(&writer, &op);
+            }
+            break;
+        case FLRD_FRAME_ENCODING_DELTAFRAME_LZ:
+            n_rects = byte_reader_read_word(reader);
+            for (size_t i = 0; i < n_rects; i++) {
+                stream_rect_header(&writer, reader, &n_pixels);
+                stream_lz_pixels(flrd, &writer, reader, n_pixels);
+            }
+            break;
+        default:
+            return NULL;
     }
 
-    if (packet != NULL) {
-        packet->type = FLRD_PACKET_PING;
+    display_writer_present(&writer);
+
+    packet = packet_new(flrd, FLRD_PACKET_FRAME);
+    if (packet == NULL) {
+        ESP_LOGE("flrd", "Out of memory while notifying about a streamed frame. The frame was still presented.");
+        return NULL;
     }
 
+    packet->frame.encoding = encoding;
+    packet->frame.presented = true;
     return packet;
 }
 
 static struct flrd_packet *read_frame_packet(struct flrd *flrd, struct byte_reader *reader) {
     enum flrd_frame_encoding encoding = (enum flrd_frame_encoding) byte_reader_read_byte(reader);
 
+    // Frames after a keyframe are drawn on top of it, so if one was
+    // requested, it can be requested again.
+    if (encoding == FLRD_FRAME_ENCODING_KEYFRAME_RAW || encoding == FLRD_FRAME_ENCODING_KEYFRAME_RLE ||
+        encoding == FLRD_FRAME_ENCODING_KEYFRAME_PALETTE) {
+        __atomic_store_n(&flrd->keyframe_requested, false, __ATOMIC_SEQ_CST);
+    }
+
+    if (flrd->display_driver != NULL) {
+        return stream_frame_packet(flrd, reader, encoding);
+    }
+
     switch (encoding) {
         case FLRD_FRAME_ENCODING_KEYFRAME_RAW: 
             return read_raw_keyframe_packet(flrd, reader);
@@ -413,6 +1553,16 @@ static struct flrd_packet *read_frame_packet(struct flrd *flrd, struct byte_read
             return read_raw_deltaframe_packet(flrd, reader);
         case FLRD_FRAME_ENCODING_DELTAFRAME_RLE:
             return read_rle_deltaframe_packet(flrd, reader);
+        case FLRD_FRAME_ENCODING_KEYFRAME_PALETTE:
+            return read_palette_keyframe_packet(flrd, reader);
+        case FLRD_FRAME_ENCODING_DELTAFRAME_PALETTE:
+            return read_palette_deltaframe_packet(flrd, reader);
+        case FLRD_FRAME_ENCODING_COPY_RECTS:
+            return read_copy_rects_packet(flrd, reader);
+        case FLRD_FRAME_ENCODING_TILES:
+            return read_tiles_packet(flrd, reader);
+        case FLRD_FRAME_ENCODING_DELTAFRAME_LZ:
+            return read_lz_deltaframe_packet(flrd, reader);
         default:
             return NULL;
     }
@@ -422,12 +1572,14 @@ static struct flrd_packet *read_packet(struct flrd *flrd, struct byte_reader *re
     enum flrd_packet_type packet_type = byte_reader_read_byte(reader);
 
     switch (packet_type) {
+        case FLRD_PACKET_QUERY_DEVICE_INFO:
+            return read_query_device_info_packet(flrd, reader);
         case FLRD_PACKET_BACKLIGHT:
-            return read_backlight_packet(reader);
+            return read_backlight_packet(flrd, reader);
         case FLRD_PACKET_VIBRATION:
-            return read_vibration_packet(reader);
+            return read_vibration_packet(flrd, reader);
         case FLRD_PACKET_PING:
-            return read_ping_packet(reader);
+            return read_ping_packet(flrd, reader);
         case FLRD_PACKET_FRAME:
             return read_frame_packet(flrd, reader);
         default:
@@ -438,9 +1590,10 @@ static struct flrd_packet *read_packet(struct flrd *flrd, struct byte_reader *re
 static void packet_builder_task(void *args) {
     struct flrd *flrd = args;
     struct byte_reader reader = {
-        .queue = flrd->btspp_buffer_queue,
-        .data = NULL,
-        .offset = 0
+        .flrd = flrd,
+        .bytes = NULL,
+        .n_acquired = 0,
+        .n_bytes = 0,
     };
 
     while (true) {
@@ -468,24 +1621,40 @@ int flrd_add_btspp_bytes(struct flrd *flrd, size_t n_bytes, void *bytes) {
         }
     }
 
-    if (n_bytes == 0) {
-        return 0;
-    }
+    while (n_bytes > 0) {
+        size_t read_offset, write_offset, index, to_copy;
 
-    struct byte_data *data = malloc(sizeof_byte_data(n_bytes));
-    if (data == NULL) {
-        return 1;
-    }
+        write_offset = flrd->btspp_ring_write_offset;
+        read_offset = __atomic_load_n(&flrd->btspp_ring_read_offset, __ATOMIC_SEQ_CST);
 
-    data->timestamp = esp_timer_get_time();
-    data->n_bytes = n_bytes;
-    memcpy(data->bytes, bytes, n_bytes);
+        // If the ring is full, wait for the packet builder task to free up
+        // a reasonable amount of space. space_wanted has to be published
+        // before re-checking the read offset, otherwise we could miss the wakeup.
+        if (write_offset - read_offset == FLRD_BTSPP_RING_SIZE) {
+            size_t space_wanted = min(n_bytes, FLRD_BTSPP_RING_SIZE / 4);
 
-    ok = xQueueSend(flrd->btspp_buffer_queue, &data, portMAX_DELAY);
-    if (ok != pdPASS) {
-        ESP_LOGE("flrd", "Error byte buffer to the packet builder task");
-        free(data);
-        return 1;
+            __atomic_store_n(&flrd->btspp_ring_space_wanted, space_wanted, __ATOMIC_SEQ_CST);
+
+            read_offset = __atomic_load_n(&flrd->btspp_ring_read_offset, __ATOMIC_SEQ_CST);
+            if (FLRD_BTSPP_RING_SIZE - (write_offset - read_offset) < space_wanted) {
+                xSemaphoreTake(flrd->btspp_byte_data_consumed, portMAX_DELAY);
+            }
+
+            __atomic_store_n(&flrd->btspp_ring_space_wanted, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        index = write_offset & (FLRD_BTSPP_RING_SIZE - 1);
+        to_copy = min(n_bytes, FLRD_BTSPP_RING_SIZE - (write_offset - read_offset));
+        to_copy = min(to_copy, FLRD_BTSPP_RING_SIZE - index);
+
+        memcpy(flrd->btspp_ring + index, bytes, to_copy);
+
+        __atomic_store_n(&flrd->btspp_ring_write_offset, write_offset + to_copy, __ATOMIC_RELEASE);
+        xSemaphoreGive(flrd->btspp_byte_data_available);
+
+        bytes = (uint8_t*) bytes + to_copy;
+        n_bytes -= to_copy;
     }
 
     return 0;
@@ -503,26 +1672,41 @@ struct flrd_packet *flrd_wait_for_packet(struct flrd *flrd) {
     return packet;
 }
 
+void flrd_set_display_driver(struct flrd *flrd, const struct flrd_display_driver *driver, void *driver_context) {
+    flrd->display_driver = driver;
+    flrd->display_driver_context = driver_context;
+}
+
+void flrd_set_rle_coalesce_cutoff(struct flrd *flrd, size_t n_pixels) {
+    flrd->rle_coalesce_cutoff = n_pixels;
+}
+
+void flrd_set_shadow_framebuffer(struct flrd *flrd, uint16_t *rgb565_pixels) {
+    flrd->shadow_framebuffer = rgb565_pixels;
+}
+
+void flrd_set_tile_cache(struct flrd *flrd, uint16_t *rgb565_pixels, size_t n_slots) {
+    flrd->tile_cache = rgb565_pixels;
+    flrd->n_tile_slots = rgb565_pixels != NULL ? n_slots : 0;
+}
+
 void flrd_packet_free(struct flrd_packet *packet) {
-    if (packet->type == FLRD_PACKET_FRAME) {
-        if (packet->frame.encoding == FLRD_FRAME_ENCODING_KEYFRAME_RAW) {
-            free(packet->frame.keyframe.raw.rgb565_pixels);
-        } else if (packet->frame.encoding == FLRD_FRAME_ENCODING_KEYFRAME_RLE) {
-            free(packet->frame.keyframe.rle.runs);
-        } else if (packet->frame.encoding == FLRD_FRAME_ENCODING_DELTAFRAME_RAW) {
-            for (size_t i = 0; i < packet->frame.deltaframe.n_rects; i++) {
-                free(packet->frame.deltaframe.rects[i].raw.rgb565_pixels);
-            }
-            free(packet->frame.deltaframe.rects);
-        } else if (packet->frame.encoding == FLRD_FRAME_ENCODING_DELTAFRAME_RLE) {
-            for (size_t i = 0; i < packet->frame.deltaframe.n_rects; i++) {
-                free(packet->frame.deltaframe.rects[i].rle.runs);
-            }
-            free(packet->frame.deltaframe.rects);
-        }
+    struct packet_arena *arena = packet_arena_of(packet);
+    struct packet_arena_chunk *chunk, *next;
+
+    for (chunk = arena->overflow; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+
+#if FLRD_PACKET_SLAB_COUNT > 0
+    if (arena->pooled) {
+        xQueueSend(arena->flrd->packet_slab_pool, &arena, portMAX_DELAY);
+        return;
     }
+#endif
 
-    free(packet);
+    free(arena);
 }
 
 int flrd_send_pong(struct flrd *flrd) {
@@ -536,6 +1720,51 @@ int flrd_send_pong(struct flrd *flrd) {
     return 0;
 }
 
+int flrd_send_device_info(struct flrd *flrd, const struct flrd_device_info_packet *info) {
+    // Slot numbers have to fit next to FLRD_TILE_OP_STORE.
+    size_t n_tile_slots = flrd->shadow_framebuffer != NULL ? min(flrd->n_tile_slots, FLRD_TILE_OP_STORE) : 0;
+    uint8_t flags = 0;
+
+    if (info->supports_vibration) flags |= FLRD_DEVICE_INFO_VIBRATION;
+    if (info->supports_backlight) flags |= FLRD_DEVICE_INFO_BACKLIGHT;
+    if (info->supports_touch) flags |= FLRD_DEVICE_INFO_TOUCH;
+    if (info->supports_accelerometer) flags |= FLRD_DEVICE_INFO_ACCELEROMETER;
+    if (flrd->shadow_framebuffer != NULL) flags |= FLRD_DEVICE_INFO_COPY_RECTS;
+
+    uint8_t data[] = {
+        FLRD_PACKET_DEVICE_INFO,
+        info->width & 0xFF,
+        (info->width >> 8) & 0xFF,
+        info->height & 0xFF,
+        (info->height >> 8) & 0xFF,
+        info->width_mm & 0xFF,
+        (info->width_mm >> 8) & 0xFF,
+        info->height_mm & 0xFF,
+        (info->height_mm >> 8) & 0xFF,
+        flags,
+        n_tile_slots & 0xFF,
+        (n_tile_slots >> 8) & 0xFF,
+    };
+
+    flrd->btspp_driver.send_bytes(flrd->btspp_driver_context, sizeof(data), data);
+    return 0;
+}
+
+int flrd_request_keyframe(struct flrd *flrd) {
+    if (__atomic_exchange_n(&flrd->keyframe_requested, true, __ATOMIC_SEQ_CST)) {
+        return 0;
+    }
+
+    flrd->btspp_driver.send_bytes(
+        flrd->btspp_driver_context,
+        1,
+        (uint8_t[]) {
+            FLRD_PACKET_KEYFRAME_REQUEST,
+        }
+    );
+    return 0;
+}
+
 int flrd_send_touch_event(struct flrd *flrd, struct flrd_touch_event_packet *event) {
     // struct flrd_touch_event_packet {
     //     uint8_t pointer;
@@ -560,36 +1789,19 @@ int flrd_send_touch_event(struct flrd *flrd, struct flrd_touch_event_packet *eve
     return 0;
 }
 
-void flrd_frame_destroy(struct flrd_frame *frame) {
-    switch (frame->encoding) {
-        case FLRD_FRAME_ENCODING_KEYFRAME_RAW:
-            free(frame->keyframe.raw.rgb565_pixels);
-            break;
-        case FLRD_FRAME_ENCODING_KEYFRAME_RLE:
-            free(frame->keyframe.rle.runs);
-            break;
-        case FLRD_FRAME_ENCODING_DELTAFRAME_RAW:
-            for (size_t i = 0; i < frame->deltaframe.n_rects; i++) {
-                free(frame->deltaframe.rects[i].raw.rgb565_pixels);
-            }
-            free(frame->deltaframe.rects);
-            break;
-        case FLRD_FRAME_ENCODING_DELTAFRAME_RLE:
-            for (size_t i = 0; i < frame->deltaframe.n_rects; i++) {
-                free(frame->deltaframe.rects[i].rle.runs);
-            }
-            free(frame->deltaframe.rects);
-            break;
+int flrd_frame_present(struct flrd *flrd, struct flrd_frame *frame, const struct flrd_display_driver *driver, void *driver_context) {
+    struct display_writer writer;
+
+    if (frame->presented) {
+        return 0;
     }
 
-    free(frame);
-}
+    display_writer_init(&writer, flrd, driver, driver_context);
 
-int flrd_frame_present(struct flrd *flrd, struct flrd_frame *frame, const struct flrd_display_driver *driver, void *driver_context) {
     switch (frame->encoding) {
         case FLRD_FRAME_ENCODING_KEYFRAME_RAW:
-            driver->set_window(
-                driver_context,
+            display_writer_set_window(
+                &writer,
                 (struct rect) {
                     .left = 0,
                     .top = 0,
@@ -597,17 +1809,17 @@ int flrd_frame_present(struct flrd *flrd, struct flrd_frame *frame, const struct
                     .height = flrd->height,
                 }
             );
-            driver->write_pixels(
-                driver_context,
+            display_writer_write_pixels(
+                &writer,
                 flrd->width * flrd->height,
                 frame->keyframe.raw.rgb565_pixels
             );
-            driver->present(driver_context);
+            display_writer_present(&writer);
             break;
 
         case FLRD_FRAME_ENCODING_KEYFRAME_RLE:
-            driver->set_window(
-                driver_context,
+            display_writer_set_window(
+                &writer,
                 (struct rect) {
                     .left = 0,
                     .top = 0,
@@ -616,19 +1828,19 @@ int flrd_frame_present(struct flrd *flrd, struct flrd_frame *frame, const struct
                 }
             );
             for (int i = 0; i < frame->keyframe.rle.n_runs; i++) {
-                driver->write_pixel_run(
-                    driver_context,
+                display_writer_write_pixel_run(
+                    &writer,
                     frame->keyframe.rle.runs[i].n_pixels,
                     frame->keyframe.rle.runs[i].rgb565
                 );
             }
-            driver->present(driver_context);
+            display_writer_present(&writer);
             break;
 
         case FLRD_FRAME_ENCODING_DELTAFRAME_RAW:
             for (int i = 0; i < frame->deltaframe.n_rects; i++) {
-                driver->set_window(
-                    driver_context,
+                display_writer_set_window(
+                    &writer,
                     (struct rect) {
                         .left = frame->deltaframe.rects[i].x,
                         .top = frame->deltaframe.rects[i].y,
@@ -636,19 +1848,19 @@ int flrd_frame_present(struct flrd *flrd, struct flrd_frame *frame, const struct
                         .height = frame->deltaframe.rects[i].height,
                     }
                 );
-                driver->write_pixels(
-                    driver_context,
+                display_writer_write_pixels(
+                    &writer,
                     frame->deltaframe.rects[i].width * frame->deltaframe.rects[i].height,
                     frame->deltaframe.rects[i].raw.rgb565_pixels
                 );
             }
-            driver->present(driver_context);
+            display_writer_present(&writer);
             break;
 
         case FLRD_FRAME_ENCODING_DELTAFRAME_RLE:
             for (int i = 0; i < frame->deltaframe.n_rects; i++) {
-                driver->set_window(
-                    driver_context,
+                display_writer_set_window(
+                    &writer,
                     (struct rect) {
                         .left = frame->deltaframe.rects[i].x,
                         .top = frame->deltaframe.rects[i].y,
@@ -657,14 +1869,73 @@ int flrd_frame_present(struct flrd *flrd, struct flrd_frame *frame, const struct
                     }
                 );
                 for (int j = 0; j < frame->deltaframe.rects[i].rle.n_runs; j++) {
-                    driver->write_pixel_run(
-                        driver_context,
+                    display_writer_write_pixel_run(
+                        &writer,
                         frame->deltaframe.rects[i].rle.runs[j].n_pixels,
                         frame->deltaframe.rects[i].rle.runs[j].rgb565
                     );
                 }
             }
-            driver->present(driver_context);
+            display_writer_present(&writer);
+            break;
+
+        case FLRD_FRAME_ENCODING_KEYFRAME_PALETTE:
+            display_writer_set_window(
+                &writer,
+                (struct rect) {
+                    .left = 0,
+                    .top = 0,
+                    .width = flrd->width,
+                    .height = flrd->height,
+                }
+            );
+            display_writer_write_indexed_pixels(
+                &writer,
+                &frame->palette,
+                flrd->width * flrd->height,
+                &frame->keyframe.indexed
+            );
+            display_writer_present(&writer);
+            break;
+
+        case FLRD_FRAME_ENCODING_DELTAFRAME_PALETTE:
+            for (int i = 0; i < frame->deltaframe.n_rects; i++) {
+                display_writer_set_window(
+                    &writer,
+                    (struct rect) {
+                        .left = frame->deltaframe.rects[i].x,
+                        .top = frame->deltaframe.rects[i].y,
+                        .width = frame->deltaframe.rects[i].width,
+                        .height = frame->deltaframe.rects[i].height,
+                    }
+                );
+                display_writer_write_indexed_pixels(
+                    &writer,
+                    &frame->palette,
+                    frame->deltaframe.rects[i].width * frame->deltaframe.rects[i].height,
+                    &frame->deltaframe.rects[i].indexed
+                );
+            }
+            display_writer_present(&writer);
+            break;
+
+        case FLRD_FRAME_ENCODING_COPY_RECTS:
+            for (int i = 0; i < frame->copy_rects.n_copies; i++) {
+                display_writer_copy_rect(&writer, &frame->copy_rects.copies[i]);
+            }
+            display_writer_present(&writer);
+            break;
+
+        case FLRD_FRAME_ENCODING_TILES:
+            for (int i = 0; i < frame->tiles.n_ops; i++) {
+                display_writer_tile_op(&writer, &frame->tiles.ops[i]);
+            }
+            display_writer_present(&writer);
+            break;
+
+        case FLRD_FRAME_ENCODING_DELTAFRAME_LZ:
+            // Never buffered, read_lz_deltaframe_packet decodes into a raw
+            // deltaframe.
             break;
     }
 
@@ -18,14 +18,111 @@ struct rect {
     int left, top, width, height;
 };
 
+// Size of the ring buffer bluetooth SPP data is received into.
+// Must be a power of two.
+#ifndef FLRD_BTSPP_RING_SIZE
+#define FLRD_BTSPP_RING_SIZE 16384
+#endif
+
+// Size of the scratch buffer used when streaming frames to the display
+// driver. Should be a multiple of 2 (bytes per pixel) and 3 (bytes per RLE run).
+#ifndef FLRD_STREAM_SCRATCH_SIZE
+#define FLRD_STREAM_SCRATCH_SIZE 1536
+#endif
+
+// Decoded packets are allocated from a pool of FLRD_PACKET_SLAB_COUNT slabs
+// of FLRD_PACKET_SLAB_SIZE bytes each, which are malloced on first use.
+// With a count of 0, every packet (and every part of it) is malloced separately.
+#ifndef FLRD_PACKET_SLAB_COUNT
+#define FLRD_PACKET_SLAB_COUNT 4
+#endif
+
+#ifndef FLRD_PACKET_SLAB_SIZE
+#define FLRD_PACKET_SLAB_SIZE 16384
+#endif
+
+// Size of each of the two line buffers used for drivers that support
+// asynchronous (DMA) writes and for coalescing short RLE runs.
+// See struct flrd_display_driver.
+#ifndef FLRD_LINE_BUFFER_PIXELS
+#define FLRD_LINE_BUFFER_PIXELS 480
+#endif
+
+// RLE runs shorter than this are expanded into a line buffer and written
+// using write_pixels instead of write_pixel_run. Tuned using flrd_bench -C.
+// See flrd_set_rle_coalesce_cutoff.
+#ifndef FLRD_RLE_COALESCE_CUTOFF
+#define FLRD_RLE_COALESCE_CUTOFF 32
+#endif
+
+// Width and height of the tiles in the tile cache, see flrd_set_tile_cache.
+// Must match the host.
+#ifndef FLRD_TILE_SIZE
+#define FLRD_TILE_SIZE 16
+#endif
+
+// LZ encoded rects are sequences of literal pixels and matches that copy
+// earlier pixels of the same rect, at most FLRD_LZ_WINDOW pixels (4KB)
+// back. Part of the wire format, so these must match the host.
+#define FLRD_LZ_WINDOW 2048
+#define FLRD_LZ_MIN_MATCH 2
+
+struct flrd_display_driver;
+
+// One RLE run, laid out exactly like on the wire (little endian), so whole
+// arrays of runs can be copied straight out of the received data.
+struct __attribute__((packed)) flrd_rle_run {
+    uint8_t n_pixels;
+    uint16_t rgb565;
+};
+
+// Copies a rect of the previous frame to another position, laid out like
+// on the wire. Source and destination may overlap.
+struct __attribute__((packed)) flrd_copy_rect {
+    uint8_t src_x, src_y, width, height;
+    uint8_t dst_x, dst_y;
+};
+
+// Set in flrd_tile_op::slot for ops that store a tile in the cache,
+// instead of drawing it.
+#define FLRD_TILE_OP_STORE 0x8000
+
+// Stores the FLRD_TILE_SIZE tile of the display at (x, y) in a tile cache
+// slot, or draws a cached tile at (x, y). Laid out like on the wire.
+struct __attribute__((packed)) flrd_tile_op {
+    uint8_t x, y;
+    uint16_t slot;
+};
+
+// One RLE run of palette indices, laid out like on the wire.
+struct __attribute__((packed)) flrd_palette_run {
+    uint8_t n_pixels;
+    uint8_t index;
+};
+
 struct flrd {
     StaticQueue_t packet_handler_queue_buffer;
     uint8_t packet_handler_queue_storage[sizeof(void*) * 32];
     QueueHandle_t packet_handler_queue;
 
-    StaticQueue_t btspp_buffer_queue_buffer;
-    uint8_t btspp_buffer_queue_storage[sizeof(void*) * 32];
-    QueueHandle_t btspp_buffer_queue;
+#if FLRD_PACKET_SLAB_COUNT > 0
+    StaticQueue_t packet_slab_pool_buffer;
+    uint8_t packet_slab_pool_storage[sizeof(void*) * FLRD_PACKET_SLAB_COUNT];
+    QueueHandle_t packet_slab_pool;
+#endif
+
+    // Single-producer, single-consumer byte ring. The bluetooth SPP callback
+    // (flrd_add_btspp_bytes) writes into it, the packet builder task parses
+    // packets straight out of it.
+    //
+    // The offsets are free-running and only ever written by one side:
+    // write_offset by the producer, read_offset by the consumer.
+    uint8_t btspp_ring[FLRD_BTSPP_RING_SIZE];
+    size_t btspp_ring_write_offset;
+    size_t btspp_ring_read_offset;
+
+    // Free space the producer is waiting for when the ring is full, 0 otherwise.
+    size_t btspp_ring_space_wanted;
 
     int width, height;
 
@@ -34,8 +131,51 @@ struct flrd {
     StaticSemaphore_t btspp_byte_data_consumed_buffer;
     SemaphoreHandle_t btspp_byte_data_consumed;
 
+    StaticSemaphore_t btspp_byte_data_available_buffer;
+    SemaphoreHandle_t btspp_byte_data_available;
+
     struct flrd_btspp_interface btspp_driver;
     void *btspp_driver_context;
+
+    // If set, frames are decoded straight to this display driver by the
+    // packet builder task. See flrd_set_display_driver.
+    const struct flrd_display_driver *display_driver;
+    void *display_driver_context;
+
+    // See flrd_set_rle_coalesce_cutoff.
+    size_t rle_coalesce_cutoff;
+
+    // Optional copy of the display contents, see flrd_set_shadow_framebuffer.
+    uint16_t *shadow_framebuffer;
+
+    // Optional tile cache, see flrd_set_tile_cache.
+    uint16_t *tile_cache;
+    size_t n_tile_slots;
+
+    // Whether the host was asked to resend a keyframe since the last one
+    // arrived, see flrd_request_keyframe.
+    bool keyframe_requested;
+
+    union {
+        uint16_t rgb565_pixels[FLRD_STREAM_SCRATCH_SIZE / sizeof(uint16_t)];
+        struct flrd_rle_run rle_runs[FLRD_STREAM_SCRATCH_SIZE / sizeof(struct flrd_rle_run)];
+        struct flrd_palette_run palette_runs[FLRD_STREAM_SCRATCH_SIZE / sizeof(struct flrd_palette_run)];
+        uint8_t bytes[FLRD_STREAM_SCRATCH_SIZE];
+    } stream_scratch;
+
+    // Palette of the palette encoded frame that is currently being streamed.
+    // Always 256 colors, so out of range indices can't read past it.
+    uint16_t stream_palette[256];
+
+    // The last FLRD_LZ_WINDOW pixels of the LZ encoded rect that is
+    // currently being streamed.
+    uint16_t stream_lz_window[FLRD_LZ_WINDOW];
+
+    // Ping-pong buffers for asynchronous display writes. One is filled while
+    // the other one is being transferred. These need to be DMA capable, so
+    // struct flrd should live in internal RAM. For synchronous drivers, the
+    // first one is used to coalesce short RLE runs.
+    uint16_t line_buffers[2][FLRD_LINE_BUFFER_PIXELS];
 };
 
 enum flrd_frame_encoding {
@@ -43,6 +183,11 @@ enum flrd_frame_encoding {
     FLRD_FRAME_ENCODING_KEYFRAME_RLE = 1,
     FLRD_FRAME_ENCODING_DELTAFRAME_RAW = 2,
     FLRD_FRAME_ENCODING_DELTAFRAME_RLE = 3,
+    FLRD_FRAME_ENCODING_KEYFRAME_PALETTE = 4,
+    FLRD_FRAME_ENCODING_DELTAFRAME_PALETTE = 5,
+    FLRD_FRAME_ENCODING_COPY_RECTS = 6,
+    FLRD_FRAME_ENCODING_TILES = 7,
+    FLRD_FRAME_ENCODING_DELTAFRAME_LZ = 8,
 };
 
 static inline const char *flrd_frame_encoding_to_string(enum flrd_frame_encoding encoding) {
@@ -55,21 +200,49 @@ static inline const char *flrd_frame_encoding_to_string(enum flrd_frame_encoding
             return "FLRD_FRAME_ENCODING_DELTAFRAME_RAW";
         case FLRD_FRAME_ENCODING_DELTAFRAME_RLE:
             return "FLRD_FRAME_ENCODING_DELTAFRAME_RLE";
+        case FLRD_FRAME_ENCODING_KEYFRAME_PALETTE:
+            return "FLRD_FRAME_ENCODING_KEYFRAME_PALETTE";
+        case FLRD_FRAME_ENCODING_DELTAFRAME_PALETTE:
+            return "FLRD_FRAME_ENCODING_DELTAFRAME_PALETTE";
+        case FLRD_FRAME_ENCODING_COPY_RECTS:
+            return "FLRD_FRAME_ENCODING_COPY_RECTS";
+        case FLRD_FRAME_ENCODING_TILES:
+            return "FLRD_FRAME_ENCODING_TILES";
+        case FLRD_FRAME_ENCODING_DELTAFRAME_LZ:
+            return "FLRD_FRAME_ENCODING_DELTAFRAME_LZ";
         default:
             return "?";
     }
 } 
 
-struct flrd_rle_run {
-    size_t n_pixels;
-    uint16_t rgb565;
-};
-
 struct flrd_rle_runs {
     size_t n_runs;
     struct flrd_rle_run *runs;
 };
 
+struct flrd_palette_runs {
+    size_t n_runs;
+    struct flrd_palette_run *runs;
+};
+
+// The colors of a palette encoded frame, shared by all of its rects.
+struct flrd_palette {
+    // Always 256 colors, the ones past n_colors are black.
+    size_t n_colors;
+    uint16_t *rgb565_colors;
+
+    // If set, the indices are RLE encoded. Otherwise, they're packed with
+    // bits_per_index (1, 2, 4 or 8) bits each, starting at the lowest bits
+    // of the first byte.
+    bool rle;
+    uint8_t bits_per_index;
+};
+
+union flrd_indexed_pixels {
+    uint8_t *packed_indices;
+    struct flrd_palette_runs rle;
+};
+
 struct flrd_frame_damaged_rect {
     uint8_t x, y, width, height;
     union {
@@ -77,22 +250,40 @@ struct flrd_frame_damaged_rect {
             uint16_t *rgb565_pixels;
         } raw;
         struct flrd_rle_runs rle;
+        union flrd_indexed_pixels indexed;
     };
 };
 
 struct flrd_frame {
     enum flrd_frame_encoding encoding;
+
+    // True if the frame was already streamed to the display driver by the
+    // packet builder task. It carries no pixel data then.
+    bool presented;
+
+    // Only used by the palette encodings.
+    struct flrd_palette palette;
+
     union {
         struct {
             struct {
                 uint16_t *rgb565_pixels;
             } raw;
             struct flrd_rle_runs rle;
+            union flrd_indexed_pixels indexed;
         } keyframe;
         struct {
             size_t n_rects;
             struct flrd_frame_damaged_rect *rects;
         } deltaframe;
+        struct {
+            size_t n_copies;
+            struct flrd_copy_rect *copies;
+        } copy_rects;
+        struct {
+            size_t n_ops;
+            struct flrd_tile_op *ops;
+        } tiles;
     };
 };
 
@@ -106,7 +297,8 @@ enum flrd_packet_type {
     FLRD_PACKET_VIBRATION,
     FLRD_PACKET_PING,
     FLRD_PACKET_PONG,
-    FLRD_PACKET_FRAME
+    FLRD_PACKET_FRAME,
+    FLRD_PACKET_KEYFRAME_REQUEST
 };
 
 static inline const char *flrd_packet_type_to_string(enum flrd_packet_type type) {
@@ -131,6 +323,8 @@ static inline const char *flrd_packet_type_to_string(enum flrd_packet_type type)
             return "FLRD_PACKET_PONG";
         case FLRD_PACKET_FRAME:
             return "FLRD_PACKET_FRAME";
+        case FLRD_PACKET_KEYFRAME_REQUEST:
+            return "FLRD_PACKET_KEYFRAME_REQUEST";
         default:
             return "?";
     }
@@ -158,6 +352,15 @@ struct flrd_device_info_packet {
     bool supports_accelerometer;
 };
 
+// Bits of the flags byte of a FLRD_PACKET_DEVICE_INFO packet.
+enum flrd_device_info_flags {
+    FLRD_DEVICE_INFO_VIBRATION = 1 << 0,
+    FLRD_DEVICE_INFO_BACKLIGHT = 1 << 1,
+    FLRD_DEVICE_INFO_TOUCH = 1 << 2,
+    FLRD_DEVICE_INFO_ACCELEROMETER = 1 << 3,
+    FLRD_DEVICE_INFO_COPY_RECTS = 1 << 4,
+};
+
 enum flrd_acceleration_event_kind {
     FLRD_ACCELERATION_EVENT_KIND_STEP,
     FLRD_ACCELERATION_EVENT_KIND_WAKE
@@ -204,6 +407,19 @@ void flrd_packet_free(struct flrd_packet *packet);
 
 int flrd_send_pong(struct flrd *flrd);
 
+/// Answers a FLRD_PACKET_QUERY_DEVICE_INFO packet.
+///
+/// Whether copy rect frames are supported and the number of tile cache slots
+/// are not taken from info, but from flrd_set_shadow_framebuffer and
+/// flrd_set_tile_cache, so the host never sends frames flrd can't apply.
+int flrd_send_device_info(struct flrd *flrd, const struct flrd_device_info_packet *info);
+
+/// Asks the host to resend a keyframe, because what the display shows is no
+/// longer what the host thinks it shows (e.g. an op of a frame was dropped).
+///
+/// Only sent once until the next keyframe arrives.
+int flrd_request_keyframe(struct flrd *flrd);
+
 int flrd_send_touch_event(struct flrd *flrd, struct flrd_touch_event_packet *event);
 
 struct flrd_display_driver {
@@ -211,8 +427,65 @@ struct flrd_display_driver {
     void (*write_pixels)(void *context, size_t n_pixels, uint16_t *rgb565_pixels);
     void (*write_pixel_run)(void *context, size_t n_pixels, uint16_t rgb565);
     void (*present)(void *context);
+
+    // Optional. Starts writing pixels to the current window and returns
+    // without waiting for the transfer to finish, e.g. using DMA.
+    // The pixels are owned by flrd and won't be touched until wait_async
+    // returned. flrd never starts a new transfer, calls set_window or present
+    // while a transfer is pending.
+    //
+    // If both are set, flrd expands RLE runs into line buffers and only uses
+    // write_pixels_async to write pixels; write_pixels and write_pixel_run
+    // are not used.
+    void (*write_pixels_async)(void *context, size_t n_pixels, uint16_t *rgb565_pixels);
+
+    // Waits until the pending write_pixels_async transfer is finished.
+    void (*wait_async)(void *context);
 };
 
+/// Makes the packet builder task decode frames straight to the given display
+/// driver as their bytes arrive, using a small fixed scratch buffer, instead
+/// of building a complete struct flrd_frame first.
+///
+/// Frame packets are still delivered by flrd_wait_for_packet after they were
+/// presented, but carry no pixel data (see struct flrd_frame::presented).
+///
+/// The driver is called from the packet builder task. Must be called before
+/// the first call to flrd_add_btspp_bytes.
+void flrd_set_display_driver(struct flrd *flrd, const struct flrd_display_driver *driver, void *driver_context);
+
+/// Sets the length below which RLE runs are expanded into a line buffer
+/// and written using the display drivers write_pixels instead of
+/// write_pixel_run. 0 disables coalescing.
+///
+/// Only used for display drivers without write_pixels_async; for those,
+/// all runs are expanded. Defaults to FLRD_RLE_COALESCE_CUTOFF.
+void flrd_set_rle_coalesce_cutoff(struct flrd *flrd, size_t n_pixels);
+
+/// Makes flrd keep a copy of everything it writes to the display in
+/// rgb565_pixels, which must have space for width * height pixels (e.g. in
+/// PSRAM). NULL disables it.
+///
+/// Required for FLRD_FRAME_ENCODING_COPY_RECTS frames (scrolling), which
+/// copy pixels of the previous frame around. The host only sends those if
+/// the device info says so (see flrd_send_device_info); copies that can't be
+/// applied anyway are dropped, and a keyframe is requested instead, since the
+/// host's following deltaframes assume the copies were applied.
+/// Must be called before the first call to flrd_add_btspp_bytes.
+void flrd_set_shadow_framebuffer(struct flrd *flrd, uint16_t *rgb565_pixels);
+
+/// Gives flrd a cache of n_slots tiles of FLRD_TILE_SIZE x FLRD_TILE_SIZE
+/// pixels each (e.g. in PSRAM), so the host can draw repeated content like
+/// digits and icons by sending the slot instead of the pixels.
+///
+/// Tiles are stored from the shadow framebuffer, so this also needs
+/// flrd_set_shadow_framebuffer. Which tile is in which slot is up to the
+/// host, which uses at most the number of slots in the device info (see
+/// flrd_send_device_info). Like copy rects, tile ops that can't be applied
+/// are dropped, and a keyframe is requested instead.
+/// Must be called before the first call to flrd_add_btspp_bytes.
+void flrd_set_tile_cache(struct flrd *flrd, uint16_t *rgb565_pixels, size_t n_slots);
+
 int flrd_frame_present(struct flrd *flrd, struct flrd_frame *frame, const struct flrd_display_driver *driver, void *driver_context);
 
 #ifdef __cplusplus
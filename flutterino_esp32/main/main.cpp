@@ -11,14 +11,17 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_heap_caps.h"
 #include "esp_bt.h"
 #include "esp_bt_main.h"
 #include "esp_gap_bt_api.h"
 #include "esp_bt_device.h"
 #include "esp_spp_api.h"
 #include "driver/i2c.h"
+#include "driver/gpio.h"
 #include "esp32-hal-periman.h"
 #include "flutter_remote_display.h"
+#include "touch_input.h"
 
 #include <Arduino.h>
 #include <axp20x.h>
@@ -38,6 +41,17 @@ static long data_num = 0;
 static const esp_spp_sec_t sec_mask = ESP_SPP_SEC_AUTHENTICATE;
 static const esp_spp_role_t role_slave = ESP_SPP_ROLE_SLAVE;
 
+// Number of tiles in the tile cache, see flrd_set_tile_cache.
+static const size_t TILE_CACHE_SLOTS = 256;
+
+// Physical size of the 1.54" display, for the device info.
+static const int TFT_WIDTH_MM = 28;
+static const int TFT_HEIGHT_MM = 28;
+
+// What the watch has, sent to the host when it asks. Filled in by app_main
+// before the packet handler task starts.
+static struct flrd_device_info_packet device_info;
+
 static char *bda2str(uint8_t * bda, char *str, size_t size)
 {
     if (bda == NULL || str == NULL || size < 18) {
@@ -253,6 +267,25 @@ static void display_write_pixel_run(void *context, size_t n_pixels, uint16_t rgb
     tft->pushBlock(rgb565, n_pixels);
 }
 
+// The pixels live in flrd.line_buffers, which (since flrd is a global) are in
+// internal, DMA-capable RAM. flrd won't touch them until display_wait_async.
+static void display_write_pixels_async(void *context, size_t n_pixels, uint16_t *rgb565_pixels) {
+    TFT_eSPI *tft = (TFT_eSPI*) context;
+
+    if (!in_transaction) {
+        tft->startWrite();
+        in_transaction = true;
+    }
+
+    tft->pushPixelsDMA(rgb565_pixels, n_pixels);
+}
+
+static void display_wait_async(void *context) {
+    TFT_eSPI *tft = (TFT_eSPI*) context;
+
+    tft->dmaWait();
+}
+
 static void display_present(void *context) {
     TFT_eSPI *tft = (TFT_eSPI*) context;
     
@@ -266,12 +299,15 @@ const static struct flrd_display_driver display_driver = {
     .set_window = display_set_window,
     .write_pixels = display_write_pixels,
     .write_pixel_run = display_write_pixel_run,
-    .present = display_present
+    .present = display_present,
+    .write_pixels_async = display_write_pixels_async,
+    .wait_async = display_wait_async
 };
 
 
 // This task is responsible for committing frames produced by the bluetooth
-// SPP task to the TFT display.
+// SPP task to the TFT display. (When frames are streamed to the display by
+// flrd itself, it only counts them.)
 static void packet_handler_task(void *arg) {
     struct flrd *flrd = (struct flrd*) arg;
     
@@ -297,6 +333,10 @@ static void packet_handler_task(void *arg) {
                 ESP_LOGI(spp_log_tag, "received ping packet");
                 flrd_send_pong(flrd);
                 break;
+            case FLRD_PACKET_QUERY_DEVICE_INFO:
+                ESP_LOGI(spp_log_tag, "received device info query");
+                flrd_send_device_info(flrd, &device_info);
+                break;
             case FLRD_PACKET_FRAME: {
                 if (n_frames == 60) {
                     struct timeval now;
@@ -581,54 +621,75 @@ static bool axp_set_channel(uint8_t channel, bool enabled) {
     return true;
 }
 
-struct touch_task_arg {
-    struct flrd *flrd;
-    FocalTech_Class *touchscreen;
+// On the T-Watch, the touch controller pulls this low when it has a new report.
+static const gpio_num_t TOUCH_INT_GPIO = GPIO_NUM_38;
+
+// Only used if the INT line can't be set up.
+static const TickType_t TOUCH_POLL_INTERVAL = pdMS_TO_TICKS(16);
+
+static struct touch_input touch_input;
+
+static bool on_touch_read_point(void *context, uint16_t *x, uint16_t *y) {
+    FocalTech_Class *touchscreen = (FocalTech_Class*) context;
+
+    return touchscreen->getPoint(*x, *y);
+}
+
+static void on_touch_event(void *context, struct flrd_touch_event_packet *event) {
+    ESP_LOGI(spp_log_tag, "touch %s, x=%d y=%d",
+        event->phase == FLRD_TOUCH_EVENT_PHASE_DOWN ? "down" :
+        event->phase == FLRD_TOUCH_EVENT_PHASE_MOVE ? "move" : "up",
+        event->x, event->y
+    );
+
+    // The touch panel is rotated by 180 degrees relative to the TFT.
+    event->x = TFT_WIDTH - event->x;
+    event->y = TFT_HEIGHT - event->y;
+    flrd_send_touch_event(&flrd, event);
+}
+
+const static struct touch_input_driver touch_driver = {
+    .read_point = on_touch_read_point,
+    .on_touch_event = on_touch_event,
 };
 
-static void touch_task(void *arg_void) {
-    struct touch_task_arg *arg = (struct touch_task_arg*) arg_void;
+static void on_touch_int(void *arg) {
+    touch_input_notify_from_isr((struct touch_input*) arg);
+}
+
+static bool touch_int_init(struct touch_input *input) {
+    esp_err_t esp_ok;
 
-    uint16_t last_x, last_y;
-    bool last_pressed = false;
+    // GPIO38 is input only and has no internal pull-up, the board has an
+    // external one.
+    gpio_config_t conf = {
+        .pin_bit_mask = 1ULL << TOUCH_INT_GPIO,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_DISABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_NEGEDGE,
+    };
 
-    while (true) {
-        // delay for 5ms
-        vTaskDelay(16 / portTICK_PERIOD_MS);
-        
-        struct flrd_touch_event_packet touch_event;
-        uint16_t x, y;
-        bool pressed;
-        
-        pressed = arg->touchscreen->getPoint(x, y);
-
-        if (pressed && (!last_pressed || x != last_x || y != last_y)) {
-            ESP_LOGI(spp_log_tag, "touch %s, x=%d y=%d", last_pressed ? "move" : "down", x, y);
-
-            touch_event.pointer = 0;
-            touch_event.timestamp = 0;
-            touch_event.phase = last_pressed ? FLRD_TOUCH_EVENT_PHASE_MOVE : FLRD_TOUCH_EVENT_PHASE_DOWN;
-            touch_event.x = TFT_WIDTH - x;
-            touch_event.y = TFT_HEIGHT - y;
-            flrd_send_touch_event(arg->flrd, &touch_event);
-
-        } else if (last_pressed && !pressed) {
-            ESP_LOGI(spp_log_tag, "touch up");
-
-            touch_event.pointer = 0;
-            touch_event.timestamp = 0;
-            touch_event.phase = FLRD_TOUCH_EVENT_PHASE_UP;
-            touch_event.x = x;
-            touch_event.y = y;
-            flrd_send_touch_event(arg->flrd, &touch_event);
-        }
+    esp_ok = gpio_config(&conf);
+    if (esp_ok != ESP_OK) {
+        ESP_LOGE(spp_log_tag, "gpio_config failed: %s", esp_err_to_name(esp_ok));
+        return false;
+    }
 
-        last_x = x;
-        last_y = y;
-        last_pressed = pressed;
+    // Arduino might have installed the ISR service already.
+    esp_ok = gpio_install_isr_service(0);
+    if (esp_ok != ESP_OK && esp_ok != ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(spp_log_tag, "gpio_install_isr_service failed: %s", esp_err_to_name(esp_ok));
+        return false;
     }
 
-    free(arg);
+    esp_ok = gpio_isr_handler_add(TOUCH_INT_GPIO, on_touch_int, input);
+    if (esp_ok != ESP_OK) {
+        ESP_LOGE(spp_log_tag, "gpio_isr_handler_add failed: %s", esp_err_to_name(esp_ok));
+        return false;
+    }
+
+    return true;
 }
 
 extern "C" void app_main(void) {
@@ -742,14 +803,60 @@ extern "C" void app_main(void) {
 
     flrd_init(&flrd, TFT_WIDTH, TFT_HEIGHT, &btspp_driver, &flrd_btspp_connection);
 
+    // Decode frames straight to the TFT as they arrive, instead of buffering
+    // (up to 115KB for a raw keyframe) and presenting them in the packet handler task.
+    flrd_set_display_driver(&flrd, &display_driver, &tft);
+
+    // Keep a copy of the screen in PSRAM, so the host can scroll by copying
+    // rects around instead of resending them. It starts out white, like the screen.
+    uint16_t *shadow_framebuffer = (uint16_t*) heap_caps_malloc(TFT_WIDTH * TFT_HEIGHT * sizeof(uint16_t), MALLOC_CAP_SPIRAM);
+    if (shadow_framebuffer != NULL) {
+        for (int i = 0; i < TFT_WIDTH * TFT_HEIGHT; i++) {
+            shadow_framebuffer[i] = 0xFFFF;
+        }
+
+        flrd_set_shadow_framebuffer(&flrd, shadow_framebuffer);
+    } else {
+        ESP_LOGE(spp_log_tag, "Could not allocate shadow framebuffer. Copy rect frames are not supported.");
+    }
+
+    // 256 tiles of 16x16 pixels take 128KB of PSRAM. The host is told the
+    // number of slots in the device info.
+    uint16_t *tile_cache = NULL;
+    if (shadow_framebuffer != NULL) {
+        tile_cache = (uint16_t*) heap_caps_malloc(TILE_CACHE_SLOTS * FLRD_TILE_SIZE * FLRD_TILE_SIZE * sizeof(uint16_t), MALLOC_CAP_SPIRAM);
+    }
+
+    if (tile_cache != NULL) {
+        flrd_set_tile_cache(&flrd, tile_cache, TILE_CACHE_SLOTS);
+    } else {
+        ESP_LOGE(spp_log_tag, "Could not allocate tile cache. Tile frames are not supported.");
+    }
+
+    device_info.width = TFT_WIDTH;
+    device_info.height = TFT_HEIGHT;
+    device_info.width_mm = TFT_WIDTH_MM;
+    device_info.height_mm = TFT_HEIGHT_MM;
+    device_info.supports_vibration = false;
+    device_info.supports_backlight = true;
+    device_info.supports_touch = hasTouch;
+    device_info.supports_accelerometer = false;
+
     xTaskCreate(packet_handler_task, "packet_handler", 4096, &flrd, 5, NULL);
 
     if (hasTouch) {
-        struct touch_task_arg *arg = (struct touch_task_arg*) malloc(sizeof(struct touch_task_arg));
+        // Only read the touchscreen when the controller has a new report,
+        // instead of polling it over I2C while nobody touches it.
+        touch_input_init(&touch_input, &touch_driver, &touchscreen, 0);
+
+        // Pulse INT for every report, instead of holding it low while touched.
+        touchscreen.enableINT();
 
-        arg->flrd = &flrd;
-        arg->touchscreen = &touchscreen;
+        if (!touch_int_init(&touch_input)) {
+            ESP_LOGE(spp_log_tag, "Could not set up the touch interrupt. Polling the touchscreen instead.");
+            touch_input.poll_interval = TOUCH_POLL_INTERVAL;
+        }
 
-        xTaskCreate(touch_task, "touch_task", 4096, arg, 5, NULL);
+        xTaskCreate(touch_input_task, "touch_task", 4096, &touch_input, 5, NULL);
     }
 }
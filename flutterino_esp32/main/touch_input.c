@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "touch_input.h"
+
+void touch_input_init(struct touch_input *input, const struct touch_input_driver *driver, void *driver_context, TickType_t poll_interval) {
+    memset(input, 0, sizeof *input);
+
+    input->driver = *driver;
+    input->driver_context = driver_context;
+    input->poll_interval = poll_interval;
+    input->interrupt = xSemaphoreCreateBinaryStatic(&input->interrupt_buffer);
+}
+
+void touch_input_deinit(struct touch_input *input) {
+    vSemaphoreDelete(input->interrupt);
+}
+
+void touch_input_notify_from_isr(struct touch_input *input) {
+    BaseType_t higher_priority_task_woken = pdFALSE;
+
+    // The semaphore is binary, so INT pulses that arrive before the task
+    // got to read the contact only wake it up once.
+    xSemaphoreGiveFromISR(input->interrupt, &higher_priority_task_woken);
+    if (higher_priority_task_woken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+static void touch_input_sample(struct touch_input *input) {
+    struct flrd_touch_event_packet event;
+    uint16_t x, y;
+    bool pressed;
+
+    pressed = input->driver.read_point(input->driver_context, &x, &y);
+
+    if (pressed && (!input->pressed || x != input->x || y != input->y)) {
+        event.phase = input->pressed ? FLRD_TOUCH_EVENT_PHASE_MOVE : FLRD_TOUCH_EVENT_PHASE_DOWN;
+        event.x = x;
+        event.y = y;
+
+        input->x = x;
+        input->y = y;
+    } else if (input->pressed && !pressed) {
+        // Lifting the finger ends the contact where it was last seen.
+        event.phase = FLRD_TOUCH_EVENT_PHASE_UP;
+        event.x = input->x;
+        event.y = input->y;
+    } else {
+        return;
+    }
+
+    input->pressed = pressed;
+
+    event.pointer = 0;
+    event.timestamp = 0;
+    input->driver.on_touch_event(input->driver_context, &event);
+}
+
+void touch_input_task(void *arg) {
+    struct touch_input *input = (struct touch_input*) arg;
+    TickType_t wait;
+
+    while (true) {
+        if (input->poll_interval != 0) {
+            wait = input->poll_interval;
+        } else if (input->pressed) {
+            wait = pdMS_TO_TICKS(TOUCH_INPUT_RELEASE_TIMEOUT_MS);
+        } else {
+            // Nobody's touching the screen, so there's nothing to read
+            // until the controller asserts INT.
+            wait = portMAX_DELAY;
+        }
+
+        // In polling mode, nothing gives the semaphore, so this is a delay.
+        xSemaphoreTake(input->interrupt, wait);
+
+        touch_input_sample(input);
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef _TOUCH_INPUT_H
+#define _TOUCH_INPUT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "flutter_remote_display.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// While a contact is held, it's read again after this long without an
+// interrupt, in case the controller's INT pulse for the release was missed.
+#ifndef TOUCH_INPUT_RELEASE_TIMEOUT_MS
+#define TOUCH_INPUT_RELEASE_TIMEOUT_MS 50
+#endif
+
+struct touch_input_driver {
+    // Reads the current contact from the touch controller, e.g. using
+    // FocalTech_Class::getPoint. Returns false if the screen isn't touched.
+    bool (*read_point)(void *context, uint16_t *x, uint16_t *y);
+
+    // Called from the touch task for every down, move and up, with the
+    // coordinates the controller reported.
+    void (*on_touch_event)(void *context, struct flrd_touch_event_packet *event);
+};
+
+struct touch_input {
+    struct touch_input_driver driver;
+    void *driver_context;
+
+    // If zero, the contact is only read when touch_input_notify_from_isr
+    // was called. Otherwise, it's read every poll_interval ticks.
+    TickType_t poll_interval;
+
+    SemaphoreHandle_t interrupt;
+    StaticSemaphore_t interrupt_buffer;
+
+    bool pressed;
+    uint16_t x, y;
+};
+
+/// Initializes touch input reading contacts using the given driver.
+///
+/// With a poll_interval of zero, the touch task sleeps until the touch
+/// controller asserts its INT line, which must call
+/// touch_input_notify_from_isr. Otherwise, it reads the contact every
+/// poll_interval ticks, for boards where the INT line isn't available.
+void touch_input_init(struct touch_input *input, const struct touch_input_driver *driver, void *driver_context, TickType_t poll_interval);
+
+void touch_input_deinit(struct touch_input *input);
+
+/// Wakes up the touch task to read the contact. Called from the GPIO
+/// interrupt handler of the touch controllers INT line.
+void touch_input_notify_from_isr(struct touch_input *input);
+
+/// Reads contacts and reports them to the driver, forever.
+/// The argument is the struct touch_input.
+void touch_input_task(void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
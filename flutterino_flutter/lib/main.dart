@@ -119,6 +119,8 @@ class _MyHomePageState extends State<MyHomePage> {
       }
     }
 
+    // Scrolling by copying rects and the tile cache are used if the watch
+    // reports that it has them in PSRAM.
     return await BluetoothDisplayConnection.connect(address);
   }
 